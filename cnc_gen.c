@@ -1,23 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
+#include "toolpath.h"
+#include "layout.h"
+#include "coupon.h"
+
 #define X 0
 #define Y 1
 
 #define ZMODE 0
-#define SIZETEST 0
-#define NUM_SIZETESTS 9
 
-#define CUT()   {if(ZMODE) fprintf(gfile, "G1 Z-5.0\n"); else fprintf(gfile, "M03 S%02d\n", (int)((float)power+extrapower)); extrapower += power_increase_per_cut;}
-#define CUT_PWR(pwr) {if(ZMODE) fprintf(gfile, "G1 Z-5.0\n"); else fprintf(gfile, "M03 S%02d\n", (int)((pwr)*((float)power+extrapower))); extrapower += power_increase_per_cut*(pwr);}
-#define CUT_MARK() {if(ZMODE) fprintf(gfile, "G1 Z-5.0\n"); else fprintf(gfile, "M03 S%02d\n", markpower);}
-#define UNCUT() {if(ZMODE) fprintf(gfile, "G1 Z5.0\n");  else fprintf(gfile, "M05\n");}
+// The main file is generated as a toolpath and put in cutting order at the end (see
+// order_contours()). The power of each cut is planned there, so CUT() and CUT_PWR() only
+// leave the multiplier there, and the S value is set in the final order.
+#define CUT()   {if(ZMODE) tp_text(gpath, "G1 Z-5.0"); else tp_on(gpath, 1.0);}
+#define CUT_PWR(pwr) {if(ZMODE) tp_text(gpath, "G1 Z-5.0"); else tp_on(gpath, (pwr));}
+#define CUT_MARK() {if(ZMODE) tp_text(gpath, "G1 Z-5.0"); else tp_on_abs(gpath, markpower);}
+#define UNCUT() {if(ZMODE) tp_text(gpath, "G1 Z5.0");  else tp_off(gpath);}
+
+#define COVER_CUT()   {if(ZMODE) tp_text(cpath, "G1 Z-5.0"); else tp_on_abs(cpath, cover_power);}
+#define COVER_UNCUT() {if(ZMODE) tp_text(cpath, "G1 Z5.0");  else tp_off(cpath);}
 
-#define COVER_CUT()   {if(ZMODE) fprintf(coverfile, "G1 Z-5.0\n"); else fprintf(coverfile, "M03 S%02d\n", cover_power);}
-#define COVER_UNCUT() {if(ZMODE) fprintf(coverfile, "G1 Z5.0\n");  else fprintf(coverfile, "M05\n");}
+#define delay(tp, dd)	{tp_dwell((tp), (dd));}
 
-#define delay(ff, dd)	{fprintf((ff), "G04 P%.3f\n", (dd));}
+// Each closed contour starts with CONTOUR(), right before its G00. The return to
+// the origin at the end is the TRAILER().
+#define CONTOUR() {tp_contour(gpath);}
+#define TRAILER() {tp_trailer(gpath);}
 
 // Generates main cell board, one side and one front.
 // Run the laser twice to obtain all 6 parts.
@@ -27,9 +38,1045 @@
 // (ALIGNPOINT x_idx;y_idx;x_coord;y_coord) defines the coordinates of the corners
 // of the finished box. idx 0;0 is the bottom-left corner.
 // The box can be aligned against physical restrainers on two edges (typically bottom-left)
+// The same geometry is saved as <prefix>_layout.bin (see layout.h), which weld reads directly.
+
+// Cut order optimization.
+// order_contours() splits the generated main toolpath into the contours marked with
+// CONTOUR() and copies them out in an order that keeps the rapid travel short:
+// nearest neighbour first, then 2-opt within a window of the order. A contour whose
+// bounding box lies inside another one (a cell hole inside the panel outline) is
+// always cut before it, so that a part never drops out before its holes are done.
+// A later pass over a feature (tp_pass(), the bottom mode cleanup of a hole) is cut
+// after the first passes of all the features, so that the feature has cooled by then;
+// heat_run() dwells for the rest of heatmodel.pass_gap if it hasn't.
+// Contours made of full circles only can start anywhere on the circle, so they are
+// entered at the point nearest to where the head comes from.
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TWO_OPT_WINDOW 40
+#define TWO_OPT_PASSES 20
+
+// One stretch of a contour cut with the laser on (M03 ... M05), as points along the
+// path for the heat model.
+typedef struct
+{
+	float mult;        // power multiplier
+	int abs;           // a mark, at its own S word
+	float fixed_dwell; // s, G04 before it in the generated contour
+	float length;
+	int num_pts;
+	int pts_size;
+	float (*pts)[3];   // x, y, length of cut the point stands for
+} piece;
+
+typedef struct
+{
+	int first;         // operations of the toolpath, starting with the G00
+	int op_end;
+	float start[2];
+	float end[2];
+	float min[2];
+	float max[2];
+	int circle;        // full circles around center only
+	float center[2];
+	float radius[2];   // of the first and the last circle
+	int num_outer;     // contours that must be cut after this one
+	int* outer;
+	int follows;       // the contour this one is a later pass over, -1 for none
+	int pass;          // 0 for a first pass, 1 for the second...
+	int num_pieces;
+	piece* pieces;
+	float fixed_dwell; // s, G04 after the last piece
+} contour;
+
+void extend_box(contour* c, float x, float y)
+{
+	if(x < c->min[X]) c->min[X] = x;
+	if(y < c->min[Y]) c->min[Y] = y;
+	if(x > c->max[X]) c->max[X] = x;
+	if(y > c->max[Y]) c->max[Y] = y;
+}
 
-int main(int argc, char** argv)
+void add_path_point(piece* p, float x, float y, float len)
+{
+	if(p->num_pts == p->pts_size)
+	{
+		p->pts_size = p->pts_size?2*p->pts_size:64;
+		p->pts = realloc(p->pts, p->pts_size*sizeof(*p->pts));
+	}
+	p->pts[p->num_pts][0] = x;
+	p->pts[p->num_pts][1] = y;
+	p->pts[p->num_pts][2] = len;
+	p->num_pts++;
+	p->length += len;
+}
+
+// Adds points along a line, or an arc around (cx, cy) when op is OP_CW or OP_CCW.
+void add_path(piece* p, const float* from, float x, float y, int op, float cx, float cy, float spacing)
+{
+	if(!p)
+		return;
+	if(op == OP_LINE)
+	{
+		float len = hypotf(x-from[X], y-from[Y]);
+		int n = (int)(len/spacing)+1;
+		for(int k = 0; k < n; k++)
+			add_path_point(p, from[X]+(x-from[X])*(k+0.5)/n, from[Y]+(y-from[Y])*(k+0.5)/n, len/n);
+		return;
+	}
+	float r = hypotf(from[X]-cx, from[Y]-cy);
+	float a0 = atan2f(from[Y]-cy, from[X]-cx);
+	float a1 = atan2f(y-cy, x-cx);
+	float sweep = (op == OP_CW)?(a0-a1):(a1-a0);
+	while(sweep <= 0.001)
+		sweep += 2.0*M_PI;
+	int n = (int)(r*sweep/spacing)+1;
+	for(int k = 0; k < n; k++)
+	{
+		float a = a0 + ((op == OP_CW)?-1.0:1.0)*sweep*(k+0.5)/n;
+		add_path_point(p, cx+r*cosf(a), cy+r*sinf(a), r*sweep/n);
+	}
+}
+
+// Reads the geometry of a contour. The cut path is sampled at spacing for the heat model.
+void parse_contour(contour* c, const toolpath* tp, int power, float spacing)
+{
+	float pos[2] = {0.0, 0.0};
+	int num_arcs = 0;
+	piece* cur = NULL;   // laser on
+	float dwell = 0.0;   // G04 since the last piece
+	c->circle = 1;
+	c->min[X] = c->min[Y] = 1e9;
+	c->max[X] = c->max[Y] = -1e9;
+
+	for(int k = c->first; k < c->op_end; k++)
+	{
+		int op = tp->op[k];
+		int has_xy = (tp->words[k] & (W_X|W_Y)) == (W_X|W_Y);
+		float x = tp->pos[k][X], y = tp->pos[k][Y];
+
+		if(op == OP_ON)
+		{
+			c->pieces = realloc(c->pieces, (c->num_pieces+1)*sizeof(piece));
+			cur = &c->pieces[c->num_pieces++];
+			memset(cur, 0, sizeof(piece));
+			cur->mult = (tp->words[k] & W_ABS)?(tp->value[k]/power):tp->value[k];
+			cur->abs = (tp->words[k] & W_ABS) != 0;
+			cur->fixed_dwell = dwell;
+			dwell = 0.0;
+		}
+		else if(op == OP_OFF)
+			cur = NULL;
+		else if(op == OP_DWELL)
+			dwell += tp->value[k];
+		else if(op == OP_RAPID && has_xy)
+		{
+			if(k == c->first)
+				{c->start[X] = x; c->start[Y] = y;}
+			pos[X] = x; pos[Y] = y;
+			extend_box(c, x, y);
+		}
+		else if(op == OP_LINE && has_xy)
+		{
+			c->circle = 0;
+			add_path(cur, pos, x, y, op, 0.0, 0.0, spacing);
+			pos[X] = x; pos[Y] = y;
+			extend_box(c, x, y);
+		}
+		else if((op == OP_CW || op == OP_CCW) && has_xy)
+		{
+			float i = tp->arc[k][0], j = tp->arc[k][1];
+			float cx = pos[X]+i, cy = pos[Y]+j;
+			float r = hypotf(i, j);
+			if(fabsf(x-pos[X]) > 0.005 || fabsf(y-pos[Y]) > 0.005)
+				c->circle = 0; // not a full circle
+			if(num_arcs && (fabsf(cx-c->center[X]) > 0.015 || fabsf(cy-c->center[Y]) > 0.015))
+				c->circle = 0;
+			if(!num_arcs)
+				{c->center[X] = cx; c->center[Y] = cy; c->radius[0] = r;}
+			c->radius[1] = r;
+			num_arcs++;
+			extend_box(c, cx-r, cy-r);
+			extend_box(c, cx+r, cy+r);
+			add_path(cur, pos, x, y, op, cx, cy, spacing);
+			pos[X] = x; pos[Y] = y;
+		}
+	}
+	c->fixed_dwell = dwell;
+	if(!num_arcs)
+		c->circle = 0;
+	c->end[X] = pos[X];
+	c->end[Y] = pos[Y];
+}
+
+// Direction in which a circle contour is entered, coming from "from".
+void circle_dir(const contour* c, const float* from, float* u)
+{
+	float dx = from[X]-c->center[X], dy = from[Y]-c->center[Y];
+	float d = hypotf(dx, dy);
+	if(d < 0.001)
+		{dx = c->start[X]-c->center[X]; dy = c->start[Y]-c->center[Y]; d = hypotf(dx, dy);}
+	u[X] = dx/d;
+	u[Y] = dy/d;
+}
+
+// Rapid distance to contour c from "from". Sets where the head is once c is cut
+// (exit may be the same array as from). With rotate = 0, circles are entered where
+// they were generated.
+float contour_rapid(const contour* c, const float* from, float* exit, int rotate)
+{
+	float d;
+	if(!c->circle || !rotate)
+	{
+		d = hypotf(c->start[X]-from[X], c->start[Y]-from[Y]);
+		exit[X] = c->end[X];
+		exit[Y] = c->end[Y];
+		return d;
+	}
+	float u[2];
+	circle_dir(c, from, u);
+	d = fabsf(hypotf(from[X]-c->center[X], from[Y]-c->center[Y]) - c->radius[0]);
+	exit[X] = c->center[X] + c->radius[1]*u[X];
+	exit[Y] = c->center[Y] + c->radius[1]*u[Y];
+	return d;
+}
+
+double order_rapids(const contour* cs, const int* order, int n, const float* from, const float* to, int rotate)
+{
+	float pos[2] = {from[X], from[Y]};
+	double total = 0.0;
+	for(int k = 0; k < n; k++)
+		total += contour_rapid(&cs[order[k]], pos, pos, rotate);
+	return total + hypotf(to[X]-pos[X], to[Y]-pos[Y]);
+}
+
+// Copies one contour to out, rotated to the entry point if it is a circle contour. The
+// dwell and the S word planned for each piece go before it; with plan, they replace the
+// G04s of the contour, else they come on top of them. See heat_run().
+void write_contour(toolpath* out, const toolpath* tp, const contour* c, const float* from, int rotate, int plan,
+	const float* dwells, const int* powers)
 {
+	int num_pieces = 0;
+	int rotated = c->circle && rotate;
+	float u[2] = {0.0, 0.0};
+	if(rotated)
+		circle_dir(c, from, u);
+
+	for(int k = c->first; k < c->op_end; k++)
+	{
+		int op = tp->op[k];
+		if(op == OP_ON && dwells[num_pieces] > 0.0)
+			delay(out, dwells[num_pieces]);
+		if(plan && op == OP_DWELL)
+			continue;
+
+		int n = tp_copy(out, tp, k);
+		if(op == OP_ON)
+		{
+			out->value[n] = powers[num_pieces++];
+			out->words[n] |= W_ABS;
+		}
+		else if(rotated && op == OP_RAPID && (tp->words[k] & W_X))
+		{
+			// Rapid to the start of the circle that follows.
+			float r = c->radius[0];
+			for(int next = k+1; next < c->op_end; next++)
+			{
+				if(tp->op[next] == OP_CW || tp->op[next] == OP_CCW)
+				{
+					r = hypotf(tp->arc[next][0], tp->arc[next][1]);
+					break;
+				}
+			}
+			out->pos[n][X] = c->center[X]+r*u[X];
+			out->pos[n][Y] = c->center[Y]+r*u[Y];
+		}
+		else if(rotated && (op == OP_CW || op == OP_CCW))
+		{
+			float r = hypotf(tp->arc[k][0], tp->arc[k][1]);
+			out->pos[n][X] = c->center[X]+r*u[X];
+			out->pos[n][Y] = c->center[Y]+r*u[Y];
+			out->arc[n][0] = c->center[X]-out->pos[n][X];
+			out->arc[n][1] = c->center[Y]-out->pos[n][Y];
+		}
+	}
+}
+
+// Common-line cutting.
+// With the parts placed one kerf (2*lasertrim) apart, the edges that face each other are
+// cut on the same line (see default_place()). share_lines() finds the cuts along X or Y
+// that run over a stretch an earlier contour already cuts and leaves the stretch out:
+// the laser goes off, the head rapids over it and the cut resumes behind it. Stretches
+// shorter than SHARE_MIN_LEN are cut twice, they don't pay for the extra M05/M03.
+
+#define SHARE_MIN_LEN 1.0
+#define SHARE_TOL 0.005 // mm between cuts on the same line
+
+typedef struct
+{
+	int op;
+	int tag;
+	int axis;  // the coordinate that changes: X for a horizontal cut
+	float at;  // the other one
+	float lo, hi;
+} cutline;
+
+static int cmp_cutline(const void* a, const void* b)
+{
+	const cutline* p = a;
+	const cutline* q = b;
+	if(p->axis != q->axis)
+		return p->axis - q->axis;
+	if(p->at != q->at)
+		return (p->at < q->at)?-1:1;
+	return (p->lo < q->lo)?-1:(p->lo > q->lo);
+}
+
+static int cmp_skip(const void* a, const void* b)
+{
+	const cutline* p = a;
+	const cutline* q = b;
+	if(p->op != q->op)
+		return p->op - q->op;
+	return (p->lo < q->lo)?-1:(p->lo > q->lo);
+}
+
+// Copies tp to out without the stretches cut twice. Returns their length.
+float share_lines(const toolpath* tp, toolpath* out)
+{
+	// The straight cuts through the sheet, marks don't count.
+	cutline* cuts = malloc((tp->num+1)*sizeof(cutline));
+	int num_cuts = 0;
+	float pos[2] = {0.0, 0.0};
+	int on = 0;
+	for(int k = 0; k < tp->num; k++)
+	{
+		int op = tp->op[k];
+		if(op == OP_ON)
+			on = !(tp->words[k] & W_ABS);
+		else if(op == OP_OFF)
+			on = 0;
+		if((tp->words[k] & (W_X|W_Y)) != (W_X|W_Y))
+			continue;
+		const float* p = tp->pos[k];
+		for(int a = X; a <= Y && op == OP_LINE && on && tp->tag[k] > 0; a++)
+		{
+			if(fabsf(p[!a]-pos[!a]) < 0.0005 && fabsf(p[a]-pos[a]) > 0.0005)
+			{
+				cutline* c = &cuts[num_cuts++];
+				c->op = k;
+				c->tag = tp->tag[k];
+				c->axis = a;
+				c->at = p[!a];
+				c->lo = fminf(p[a], pos[a]);
+				c->hi = fmaxf(p[a], pos[a]);
+			}
+		}
+		pos[X] = p[X];
+		pos[Y] = p[Y];
+	}
+
+	// Where a cut runs along one of an earlier contour, on the same line.
+	qsort(cuts, num_cuts, sizeof(cutline), cmp_cutline);
+	cutline* skips = malloc((num_cuts+1)*sizeof(cutline));
+	int num_skips = 0;
+	for(int i = 0; i < num_cuts; i++)
+	{
+		cutline* c = &cuts[i];
+		for(int dir = -1; dir <= 1; dir += 2)
+		{
+			for(int j = i+dir; j >= 0 && j < num_cuts; j += dir)
+			{
+				const cutline* e = &cuts[j];
+				if(e->axis != c->axis || fabsf(e->at - c->at) > SHARE_TOL)
+					break;
+				float lo = fmaxf(c->lo, e->lo), hi = fminf(c->hi, e->hi);
+				if(e->tag < c->tag && hi - lo >= SHARE_MIN_LEN)
+				{
+					skips[num_skips] = *c;
+					skips[num_skips].lo = lo;
+					skips[num_skips].hi = hi;
+					num_skips++;
+				}
+			}
+		}
+	}
+	qsort(skips, num_skips, sizeof(cutline), cmp_skip);
+
+	// Merge the overlapping ones.
+	int n = 0;
+	float shared = 0.0;
+	for(int i = 0; i < num_skips; i++)
+	{
+		if(n && skips[n-1].op == skips[i].op && skips[i].lo <= skips[n-1].hi)
+			skips[n-1].hi = fmaxf(skips[n-1].hi, skips[i].hi);
+		else
+			skips[n++] = skips[i];
+	}
+	num_skips = n;
+	for(int i = 0; i < num_skips; i++)
+		shared += skips[i].hi - skips[i].lo;
+
+	// Copy, turning the laser off over the skipped stretches.
+	int s = 0;
+	int last_on = -1;   // M03 in out of the cut in progress
+	int on_src = -1;    // M03 in tp it copies
+	int need_on = 0;    // off over a stretch, back on at the next cut
+	pos[X] = pos[Y] = 0.0;
+	for(int k = 0; k < tp->num; k++)
+	{
+		int op = tp->op[k];
+		if(op == OP_ON)
+		{
+			last_on = tp_copy(out, tp, k);
+			on_src = k;
+			need_on = 0;
+			continue;
+		}
+		if(op == OP_OFF && need_on)
+		{
+			need_on = 0; // already off
+			continue;
+		}
+		if(op == OP_OFF)
+			last_on = -1;
+
+		int cut = (op == OP_LINE || op == OP_CW || op == OP_CCW);
+		int first = s;
+		while(s < num_skips && skips[s].op == k)
+			s++;
+		if(first == s)
+		{
+			if(cut && need_on)
+			{
+				last_on = tp_copy(out, tp, on_src);
+				need_on = 0;
+			}
+			tp_copy(out, tp, k);
+		}
+		else
+		{
+			// Go through the stretches in the direction of the cut.
+			int a = skips[first].axis;
+			const float* to = tp->pos[k];
+			int up = to[a] > pos[a];
+			int last = -1;
+			for(int i = 0; i < s-first; i++)
+			{
+				const cutline* sk = &skips[up?(first+i):(s-1-i)];
+				float enter = up?sk->lo:sk->hi, leave = up?sk->hi:sk->lo;
+				if(fabsf(enter - pos[a]) > 0.0005)
+				{
+					if(need_on)
+					{
+						last_on = tp_copy(out, tp, on_src);
+						need_on = 0;
+					}
+					last = tp_copy(out, tp, k);
+					out->pos[last][a] = enter;
+					out->text[last] = -1;
+				}
+				if(!need_on)
+				{
+					if(last_on == out->num-1)
+						out->num--; // nothing cut since the M03
+					else
+						out->tag[tp_off(out)] = tp->tag[k];
+					last_on = -1;
+					need_on = 1;
+				}
+				pos[a] = leave;
+				last = tp_rapid(out, pos[X], pos[Y]);
+				out->tag[last] = tp->tag[k];
+			}
+			if(fabsf(to[a] - pos[a]) > 0.0005)
+			{
+				last_on = tp_copy(out, tp, on_src);
+				need_on = 0;
+				last = tp_copy(out, tp, k);
+			}
+			else if(tp->text[k] >= 0)
+				out->text[last] = tp_pool_add(out, tp->pool+tp->text[k], strlen(tp->pool+tp->text[k]));
+		}
+
+		if((tp->words[k] & (W_X|W_Y)) == (W_X|W_Y))
+		{
+			pos[X] = tp->pos[k][X];
+			pos[Y] = tp->pos[k][Y];
+		}
+	}
+	tp_copy_contours(out, tp);
+
+	free(cuts);
+	free(skips);
+	return shared;
+}
+
+// Dwell planner.
+// The fixed G04 dwells after the cuts are replaced by what a coarse heat model of the
+// sheet asks for: every cut puts heat into the grid cells along its path, the grid
+// diffuses and loses heat to the air, and a cut may only start when the hottest point
+// on its path is within the budget. Before dwelling, the next few contours in the
+// order are tried, and a cool one is cut first instead.
+//
+// Power planner.
+// The S word of each cut comes from the same run: the tube warms up while the laser
+// is on and cools off towards the coolant while it's off, and loses output as it warms,
+// which the power makes up for. A cut on warm sheet needs a bit less. When a cut
+// would need more than the controller takes, the head waits for the tube to cool
+// until it fits, and only then is the power clamped.
+
+typedef struct
+{
+	float cell;          // mm, grid resolution
+	float heat_per_mm;   // K, rise of a grid cell per mm of cut in it at power multiplier 1
+	float diffusivity;   // mm^2/s
+	float cooling;       // s, time constant of the losses to air and to the bed
+	float budget;        // K above ambient, hottest point allowed on a cut when it starts
+	                     // (0: the hottest it gets with the fixed dwells)
+	float max_dwell;     // s
+	int lookahead;       // contours tried before dwelling
+	float pass_gap;      // s, least time between two passes over the same feature
+} heatmodel;
+
+typedef struct
+{
+	float heat_rate;     // K/s, the tube warms at power multiplier 1
+	float cooling;       // s, time constant towards the coolant
+	float loss;          // output lost per K of the tube
+	float sheet_gain;    // power saved per K of the sheet along the cut
+	int max_power;       // S range of the controller
+	int min_power;
+	float max_wait;      // s, longest wait for the tube before a cut
+} tubemodel;
+
+// Tube temperature (K above the coolant) after running for seconds at multiplier mult.
+float tube_advance(const tubemodel* tm, float t, float mult, float seconds)
+{
+	float steady = tm->heat_rate*mult*tm->cooling;
+	return steady + (t - steady)*expf(-seconds/tm->cooling);
+}
+
+// Output of the tube at temperature t, relative to a cold one.
+float tube_output(const tubemodel* tm, float t)
+{
+	float out = 1.0 - tm->loss*t;
+	return (out < 0.2)?0.2:out;
+}
+
+// S for a piece at multiplier mult over sheet at temperature sheet_t.
+float tube_power(const tubemodel* tm, int power, float mult, float tube_t, float sheet_t)
+{
+	float sheet = 1.0 - tm->sheet_gain*sheet_t;
+	if(sheet < 0.5)
+		sheet = 0.5;
+	return mult*power*sheet/tube_output(tm, tube_t);
+}
+
+typedef struct
+{
+	int w, h;
+	float origin[2];
+	float* t;            // K above ambient
+	float* next;
+	float dt;            // s, diffusion step
+	float pending;       // s, not yet stepped
+	float loss;          // per step
+	float spread;        // per step
+} heatgrid;
+
+void heat_init(heatgrid* g, const heatmodel* hm, const float* min, const float* max)
+{
+	g->origin[X] = min[X] - 2.0*hm->cell;
+	g->origin[Y] = min[Y] - 2.0*hm->cell;
+	g->w = (int)((max[X]-min[X])/hm->cell)+5;
+	g->h = (int)((max[Y]-min[Y])/hm->cell)+5;
+	g->t = calloc(g->w*g->h, sizeof(float));
+	g->next = calloc(g->w*g->h, sizeof(float));
+	// Explicit scheme: stable below cell^2/(4*diffusivity).
+	g->dt = 0.2*hm->cell*hm->cell/hm->diffusivity;
+	if(g->dt > 0.5)
+		g->dt = 0.5;
+	g->spread = hm->diffusivity*g->dt/(hm->cell*hm->cell);
+	g->loss = expf(-g->dt/hm->cooling);
+	g->pending = 0.0;
+}
+
+void heat_free(heatgrid* g)
+{
+	free(g->t);
+	free(g->next);
+}
+
+float* heat_cell(heatgrid* g, const heatmodel* hm, float x, float y)
+{
+	int cx = (int)((x-g->origin[X])/hm->cell);
+	int cy = (int)((y-g->origin[Y])/hm->cell);
+	if(cx < 0) cx = 0; else if(cx >= g->w) cx = g->w-1;
+	if(cy < 0) cy = 0; else if(cy >= g->h) cy = g->h-1;
+	return &g->t[cy*g->w+cx];
+}
+
+void heat_step(heatgrid* g)
+{
+	int w = g->w, h = g->h;
+	for(int y = 0; y < h; y++)
+	{
+		const float* row = &g->t[y*w];
+		const float* up = (y > 0)?(row-w):row;
+		const float* down = (y < h-1)?(row+w):row;
+		float* out = &g->next[y*w];
+		for(int x = 0; x < w; x++)
+		{
+			float left = row[(x > 0)?(x-1):x];
+			float right = row[(x < w-1)?(x+1):x];
+			out[x] = (row[x] + g->spread*(left+right+up[x]+down[x]-4.0*row[x]))*g->loss;
+		}
+	}
+	float* tmp = g->t;
+	g->t = g->next;
+	g->next = tmp;
+}
+
+void heat_advance(heatgrid* g, float seconds)
+{
+	g->pending += seconds;
+	while(g->pending >= g->dt)
+	{
+		heat_step(g);
+		g->pending -= g->dt;
+	}
+}
+
+float piece_peak(heatgrid* g, const heatmodel* hm, const piece* p)
+{
+	float peak = 0.0;
+	for(int k = 0; k < p->num_pts; k++)
+	{
+		float t = *heat_cell(g, hm, p->pts[k][0], p->pts[k][1]);
+		if(t > peak)
+			peak = t;
+	}
+	return peak;
+}
+
+// Mean temperature along the path.
+float piece_mean(heatgrid* g, const heatmodel* hm, const piece* p)
+{
+	float sum = 0.0;
+	for(int k = 0; k < p->num_pts; k++)
+		sum += *heat_cell(g, hm, p->pts[k][0], p->pts[k][1])*p->pts[k][2];
+	return (p->length > 0.0)?(sum/p->length):0.0;
+}
+
+// Heat of the cut at multiplier mult.
+void piece_heat(heatgrid* g, const heatmodel* hm, const piece* p, float mult)
+{
+	for(int k = 0; k < p->num_pts; k++)
+		*heat_cell(g, hm, p->pts[k][0], p->pts[k][1]) += hm->heat_per_mm*mult*p->pts[k][2];
+}
+
+// Lets the sheet cool until piece p can be cut. Returns the dwell.
+float piece_cool(heatgrid* g, const heatmodel* hm, const piece* p)
+{
+	float dwell = 0.0;
+	while(piece_peak(g, hm, p) > hm->budget && dwell < hm->max_dwell)
+	{
+		heat_advance(g, g->dt);
+		dwell += g->dt;
+	}
+	return dwell;
+}
+
+typedef struct
+{
+	double dwell;
+	double time;
+	double rapids;
+	float peak;          // hottest point on a cut when it started
+	int moved;           // contours cut ahead of the order to avoid a dwell
+	int min_power, max_power;
+	float tube_peak;     // K
+	double wait;         // s, for the tube to cool
+	int waits;
+	int clamped;         // cuts that needed more than max_power even after the wait
+} heatrun;
+
+// Runs the contours of tp through the heat model in order, with the fixed dwells or
+// (plan) with planned ones, plans the power of each piece, and copies them to out
+// unless it is NULL. With plan, order is changed to the order that was cut.
+void heat_run(heatrun* r, const toolpath* tp, contour* cs, int* order, int n, int plan, int rotate, const heatmodel* hm,
+	const tubemodel* tm, const float* min, const float* max, const float* home, const float* last,
+	float feedrate, float rapid_rate, toolpath* out, int power)
+{
+	heatgrid g;
+	heat_init(&g, hm, min, max);
+	memset(r, 0, sizeof(*r));
+	r->min_power = tm->max_power;
+	float tube = 0.0;
+	int* powers = NULL;
+
+	int* inner_left = calloc(n, sizeof(int));
+	int* done = calloc(n, sizeof(int));
+	int* cut_order = malloc(n*sizeof(int));
+	float* end_time = calloc(n, sizeof(float));
+	float* dwells = NULL;
+	for(int a = 0; a < n; a++)
+		for(int o = 0; o < cs[a].num_outer; o++)
+			inner_left[cs[a].outer[o]]++;
+
+	float pos[2] = {home[X], home[Y]};
+	for(int k = 0; k < n; k++)
+	{
+		// The next contour in the order, or a cooler one a bit further on.
+		int pick = -1, first = -1, tried = 0;
+		if(!plan)
+			pick = first = order[k];
+		for(int m = 0; m < n && tried < hm->lookahead && pick < 0; m++)
+		{
+			int c = order[m];
+			if(done[c] || inner_left[c])
+				continue;
+			if(first < 0)
+				first = c;
+			tried++;
+			if(!cs[c].num_pieces || piece_peak(&g, hm, &cs[c].pieces[0]) <= hm->budget)
+				{pick = c; break;}
+		}
+		if(pick < 0)
+			pick = first;
+		if(pick != first)
+			r->moved++;
+
+		contour* c = &cs[pick];
+		cut_order[k] = pick;
+		done[pick] = 1;
+		for(int o = 0; o < c->num_outer; o++)
+			inner_left[c->outer[o]]--;
+
+		float from[2] = {pos[X], pos[Y]};
+		float d = contour_rapid(c, from, pos, rotate);
+		r->rapids += d;
+		heat_advance(&g, d*60.0/rapid_rate);
+		tube = tube_advance(tm, tube, 0.0, d*60.0/rapid_rate);
+		r->time += d*60.0/rapid_rate;
+
+		// A later pass waits for the feature to have had pass_gap since the pass before,
+		// which the order mostly takes care of by cutting the first passes everywhere first.
+		float gap = 0.0;
+		if(c->follows >= 0 && r->time - end_time[c->follows] < hm->pass_gap)
+		{
+			gap = hm->pass_gap - (r->time - end_time[c->follows]);
+			heat_advance(&g, gap);
+			tube = tube_advance(tm, tube, 0.0, gap);
+			r->time += gap;
+			r->dwell += gap;
+		}
+
+		dwells = realloc(dwells, (c->num_pieces+1)*sizeof(float));
+		powers = realloc(powers, (c->num_pieces+1)*sizeof(int));
+		for(int i = 0; i < c->num_pieces; i++)
+		{
+			const piece* p = &c->pieces[i];
+			float dwell = p->fixed_dwell;
+			if(plan)
+				dwell = piece_cool(&g, hm, p);
+			else
+				heat_advance(&g, dwell);
+			tube = tube_advance(tm, tube, 0.0, dwell);
+
+			// Marks keep their own power (W_ABS), the cuts get the planned one.
+			float mult = p->mult, wait = 0.0;
+			if(p->abs)
+				powers[i] = (int)(p->mult*power+0.5);
+			else
+			{
+				float s = tube_power(tm, power, p->mult, tube, piece_mean(&g, hm, p));
+				while(s > tm->max_power && wait < tm->max_wait)
+				{
+					heat_advance(&g, g.dt);
+					tube = tube_advance(tm, tube, 0.0, g.dt);
+					wait += g.dt;
+					s = tube_power(tm, power, p->mult, tube, piece_mean(&g, hm, p));
+				}
+				if(wait > 0.0)
+					{r->wait += wait; r->waits++;}
+				int si = (int)(s+0.5);
+				if(si > tm->max_power)
+					{si = tm->max_power; r->clamped++;}
+				if(si < tm->min_power)
+					si = tm->min_power;
+				if(si < r->min_power) r->min_power = si;
+				if(si > r->max_power) r->max_power = si;
+				powers[i] = si;
+				mult = (float)si/power*tube_output(tm, tube); // what reaches the sheet
+			}
+			dwells[i] = plan?(dwell+wait):wait; // the fixed G04s stay in
+			if(i == 0)
+				dwells[i] += gap;
+			dwell += wait;
+
+			float peak = piece_peak(&g, hm, p);
+			if(peak > r->peak)
+				r->peak = peak;
+			piece_heat(&g, hm, p, mult);
+			heat_advance(&g, p->length*60.0/feedrate);
+			tube = tube_advance(tm, tube, mult, p->length*60.0/feedrate);
+			if(tube > r->tube_peak)
+				r->tube_peak = tube;
+			r->time += dwell + p->length*60.0/feedrate;
+			r->dwell += dwell;
+		}
+		end_time[pick] = r->time;
+		if(!plan)
+		{
+			heat_advance(&g, c->fixed_dwell);
+			tube = tube_advance(tm, tube, 0.0, c->fixed_dwell);
+			r->time += c->fixed_dwell;
+			r->dwell += c->fixed_dwell;
+		}
+
+		if(out)
+			write_contour(out, tp, c, from, rotate, plan, dwells, powers);
+	}
+	r->rapids += hypotf(last[X]-pos[X], last[Y]-pos[Y]);
+
+	if(plan)
+		memcpy(order, cut_order, n*sizeof(int));
+	free(inner_left);
+	free(done);
+	free(cut_order);
+	free(end_time);
+	free(dwells);
+	free(powers);
+	heat_free(&g);
+}
+
+// Copies the generated main toolpath tp to out with the contours in order, with planned
+// dwells unless fixed_dwells, and with planned power. Returns the highest S written.
+int order_contours(const toolpath* tp, toolpath* out, int reorder, int fixed_dwells, int power,
+	float feedrate, float rapid_rate, const heatmodel* hm, const tubemodel* tm)
+{
+	// Split into preamble, contours and trailer.
+	int n = tp->num_tags;
+	contour* cs = calloc(n, sizeof(contour));
+	int preamble_end = -1, trailer = -1;
+	for(int k = 0; k < tp->num; k++)
+	{
+		int tag = tp->tag[k];
+		if(tag > 0 && tag <= n)
+		{
+			contour* c = &cs[tag-1];
+			if(!c->op_end)
+				c->first = k;
+			c->op_end = k+1;
+			if(preamble_end < 0)
+				preamble_end = k;
+		}
+		else if(tag == TAG_TRAILER && trailer < 0)
+			trailer = k;
+	}
+	if(!n || trailer < 0)
+	{
+		printf("Internal error: contours not marked\n");
+		for(int k = 0; k < tp->num; k++)
+			tp_copy(out, tp, k);
+		free(cs);
+		return power;
+	}
+
+	for(int k = 0; k < n; k++)
+	{
+		parse_contour(&cs[k], tp, power, hm->cell/2.0);
+		cs[k].follows = (tp->follows[k] > 0 && tp->follows[k] <= k)?tp->follows[k]-1:-1;
+		cs[k].pass = (cs[k].follows >= 0)?cs[cs[k].follows].pass+1:0;
+	}
+
+	// Contours inside another one come first. A later pass comes after the one before it,
+	// even if it lies inside.
+	for(int a = 0; a < n; a++)
+		cs[a].outer = malloc(n*sizeof(int));
+	for(int a = 0; a < n; a++)
+	{
+		if(cs[a].follows >= 0)
+			cs[cs[a].follows].outer[cs[cs[a].follows].num_outer++] = a;
+		for(int b = 0; b < n; b++)
+		{
+			if(a == b || cs[a].follows == b || cs[b].follows == a)
+				continue;
+			if(cs[a].min[X] >= cs[b].min[X] && cs[a].min[Y] >= cs[b].min[Y] &&
+				cs[a].max[X] <= cs[b].max[X] && cs[a].max[Y] <= cs[b].max[Y] &&
+				(cs[a].max[X]-cs[a].min[X])*(cs[a].max[Y]-cs[a].min[Y]) < (cs[b].max[X]-cs[b].min[X])*(cs[b].max[Y]-cs[b].min[Y]))
+			{
+				cs[a].outer[cs[a].num_outer++] = b;
+			}
+		}
+	}
+
+	float home[2] = {0.0, 0.0};
+	float last[2] = {0.0, 0.0};
+	if(tp->op[trailer] == OP_RAPID && (tp->words[trailer] & W_X))
+		{last[X] = tp->pos[trailer][X]; last[Y] = tp->pos[trailer][Y];}
+
+	int* order = calloc(n, sizeof(int));
+	int* pos_of = malloc(n*sizeof(int));
+	for(int k = 0; k < n; k++)
+		order[k] = k;
+	double rapids_before = order_rapids(cs, order, n, home, last, 0);
+
+	if(reorder)
+	{
+		// Nearest neighbour among the contours whose inner contours are all done, the
+		// first passes before the second ones, so that a feature cools in between.
+		int* inner_left = calloc(n, sizeof(int));
+		int* done = calloc(n, sizeof(int));
+		for(int a = 0; a < n; a++)
+			for(int o = 0; o < cs[a].num_outer; o++)
+				inner_left[cs[a].outer[o]]++;
+
+		float pos[2] = {home[X], home[Y]};
+		for(int k = 0; k < n; k++)
+		{
+			int best = -1;
+			float best_d = 0.0, exit[2];
+			for(int c = 0; c < n; c++)
+			{
+				if(done[c] || inner_left[c])
+					continue;
+				float d = contour_rapid(&cs[c], pos, exit, 1);
+				if(best < 0 || cs[c].pass < cs[best].pass || (cs[c].pass == cs[best].pass && d < best_d))
+					{best = c; best_d = d;}
+			}
+			order[k] = best;
+			done[best] = 1;
+			for(int o = 0; o < cs[best].num_outer; o++)
+				inner_left[cs[best].outer[o]]--;
+			contour_rapid(&cs[best], pos, pos, 1);
+		}
+		free(inner_left);
+		free(done);
+
+		// 2-opt: reverse a stretch of the order where that keeps the inner contours first,
+		// within the stretches of one pass.
+		double cur = order_rapids(cs, order, n, home, last, 1);
+		for(int pass = 0; pass < TWO_OPT_PASSES; pass++)
+		{
+			int improved = 0;
+			for(int k = 0; k < n; k++)
+				pos_of[order[k]] = k;
+
+			for(int i = 0; i < n-1; i++)
+			{
+				for(int j = i+1; j < n && j <= i+TWO_OPT_WINDOW; j++)
+				{
+					int valid = 1;
+					for(int k = i; k <= j && valid; k++)
+					{
+						if(cs[order[k]].pass != cs[order[i]].pass)
+							valid = 0;
+						for(int o = 0; o < cs[order[k]].num_outer; o++)
+							if(pos_of[cs[order[k]].outer[o]] >= i && pos_of[cs[order[k]].outer[o]] <= j)
+								{valid = 0; break;}
+					}
+					if(!valid)
+						break; // a longer stretch from i contains the same pair
+
+					for(int a = i, b = j; a < b; a++, b--)
+						{int t = order[a]; order[a] = order[b]; order[b] = t;}
+					double d = order_rapids(cs, order, n, home, last, 1);
+					if(d < cur - 0.01)
+					{
+						cur = d;
+						improved = 1;
+						for(int k = i; k <= j; k++)
+							pos_of[order[k]] = k;
+					}
+					else
+					{
+						for(int a = i, b = j; a < b; a++, b--)
+							{int t = order[a]; order[a] = order[b]; order[b] = t;}
+					}
+				}
+			}
+			if(!improved)
+				break;
+		}
+	}
+
+	double rapids_after = order_rapids(cs, order, n, home, last, reorder);
+	printf("%u contours. Rapid travel %.0f mm in generation order, %.0f mm %s", n, rapids_before, rapids_after,
+		reorder?"ordered":"kept");
+	if(reorder)
+		printf(": saves %.0f mm, %.1f s at %.0f mm/min", rapids_before-rapids_after, (rapids_before-rapids_after)*60.0/rapid_rate, rapid_rate);
+	printf("\n");
+
+	float min[2] = {1e9, 1e9}, max[2] = {-1e9, -1e9};
+	for(int k = 0; k < n; k++)
+	{
+		for(int d = X; d <= Y; d++)
+		{
+			if(cs[k].min[d] < min[d]) min[d] = cs[k].min[d];
+			if(cs[k].max[d] > max[d]) max[d] = cs[k].max[d];
+		}
+	}
+
+	// Write out, running the heat model on the way.
+	heatrun fixed, planned;
+	for(int k = 0; k < preamble_end; k++)
+		tp_copy(out, tp, k);
+	if(fixed_dwells)
+	{
+		heat_run(&fixed, tp, cs, order, n, 0, reorder, hm, tm, min, max, home, last, feedrate, rapid_rate,
+			out, power);
+	}
+	else
+	{
+		heat_run(&fixed, tp, cs, order, n, 0, reorder, hm, tm, min, max, home, last, feedrate, rapid_rate,
+			NULL, power);
+		heatmodel budgeted = *hm;
+		if(budgeted.budget <= 0.0)
+			budgeted.budget = fixed.peak;
+		heat_run(&planned, tp, cs, order, n, 1, reorder, &budgeted, tm, min, max, home, last, feedrate, rapid_rate,
+			out, power);
+	}
+	const heatrun* r = fixed_dwells?&fixed:&planned;
+	for(int k = trailer; k < tp->num; k++)
+		tp_copy(out, tp, k);
+
+	printf("Dwell after cuts: fixed %.0f s, hottest cut start %.1f K", fixed.dwell, fixed.peak);
+	if(!fixed_dwells)
+	{
+		printf("; planned %.0f s, hottest cut start %.1f K (budget %.1f K)\n", planned.dwell, planned.peak,
+			(hm->budget > 0.0)?hm->budget:fixed.peak);
+		printf("%u contours cut ahead of the order to avoid a dwell, rapid travel %.0f mm\n", planned.moved, planned.rapids);
+		printf("Cutting time estimate %.0f s -> %.0f s", fixed.time, planned.time);
+	}
+	printf("\n");
+	printf("Power S%02d..S%02d for tube up to %.1f K", r->min_power, r->max_power, r->tube_peak);
+	if(r->waits)
+		printf(", %u cuts wait %.0f s in total for the tube to cool", r->waits, r->wait);
+	printf("\n");
+	if(r->clamped)
+		printf("Warning: %u cuts clamped at S%02d, they may not cut through\n", r->clamped, tm->max_power);
+
+	for(int k = 0; k < n; k++)
+	{
+		for(int i = 0; i < cs[k].num_pieces; i++)
+			free(cs[k].pieces[i].pts);
+		free(cs[k].pieces);
+		free(cs[k].outer);
+	}
+	int max_power = r->max_power;
+	free(cs);
+	free(order);
+	free(pos_of);
+	return max_power;
+}
+
+// Parameters. The pack size is given on the command line.
 
 	float part_separation = 2.0; // clearance between main board, side and front
 	float thickness = 3.0; // Thickness of the material.
@@ -37,13 +1084,9 @@ int main(int argc, char** argv)
 
 	float cell_length = 65.0;
 	float hole = 18.43;
-	float sizetests[NUM_SIZETESTS] = {-0.20, -0.15, -0.1, -0.05, 0, 0.05, 0.1, 0.15, 0.20};
-//	float sizetests[NUM_SIZETESTS] = {-4.0, -3.0, -2.0, -1.0, 0, 1.0, 2.0, 3.0, 4.0};
 	float wallgaps[4] = {4.0, 20.5-18.43, 4.0, 3.15};
-	float cellgap = 20.5-hole;
+	float cellgap; // 20.5-hole
 
-	int ys[2];
-	int x;
 	float bonushole = 2.5;
 	float bonushole_dist = 1.3; // gap to cell hole
 
@@ -54,11 +1097,11 @@ int main(int argc, char** argv)
 
 	float feedrate = 530.0;
 	int power = 73; // 70 -> 20 mA
-	float extrapower = 0.0;
-	float power_increase_per_cut = 0.04;  // 0.03
 	float vertical_power_mult = 1.05;
 	int markpower = 4;
 	float lasertrim = 0.12; // How much excess does the laser burn.
+	float rapid_rate = 2000.0; // mm/min, G00 travel of the machine
+
 
 	// focus = 7mm
 	float cover_feedrate = 700.0;
@@ -82,7 +1125,7 @@ int main(int argc, char** argv)
 	float side_bonushole_size = 2.0; // 3.20 tapped to M4 for mounting.
 	// Distance (of hole center) from the cell
 	// main board. Absolute minimum is side_bonushole_size/2.
-	float side_bonushole_dist = side_bonushole_size/2.0 + 15.0;
+	float side_bonushole_dist; // side_bonushole_size/2.0 + 15.0
 
 	int do_fronts = 1; // adds front and back. Front and back 
 			   // look like ####, to allow air to pass with maximum
@@ -123,105 +1166,41 @@ int main(int argc, char** argv)
        ###    #     #     #    #                    v          ##
         ##    #     #     #         hole at every cell (y[0])  ##
       ####    #     #            ...  <----------->            ####
-      #############################################################
-        #########################################################
-           ###   ###   ###   ###   ###   ###   ###   ###   ###
-
-*/
-
-
-	if(argc < 5)
-	{
-		printf("Usage: cnc_gen <outfile_prefix> <y1> <y2> <x> [b]\n");
-		printf("Ex.: cnc_gen out 4 3 11\n");
-		printf("__-_-_-_-_-_4_-_-_-_-_-__\n");
-		printf("| O   O   O   O   O   O |\n");
-		printf("|  .O  .O  .O  .O  .O   |\n");
-		printf("| O   O   O   O   O   O |\n");
-		printf("1  .O  .O  .O  .O  .O   3\n");
-		printf("| O   O   O   O   O   O |\n");
-		printf("|  .O  .O  .O  .O  .O   |\n");
-		printf("| O   O   O   O   O   O |\n");
-		printf("------------2------------\n");
-		printf("b = bottom sheet mode (tight special holes)\n");
-		return 1;
-	}
-
-	ys[0] = atoi(argv[2]);
-	if(ys[0] < 1 || ys[0] > 100) { printf("Invalid y1\n"); return 1;}
-
-	ys[1] = atoi(argv[3]);
-	if(ys[1] < 1 || ys[1] > 100) { printf("Invalid y2\n"); return 1;}
-	if(ys[1] < ys[0]-1 || ys[1] > ys[0]) { printf("y2 must be y1-1 or y1\n"); return 1;}
-
-	x = atoi(argv[4]);
-	if(x < 1 || x > 100) { printf("Invalid x\n"); return 1;}
-
-	int bottom = 0;
-	if(argc > 5 && argv[5][0] == 'b')
-	{
-		printf("bottom mode\n");
-		bottom = 1;
-	}
-
-	char mainfilename[1000];
-	char coverfilename[1000];
-	sprintf(mainfilename, "%s_main.ngc", argv[1]);
-	sprintf(coverfilename, "%s_cover.ngc", argv[1]);
-
-	FILE* gfile = fopen(mainfilename, "wb");
-	if(!gfile)
-	{
-		printf("Error opening file %s\n", mainfilename);
-		return 1;
-	}
-
-	FILE* coverfile;
-
-	if(do_covers)
-	{
-		coverfile = fopen(coverfilename, "wb");
-		if(!coverfile)
-		{
-			printf("Error opening file %s\n", coverfilename);
-			return 1;
-		}
-	}
+      #############################################################
+        #########################################################
+           ###   ###   ###   ###   ###   ###   ###   ###   ###
 
-	float y_step = hole + cellgap;
-	float x_step = sqrt(  (3.0*(hole/2.0)*(hole/2.0)) + (2.0*(hole/2.0)*cellgap)  ) * 1.05 * spacing_trim; // todo: fix math...
+*/
 
-	printf("y_step = %f, x_step = %f\n", y_step, x_step);
 
-	fprintf(gfile, "(");
-	for(int i = 0; i < 4; i++)
-	{
-		fprintf(gfile, " %s ", argv[i]);
-	}
-	fprintf(gfile, ")\n");
-	fprintf(gfile, "(%f; %f; %f; %f; %f; %f; %f; %f;)\n(%f; %f; %f; %f; %f; %f; %f; %d;)\n(%f; %f; %d; %f; %d; %f; %d; %f)\n",
-		part_separation, thickness, cell_length, hole, wallgaps[0], wallgaps[1], wallgaps[2], wallgaps[3],
-		cellgap, bonushole, lasertrim, finger_size_x, finger_size_y, side_bonushole_size, side_bonushole_dist, num_side_front_fingers,
-		front_y_frame_width, front_mid_width, num_front_holes_y, feedrate, power, cover_feedrate, cover_power, spacing_trim);
 
-	fprintf(gfile, "G21\n");
-	fprintf(gfile, "G61\n");
-	UNCUT();
-	fprintf(gfile, "G00 F%.2f\n", feedrate);
-	fprintf(gfile, "M07 (air on)\n");
-	delay(gfile, 5.0);
+int weld_notes = 1; // WELDPOINT and ALIGNPOINT comments in the main file
+int split_passes = 1; // the bottom mode cleanup pass as a contour of its own, 0 to keep the order (k)
 
-	if(do_covers)
-	{
-		fprintf(coverfile, "G21\n");
-		fprintf(coverfile, "G61\n");
-		COVER_UNCUT();
-		fprintf(coverfile, "G00 F%.2f\n", cover_feedrate);
-		fprintf(coverfile, "M07 (air on)\n");
-		delay(coverfile, 5.0);
+// Parts of a pack
+#define PART_BOARD 0 // main cell board
+#define PART_SIDE  1
+#define PART_FRONT 2
+#define PART_COVER 3
+#define NUM_PARTS  4
 
-	}
+const char* part_names[NUM_PARTS] = {"main board", "side", "front", "cover"};
 
+// Where the parts of a pack are cut: the origin each part is generated at, and the
+// toolpath of the sheet it goes to.
+typedef struct
+{
+	float origin[NUM_PARTS][2];
+	toolpath* tp[NUM_PARTS];
+} partplace;
+
+// The parts of one pack at the fixed origins of one sheet per pack. With common, the
+// side below the main board and the front left of it are moved in to one kerf from the
+// finger tips of the board, so that the tips and the edge they face are cut on one
+// line (see share_lines()). They are also shifted by half a finger pitch, for the tips
+// to face the solid edge between the finger slots instead of the slots.
+void default_place(partplace* at, const packlayout* L, int common)
+{
 	float front_origin_x = 10.0;
 	float front_origin_y = 10.0;
 	float side_origin_x = 10.0;
@@ -235,7 +1214,7 @@ int main(int argc, char** argv)
 
 	if(do_fronts)
 	{
-		origin_x += cell_length + part_separation;
+		origin_x += cell_length + (common?(2.0*lasertrim):part_separation);
 		side_origin_x = origin_x;
 	}
 
@@ -243,9 +1222,15 @@ int main(int argc, char** argv)
 	{
 		if(side_at_back)
 		{
-			side_origin_x = origin_x + wallgaps[0] + x_step*(x-1) + hole + wallgaps[2] + part_separation
+			side_origin_x = origin_x + L->size[X] + part_separation
 				+ thickness*2.0;
 		}
+		else if(common)
+		{
+			origin_y += cell_length + 2.0*lasertrim + (do_covers?cover_thickness:0.0);
+			front_origin_y = origin_y - L->step[Y]/2.0;
+			side_origin_x += L->step[X]/2.0;
+		}
 		else
 		{
 			origin_y += cell_length + part_separation + (do_covers?(cover_thickness*2.0):0.0);
@@ -253,18 +1238,72 @@ int main(int argc, char** argv)
 		}
 	}
 
+	at->origin[PART_BOARD][X] = origin_x;
+	at->origin[PART_BOARD][Y] = origin_y;
+	at->origin[PART_SIDE][X] = side_origin_x;
+	at->origin[PART_SIDE][Y] = side_origin_y;
+	at->origin[PART_FRONT][X] = front_origin_x;
+	at->origin[PART_FRONT][Y] = front_origin_y;
+	at->origin[PART_COVER][X] = cover_origin_x;
+	at->origin[PART_COVER][Y] = cover_origin_y;
+}
+
+// Machine setup at the start of a main file, after the parameters as a comment.
+void begin_main(toolpath* gpath)
+{
+	tp_text(gpath, "(%f; %f; %f; %f; %f; %f; %f; %f;)\n(%f; %f; %f; %f; %f; %f; %f; %d;)\n(%f; %f; %d; %f; %d; %f; %d; %f)",
+		part_separation, thickness, cell_length, hole, wallgaps[0], wallgaps[1], wallgaps[2], wallgaps[3],
+		cellgap, bonushole, lasertrim, finger_size_x, finger_size_y, side_bonushole_size, side_bonushole_dist, num_side_front_fingers,
+		front_y_frame_width, front_mid_width, num_front_holes_y, feedrate, power, cover_feedrate, cover_power, spacing_trim);
+
+	tp_text(gpath, "G21");
+	tp_text(gpath, "G61");
+	UNCUT();
+	tp_op(gpath, OP_RAPID);
+	tp_feed(gpath, feedrate);
+	tp_text(gpath, "M07 (air on)");
+	delay(gpath, 5.0);
+}
+
+void begin_cover(toolpath* cpath)
+{
+	tp_text(cpath, "G21");
+	tp_text(cpath, "G61");
+	COVER_UNCUT();
+	tp_op(cpath, OP_RAPID);
+	tp_feed(cpath, cover_feedrate);
+	tp_text(cpath, "M07 (air on)");
+	delay(cpath, 5.0);
+}
+
+// Generates the parts of one pack: the cell holes and outline of the main board with the
+// cover outline alongside, then the side and the front.
+void gen_pack(const packlayout* L, int bottom, const partplace* at)
+{
+	int x = L->spec.x;
+	const int* ys = L->spec.ys;
+	toolpath* gpath = at->tp[PART_BOARD];
+	toolpath* cpath = at->tp[PART_COVER];
+	float origin_x = at->origin[PART_BOARD][X];
+	float origin_y = at->origin[PART_BOARD][Y];
+	float side_origin_x = at->origin[PART_SIDE][X];
+	float side_origin_y = at->origin[PART_SIDE][Y];
+	float front_origin_x = at->origin[PART_FRONT][X];
+	float front_origin_y = at->origin[PART_FRONT][Y];
+	float cover_origin_x = at->origin[PART_COVER][X];
+	float cover_origin_y = at->origin[PART_COVER][Y];
+
 	int eka = 1;
-	int cur_sizetest = 0;
+	int c = 0; // cell in the layout
 	for(int curx = 0; curx < x; curx++)
 	{
 		int y = ys[curx%2];
-		float y_offset = (curx%2)?(y_step/2.0):(0.0);
-		for(int cury = 0; cury < y; cury++)
+		for(int cury = 0; cury < y; cury++, c++)
 		{
-			float start_x = origin_x + wallgaps[0] + x_step*curx;
-			float mid_x = start_x + hole/2.0;
-			float start_y = origin_y + wallgaps[1] + y_step*cury + hole/2.0 + y_offset;
-			float mid_y = start_y;
+			float mid_x = origin_x + L->mid[c][X];
+			float mid_y = origin_y + L->mid[c][Y];
+			float start_x = mid_x - hole/2.0;
+			float start_y = mid_y;
 
 			float start_x_trimmed = start_x + lasertrim;
 			float start_y_trimmed = start_y;
@@ -272,20 +1311,13 @@ int main(int argc, char** argv)
 			float offset_i = hole/2.0 - lasertrim;
 			float offset_j = 0.0;
 
-			if(SIZETEST)
-			{
-				start_x_trimmed -= sizetests[cur_sizetest%NUM_SIZETESTS]/2.0;
-				offset_i += sizetests[cur_sizetest%NUM_SIZETESTS]/2.0;
-				cur_sizetest++;
-			}
-
 			// Do end bms bonusholes:
 			if(((curx == 0) || (curx == x-1)) && (cury == y-1) && end_bonusholes > 0.01)
 			{
 				float bonushole_midx = mid_x;
 				if(curx == 0) bonushole_midx -= hole/2.0; else bonushole_midx += hole/2.0;
 
-				float bonushole_midy = origin_y + wallgaps[1] + y_step*(ys[0]-1) + hole/2.0;
+				float bonushole_midy = origin_y + L->row[ys[0]-1];
 				float shift = hole/2.0 + end_bonusholes/2.0 + end_bonusholes_dist;
 				bonushole_midy += shift;
 				float bonushole_startx = bonushole_midx - end_bonusholes/2.0;
@@ -295,13 +1327,13 @@ int main(int argc, char** argv)
 				float bonushole_offset_i = end_bonusholes/2.0 - lasertrim;
 				float bonushole_offset_j = 0.0;
 
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed);
+				CONTOUR();
+				tp_rapid(gpath, bonushole_startx_trimmed, bonushole_starty_trimmed);
 				CUT();
-				fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed,
-					bonushole_offset_i, bonushole_offset_j);
+				tp_arc(gpath, OP_CW, bonushole_startx_trimmed, bonushole_starty_trimmed, bonushole_offset_i, bonushole_offset_j);
 
 				UNCUT();
-				delay(gfile, delay_per_cell*0.25);
+				delay(gpath, delay_per_cell*0.25);
 
 
 			}
@@ -324,17 +1356,19 @@ int main(int argc, char** argv)
 				float bonushole_offset_i = bonushole/2.0 - lasertrim;
 				float bonushole_offset_j = 0.0;
 
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed);
+				CONTOUR();
+				tp_rapid(gpath, bonushole_startx_trimmed, bonushole_starty_trimmed);
 				CUT();
-				fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed,
-					bonushole_offset_i, bonushole_offset_j);
+				tp_arc(gpath, OP_CW, bonushole_startx_trimmed, bonushole_starty_trimmed, bonushole_offset_i, bonushole_offset_j);
 
 				UNCUT();
-				delay(gfile, delay_per_cell*0.25);
+				delay(gpath, delay_per_cell*0.25);
 			}
 
-			fprintf(gfile, "G00 X%.2f Y%.2f (WELDPOINT %u;%u;%.2f;%.2f)\n", start_x_trimmed,
-				start_y_trimmed, curx, cury, mid_x-origin_x, mid_y-origin_y);
+			CONTOUR();
+			tp_rapid(gpath, start_x_trimmed, start_y_trimmed);
+			if(weld_notes)
+				tp_note(gpath, "WELDPOINT %u;%u;%.2f;%.2f", curx, cury, mid_x-origin_x, mid_y-origin_y);
 
 			if(bottom)
 			{
@@ -344,27 +1378,30 @@ int main(int argc, char** argv)
 			{
 				CUT();
 			}
-			fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f", start_x_trimmed, start_y_trimmed,
-				offset_i, offset_j);
+			tp_arc(gpath, OP_CW, start_x_trimmed, start_y_trimmed, offset_i, offset_j);
 
 			if(eka)
-				fprintf(gfile, " F%.2f", feedrate);
+				tp_feed(gpath, feedrate);
 			eka = 0;
-			fprintf(gfile, "\n");
 
 			UNCUT();
+			if(!bottom || split_passes)
+				delay(gpath, delay_per_cell);
 
 			if(bottom)
 			{
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", start_x_trimmed+lasertrim,
-					start_y_trimmed);
+				// The cleanup pass is a contour of its own, cut once the first passes
+				// are done elsewhere (see order_contours()). In the kept order it follows
+				// at once, as it always did, with the dwell after both.
+				if(split_passes)
+					tp_pass(gpath, gpath->cur_tag);
+				tp_rapid(gpath, start_x_trimmed+lasertrim, start_y_trimmed);
 				CUT_PWR(0.30);
-				fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", start_x_trimmed+lasertrim, start_y_trimmed,
-					offset_i-lasertrim, offset_j);
+				tp_arc(gpath, OP_CW, start_x_trimmed+lasertrim, start_y_trimmed, offset_i-lasertrim, offset_j);
 				UNCUT();
-
+				if(!split_passes)
+					delay(gpath, delay_per_cell);
 			}
-			delay(gfile, delay_per_cell);
 
 		}
 	}
@@ -374,38 +1411,36 @@ int main(int argc, char** argv)
 	float cover_outline[4][2];
 	outline[0][X] = origin_x;
 	outline[0][Y] = origin_y;
-	outline[1][X] = origin_x + wallgaps[0] + x_step*(x-1) + hole + wallgaps[2];
+	outline[1][X] = origin_x + L->size[X];
 	outline[1][Y] = outline[0][Y];
 	outline[2][X] = outline[1][X];
-	outline[2][Y] = origin_y + wallgaps[1] + y_step*(ys[0]-1) + hole + wallgaps[3];
-	if(ys[1] == ys[0])
-		outline[2][Y] += y_step/2.0;
+	outline[2][Y] = origin_y + L->size[Y];
 	outline[3][X] = origin_x;
 	outline[3][Y] = outline[2][Y];
 
 	side_outline[0][X] = side_origin_x;
 	side_outline[0][Y] = side_origin_y;
-	side_outline[1][X] = side_origin_x + wallgaps[0] + x_step*(x-1) + hole + wallgaps[2];
+	side_outline[1][X] = side_origin_x + L->size[X];
 	side_outline[1][Y] = side_outline[0][Y];
 
 	cover_outline[0][X] = cover_origin_x;
 	cover_outline[0][Y] = cover_origin_y;
-	cover_outline[1][X] = cover_origin_x + wallgaps[0] + x_step*(x-1) + hole + wallgaps[2];
+	cover_outline[1][X] = cover_origin_x + L->size[X];
 	cover_outline[1][Y] = cover_outline[0][Y];
 	cover_outline[2][X] = cover_outline[1][X];
-	cover_outline[2][Y] = cover_origin_y + wallgaps[1] + y_step*(ys[0]-1) + hole + wallgaps[3];
-	if(ys[1] == ys[0])
-		cover_outline[2][Y] += y_step/2.0;
+	cover_outline[2][Y] = cover_origin_y + L->size[Y];
 	cover_outline[3][X] = cover_outline[0][X];
 	cover_outline[3][Y] = cover_outline[2][Y];
 
-	fprintf(gfile, "G00 X%.2f Y%.2f (ALIGNPOINT 0;0;%.2f;%.2f)\n", outline[0][X]-lasertrim, outline[0][Y]-lasertrim,
-		outline[0][X]-(do_fronts?thickness:0.0), outline[0][Y]-(do_sides?thickness:0.0));
+	CONTOUR();
+	tp_rapid(gpath, outline[0][X]-lasertrim, outline[0][Y]-lasertrim);
+	if(weld_notes)
+		tp_note(gpath, "ALIGNPOINT 0;0;%.2f;%.2f", origin_x+L->align[0][X], origin_y+L->align[0][Y]);
 	CUT();
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G00 X%.2f Y%.2f\n", cover_outline[0][X]-thickness-cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
+		tp_rapid(cpath, cover_outline[0][X]-thickness-cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
 		COVER_CUT();
 	}
 
@@ -415,48 +1450,51 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int curx = 0; curx < x; curx++)
 		{
-			float finger_start_x = origin_x + wallgaps[0] + x_step*curx + hole/2.0 - finger_size_x/2.0;
+			float finger_start_x = origin_x + L->finger[X][curx];
 			float finger_end_x = finger_start_x + finger_size_x;
 
-			float cfinger_start_x = cover_origin_x + wallgaps[0] + x_step*curx + hole/2.0 - finger_size_x/2.0;
+			float cfinger_start_x = cover_origin_x + L->finger[X][curx];
 			float cfinger_end_x = cfinger_start_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-lasertrim, outline[0][Y]-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-lasertrim, outline[0][Y]
+			tp_line(gpath, finger_start_x-lasertrim, outline[0][Y]-lasertrim);
+			tp_line(gpath, finger_start_x-lasertrim, outline[0][Y]
 				-thickness-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+lasertrim, outline[0][Y]
+			tp_line(gpath, finger_end_x+lasertrim, outline[0][Y]
 				-thickness-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+lasertrim, outline[0][Y]-lasertrim);
+			tp_line(gpath, finger_end_x+lasertrim, outline[0][Y]-lasertrim);
 
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f F%.2f\n", cfinger_start_x-cover_lasertrim, cover_outline[0][Y]-cover_lasertrim, cover_feedrate);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_start_x-cover_lasertrim, cover_outline[0][Y]
+				tp_line(cpath, cfinger_start_x-cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
+				tp_feed(cpath, cover_feedrate);
+				tp_line(cpath, cfinger_start_x-cover_lasertrim, cover_outline[0][Y]
 					-thickness-cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x+cover_lasertrim, cover_outline[0][Y]
+				tp_line(cpath, cfinger_end_x+cover_lasertrim, cover_outline[0][Y]
 					-thickness-cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x+cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
+				tp_line(cpath, cfinger_end_x+cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
 			}
 
 		}
 	}
 
-	fprintf(gfile, "G01 X%.2f Y%.2f (ALIGNPOINT 1;0;%.2f;%.2f)\n", outline[1][X]+lasertrim, outline[1][Y]-lasertrim,
-		outline[1][X]+(do_fronts?thickness:0.0), outline[1][Y]-(do_sides?thickness:0.0));
+	tp_line(gpath, outline[1][X]+lasertrim, outline[1][Y]-lasertrim);
+	if(weld_notes)
+		tp_note(gpath, "ALIGNPOINT 1;0;%.2f;%.2f", origin_x+L->align[1][X], origin_y+L->align[1][Y]);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f F%.2f\n", cover_outline[1][X]+thickness+cover_lasertrim, cover_outline[1][Y]-cover_lasertrim, cover_feedrate);
+		tp_line(cpath, cover_outline[1][X]+thickness+cover_lasertrim, cover_outline[1][Y]-cover_lasertrim);
+		tp_feed(cpath, cover_feedrate);
 
 	}
 
 	UNCUT();
-	delay(gfile, delay_per_cell*x);
+	delay(gpath, delay_per_cell*x);
 	CUT_PWR(vertical_power_mult);
 	if(do_covers)
 	{
 		COVER_UNCUT();
-		delay(coverfile, cover_delay_per_cell*x);
+		delay(cpath, cover_delay_per_cell*x);
 		COVER_CUT();
 	}
 
@@ -467,43 +1505,44 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int cury = 0; cury < ys[0]; cury++)
 		{
-			float finger_start_y = origin_y + wallgaps[1] + y_step*cury + hole/2.0 - finger_size_y/2.0;
+			float finger_start_y = origin_y + L->finger[Y][cury];
 			float finger_end_y = finger_start_y + finger_size_y;
-			float cfinger_start_y = cover_origin_y + wallgaps[1] + y_step*cury + hole/2.0 - finger_size_y/2.0;
+			float cfinger_start_y = cover_origin_y + L->finger[Y][cury];
 			float cfinger_end_y = cfinger_start_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+lasertrim, finger_start_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+thickness+lasertrim, finger_start_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+thickness+lasertrim, finger_end_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+lasertrim, finger_end_y+lasertrim);
+			tp_line(gpath, outline[1][X]+lasertrim, finger_start_y-lasertrim);
+			tp_line(gpath, outline[1][X]+thickness+lasertrim, finger_start_y-lasertrim);
+			tp_line(gpath, outline[1][X]+thickness+lasertrim, finger_end_y+lasertrim);
+			tp_line(gpath, outline[1][X]+lasertrim, finger_end_y+lasertrim);
 
 /*
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+cover_lasertrim, cfinger_start_y-cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+thickness+cover_lasertrim, cfinger_start_y-cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+thickness+cover_lasertrim, cfinger_end_y+cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+cover_lasertrim, cfinger_end_y+cover_lasertrim);
+				tp_line(cpath, cover_outline[1][X]+cover_lasertrim, cfinger_start_y-cover_lasertrim);
+				tp_line(cpath, cover_outline[1][X]+thickness+cover_lasertrim, cfinger_start_y-cover_lasertrim);
+				tp_line(cpath, cover_outline[1][X]+thickness+cover_lasertrim, cfinger_end_y+cover_lasertrim);
+				tp_line(cpath, cover_outline[1][X]+cover_lasertrim, cfinger_end_y+cover_lasertrim);
 
 			}
 */
 		}
 	}
 
-	fprintf(gfile, "G01 X%.2f Y%.2f (ALIGNPOINT 1;1;%.2f;%.2f)\n", outline[2][X]+lasertrim, outline[2][Y]+lasertrim,
-		outline[2][X]+(do_fronts?thickness:0.0), outline[2][Y]+(do_sides?thickness:0.0));
+	tp_line(gpath, outline[2][X]+lasertrim, outline[2][Y]+lasertrim);
+	if(weld_notes)
+		tp_note(gpath, "ALIGNPOINT 1;1;%.2f;%.2f", origin_x+L->align[2][X], origin_y+L->align[2][Y]);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[2][X]+thickness+cover_lasertrim, cover_outline[2][Y]+cover_lasertrim);
+		tp_line(cpath, cover_outline[2][X]+thickness+cover_lasertrim, cover_outline[2][Y]+cover_lasertrim);
 	}
 
 	UNCUT();
-	delay(gfile, delay_per_cell*ys[0]);
+	delay(gpath, delay_per_cell*ys[0]);
 	CUT();
 	if(do_covers)
 	{
 		COVER_UNCUT();
-		delay(coverfile, 0.7*cover_delay_per_cell*ys[0]);
+		delay(cpath, 0.7*cover_delay_per_cell*ys[0]);
 		COVER_CUT();
 	}
 
@@ -516,41 +1555,42 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int curx = x-1; curx >= 0; curx--)
 		{
-			float finger_end_x = origin_x + wallgaps[0] + x_step*curx + hole/2.0 - finger_size_x/2.0;
+			float finger_end_x = origin_x + L->finger[X][curx];
 			float finger_start_x = finger_end_x + finger_size_x;
-			float cfinger_end_x = cover_origin_x + wallgaps[0] + x_step*curx + hole/2.0 - finger_size_x/2.0;
+			float cfinger_end_x = cover_origin_x + L->finger[X][curx];
 			float cfinger_start_x = cfinger_end_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+lasertrim, outline[2][Y]+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+lasertrim, outline[2][Y]+thickness+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-lasertrim, outline[2][Y]+thickness+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-lasertrim, outline[2][Y]+lasertrim);
+			tp_line(gpath, finger_start_x+lasertrim, outline[2][Y]+lasertrim);
+			tp_line(gpath, finger_start_x+lasertrim, outline[2][Y]+thickness+lasertrim);
+			tp_line(gpath, finger_end_x-lasertrim, outline[2][Y]+thickness+lasertrim);
+			tp_line(gpath, finger_end_x-lasertrim, outline[2][Y]+lasertrim);
 
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_start_x+cover_lasertrim, cover_outline[2][Y]+cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_start_x+cover_lasertrim, cover_outline[2][Y]+thickness+cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x-cover_lasertrim, cover_outline[2][Y]+thickness+cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x-cover_lasertrim, cover_outline[2][Y]+cover_lasertrim);
+				tp_line(cpath, cfinger_start_x+cover_lasertrim, cover_outline[2][Y]+cover_lasertrim);
+				tp_line(cpath, cfinger_start_x+cover_lasertrim, cover_outline[2][Y]+thickness+cover_lasertrim);
+				tp_line(cpath, cfinger_end_x-cover_lasertrim, cover_outline[2][Y]+thickness+cover_lasertrim);
+				tp_line(cpath, cfinger_end_x-cover_lasertrim, cover_outline[2][Y]+cover_lasertrim);
 			}
 		}
 	}
 
-	fprintf(gfile, "G01 X%.2f Y%.2f (ALIGNPOINT 0;1;%.2f;%.2f)\n", outline[3][X]-lasertrim, outline[3][Y]+lasertrim,
-		outline[3][X]-(do_fronts?thickness:0.0), outline[3][Y]+(do_sides?thickness:0.0));
+	tp_line(gpath, outline[3][X]-lasertrim, outline[3][Y]+lasertrim);
+	if(weld_notes)
+		tp_note(gpath, "ALIGNPOINT 0;1;%.2f;%.2f", origin_x+L->align[3][X], origin_y+L->align[3][Y]);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-thickness-cover_lasertrim, cover_outline[3][Y]+cover_lasertrim);
+		tp_line(cpath, cover_outline[3][X]-thickness-cover_lasertrim, cover_outline[3][Y]+cover_lasertrim);
 	}
 
 	UNCUT();
-	delay(gfile, delay_per_cell*x);
+	delay(gpath, delay_per_cell*x);
 	CUT_PWR(vertical_power_mult);
 	if(do_covers)
 	{
 		COVER_UNCUT();
-		delay(coverfile, cover_delay_per_cell*x);
+		delay(cpath, cover_delay_per_cell*x);
 		COVER_CUT();
 	}
 
@@ -561,22 +1601,22 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int cury = ys[0]-1; cury >=0; cury--)
 		{
-			float finger_end_y = origin_y + wallgaps[1] + y_step*cury + hole/2.0 - finger_size_y/2.0;
+			float finger_end_y = origin_y + L->finger[Y][cury];
 			float finger_start_y = finger_end_y + finger_size_y;
-			float cfinger_end_y = cover_origin_y + wallgaps[1] + y_step*cury + hole/2.0 - finger_size_y/2.0;
+			float cfinger_end_y = cover_origin_y + L->finger[Y][cury];
 			float cfinger_start_y = cfinger_end_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-lasertrim, finger_start_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-thickness-lasertrim, finger_start_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-thickness-lasertrim, finger_end_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-lasertrim, finger_end_y-lasertrim);
+			tp_line(gpath, outline[3][X]-lasertrim, finger_start_y+lasertrim);
+			tp_line(gpath, outline[3][X]-thickness-lasertrim, finger_start_y+lasertrim);
+			tp_line(gpath, outline[3][X]-thickness-lasertrim, finger_end_y-lasertrim);
+			tp_line(gpath, outline[3][X]-lasertrim, finger_end_y-lasertrim);
 
 /*
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-cover_lasertrim, cfinger_start_y+cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-thickness-cover_lasertrim, cfinger_start_y+cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-thickness-cover_lasertrim, cfinger_end_y-cover_lasertrim);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-cover_lasertrim, cfinger_end_y-cover_lasertrim);
+				tp_line(cpath, cover_outline[3][X]-cover_lasertrim, cfinger_start_y+cover_lasertrim);
+				tp_line(cpath, cover_outline[3][X]-thickness-cover_lasertrim, cfinger_start_y+cover_lasertrim);
+				tp_line(cpath, cover_outline[3][X]-thickness-cover_lasertrim, cfinger_end_y-cover_lasertrim);
+				tp_line(cpath, cover_outline[3][X]-cover_lasertrim, cfinger_end_y-cover_lasertrim);
 			}
 */
 		}
@@ -584,30 +1624,24 @@ int main(int argc, char** argv)
 	}
 
 
-	fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[0][X]-lasertrim, outline[0][Y]-lasertrim);
+	tp_line(gpath, outline[0][X]-lasertrim, outline[0][Y]-lasertrim);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[0][X]-thickness-cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
+		tp_line(cpath, cover_outline[0][X]-thickness-cover_lasertrim, cover_outline[0][Y]-cover_lasertrim);
 
 	}
 
 	UNCUT();
-	delay(gfile, delay_per_cell*ys[0]);
+	delay(gpath, delay_per_cell*ys[0]);
 	if(do_covers)
 	{
 		COVER_UNCUT();
-//		delay(coverfile, 0.7*cover_delay_per_cell*ys[0]);
+//		delay(cpath, 0.7*cover_delay_per_cell*ys[0]);
 	}
 
 
 
-	printf("Main panel size without fingers: %.2f x %.2f\n", outline[1][X]-outline[0][X], outline[2][Y]-outline[1][Y]);
-	printf("Total box size: %.2f x %.2f x %.2f\n", outline[1][X]-outline[0][X]+2.0*thickness, outline[2][Y]-outline[1][Y]+2.0*thickness, cell_length+2.0*cover_thickness);
-	printf("Sheet needed: %.2f x %.2f\n", outline[1][X]-outline[0][X]+2.0*thickness+cell_length+part_separation, outline[2][Y]-outline[1][Y]+2.0*thickness+cell_length+2.0*cover_thickness+part_separation);
-	if(do_covers)
-		printf("Cover size with fingers (sheet needed): %.2f x %.2f\n", cover_outline[1][X]-cover_outline[0][X]+2.0*thickness, cover_outline[2][Y]-cover_outline[1][Y]+2.0*thickness);
-
 /*
 
 |||| thickness
@@ -624,26 +1658,28 @@ n ||||  v step
 	float side_front_finger_step = (cell_length - 2.0*thickness) / ((float)num_side_front_fingers-0.5);
 
 	// Do side panel
+	gpath = at->tp[PART_SIDE];
 	if(do_sides)
 	{
-		fprintf(gfile, "G00 X%.2f Y%.2f\n", side_outline[0][X]-lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
+		CONTOUR();
+		tp_rapid(gpath, side_outline[0][X]-lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
 		CUT();
 		// Bottom horizontal
 		for(int curx = 0; curx < x; curx++)
 		{
-			float finger_start_x = side_origin_x + wallgaps[0] + x_step*curx + hole/2.0 - finger_size_x/2.0;
+			float finger_start_x = side_origin_x + L->finger[X][curx];
 			float finger_end_x = finger_start_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+lasertrim, side_origin_y+thickness-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-lasertrim, side_origin_y+thickness-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
+			tp_line(gpath, finger_start_x+lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
+			tp_line(gpath, finger_start_x+lasertrim, side_origin_y+thickness-lasertrim);
+			tp_line(gpath, finger_end_x-lasertrim, side_origin_y+thickness-lasertrim);
+			tp_line(gpath, finger_end_x-lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
+		tp_line(gpath, side_outline[1][X]+lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*x);
+		delay(gpath, delay_per_cell*x);
 		CUT_PWR(vertical_power_mult);
 
 		// Right vertical
@@ -652,34 +1688,34 @@ n ||||  v step
 			float finger_start_y = side_origin_y + thickness +
 				side_front_finger_step*cury;
 			float finger_end_y = finger_start_y + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+lasertrim, finger_start_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+thickness+lasertrim, finger_start_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+thickness+lasertrim, finger_end_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+lasertrim, finger_end_y+lasertrim);
+			tp_line(gpath, side_outline[1][X]+lasertrim, finger_start_y-lasertrim);
+			tp_line(gpath, side_outline[1][X]+thickness+lasertrim, finger_start_y-lasertrim);
+			tp_line(gpath, side_outline[1][X]+thickness+lasertrim, finger_end_y+lasertrim);
+			tp_line(gpath, side_outline[1][X]+lasertrim, finger_end_y+lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
+		tp_line(gpath, side_outline[1][X]+lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*3);
+		delay(gpath, delay_per_cell*3);
 		CUT();
 
 		// Top horizontal
 		for(int curx = x-1; curx >= 0; curx--)
 		{
-			float finger_end_x = side_origin_x + wallgaps[0] + x_step*curx + hole/2.0 - finger_size_x/2.0;
+			float finger_end_x = side_origin_x + L->finger[X][curx];
 			float finger_start_x = finger_end_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-lasertrim, side_origin_y+cell_length-thickness+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+lasertrim, side_origin_y+cell_length-thickness+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
+			tp_line(gpath, finger_start_x-lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
+			tp_line(gpath, finger_start_x-lasertrim, side_origin_y+cell_length-thickness+lasertrim);
+			tp_line(gpath, finger_end_x+lasertrim, side_origin_y+cell_length-thickness+lasertrim);
+			tp_line(gpath, finger_end_x+lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
+		tp_line(gpath, side_outline[0][X]-lasertrim, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*x);
+		delay(gpath, delay_per_cell*x);
 		CUT_PWR(vertical_power_mult);
 
 		// Left vertical
@@ -689,28 +1725,27 @@ n ||||  v step
 			float finger_end_y = side_origin_y + thickness +
 				side_front_finger_step*cury;
 			float finger_start_y = finger_end_y + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-lasertrim, finger_start_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-thickness-lasertrim, finger_start_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-thickness-lasertrim, finger_end_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-lasertrim, finger_end_y-lasertrim);
+			tp_line(gpath, side_outline[0][X]-lasertrim, finger_start_y+lasertrim);
+			tp_line(gpath, side_outline[0][X]-thickness-lasertrim, finger_start_y+lasertrim);
+			tp_line(gpath, side_outline[0][X]-thickness-lasertrim, finger_end_y-lasertrim);
+			tp_line(gpath, side_outline[0][X]-lasertrim, finger_end_y-lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
+		tp_line(gpath, side_outline[0][X]-lasertrim, side_origin_y-(do_covers?cover_thickness:0.0)-lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*3);
+		delay(gpath, delay_per_cell*3);
 
 		if(do_side_bonusholes)
 		{
 			for(int curx = 0; curx < x; curx++)
 			{
 				int y = ys[curx%2];
-				float y_offset = (curx%2)?(y_step/2.0):(0.0);
 				for(int cury = 0; cury < 2; cury++)
 				{
 					if(curx%2)
 					{
-						float bonushole_midx = side_origin_x + wallgaps[0] + x_step*curx + hole/2.0;
+						float bonushole_midx = side_origin_x + L->col[curx];
 						float bonushole_midy = cury?
 							(side_origin_y+cell_length-thickness-side_bonushole_dist):
 							(side_origin_y+thickness+side_bonushole_dist);
@@ -721,7 +1756,8 @@ n ||||  v step
 						float bonushole_offset_i = side_bonushole_size/2.0 - lasertrim;
 						float bonushole_offset_j = 0.0;
 
-						fprintf(gfile, "G00 X%.2f Y%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed);
+						CONTOUR();
+						tp_rapid(gpath, bonushole_startx_trimmed, bonushole_starty_trimmed);
 						if(do_side_bonusholes == 2)
 						{
 							CUT_MARK();
@@ -730,12 +1766,11 @@ n ||||  v step
 						{
 							CUT();
 						}
-						fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed,
-							bonushole_offset_i, bonushole_offset_j);
+						tp_arc(gpath, OP_CW, bonushole_startx_trimmed, bonushole_starty_trimmed, bonushole_offset_i, bonushole_offset_j);
 						UNCUT();
 						if(do_side_bonusholes != 2)
 						{
-							delay(gfile, delay_per_cell*0.25);
+							delay(gpath, delay_per_cell*0.25);
 						}
 					}
 				}
@@ -745,6 +1780,7 @@ n ||||  v step
 	} // end do side panel
 
 	// Do front panel
+	gpath = at->tp[PART_FRONT];
 	if(do_fronts)
 	{
 		// Cut ventilation holes
@@ -755,7 +1791,7 @@ n ||||  v step
 
 		for(int cury = 0; cury < ys[0]; cury++)
 		{
-			float fhole_start_y = origin_y + wallgaps[1] + y_step*cury + hole/2.0 - fhole_width/2.0;
+			float fhole_start_y = front_origin_y + L->row[cury] - fhole_width/2.0;
 			if(ys[0] == ys[1])
 				fhole_start_y += (hole+cellgap)/4.0;
 
@@ -767,36 +1803,38 @@ n ||||  v step
 						+ front_mid_width/2.0;
 				float fhole_end_x = fhole_start_x + fhole_height;
 
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", fhole_start_x+lasertrim, fhole_start_y+lasertrim);
+				CONTOUR();
+				tp_rapid(gpath, fhole_start_x+lasertrim, fhole_start_y+lasertrim);
 				CUT();
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_end_x-lasertrim, fhole_start_y+lasertrim);
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_end_x-lasertrim, fhole_end_y-lasertrim);
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_start_x+lasertrim, fhole_end_y-lasertrim);
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_start_x+lasertrim, fhole_start_y+lasertrim);
+				tp_line(gpath, fhole_end_x-lasertrim, fhole_start_y+lasertrim);
+				tp_line(gpath, fhole_end_x-lasertrim, fhole_end_y-lasertrim);
+				tp_line(gpath, fhole_start_x+lasertrim, fhole_end_y-lasertrim);
+				tp_line(gpath, fhole_start_x+lasertrim, fhole_start_y+lasertrim);
 				UNCUT();
-				delay(gfile, delay_per_cell);
+				delay(gpath, delay_per_cell);
 
 			}
 		}
 
 
 		// Left vertical (joins bottom main cell board)
-		fprintf(gfile, "G00 X%.2f Y%.2f\n", front_origin_x-lasertrim, outline[3][Y]+thickness+lasertrim);
+		CONTOUR();
+		tp_rapid(gpath, front_origin_x-lasertrim, (front_origin_y+L->size[Y])+thickness+lasertrim);
 		CUT_PWR(vertical_power_mult);
 		for(int cury = ys[0]-1; cury >=0; cury--)
 		{
-			float finger_end_y = origin_y + wallgaps[1] + y_step*cury + hole/2.0 - finger_size_y/2.0;
+			float finger_end_y = front_origin_y + L->finger[Y][cury];
 			float finger_start_y = finger_end_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-lasertrim, finger_start_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+thickness-lasertrim, finger_start_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+thickness-lasertrim, finger_end_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-lasertrim, finger_end_y+lasertrim);
+			tp_line(gpath, front_origin_x-lasertrim, finger_start_y-lasertrim);
+			tp_line(gpath, front_origin_x+thickness-lasertrim, finger_start_y-lasertrim);
+			tp_line(gpath, front_origin_x+thickness-lasertrim, finger_end_y+lasertrim);
+			tp_line(gpath, front_origin_x-lasertrim, finger_end_y+lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-lasertrim, outline[0][Y]-thickness-lasertrim);
+		tp_line(gpath, front_origin_x-lasertrim, front_origin_y-thickness-lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*ys[0]);
+		delay(gpath, delay_per_cell*ys[0]);
 		CUT();
 
 		// Bottom horizontal (joins to a side board)
@@ -806,34 +1844,34 @@ n ||||  v step
 			float finger_start_x = front_origin_x + thickness +
 				side_front_finger_step*curx;
 			float finger_end_x = finger_start_x + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+lasertrim, outline[0][Y]-thickness-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+lasertrim, outline[0][Y]-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-lasertrim, outline[0][Y]-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-lasertrim, outline[0][Y]-thickness-lasertrim);
+			tp_line(gpath, finger_start_x+lasertrim, front_origin_y-thickness-lasertrim);
+			tp_line(gpath, finger_start_x+lasertrim, front_origin_y-lasertrim);
+			tp_line(gpath, finger_end_x-lasertrim, front_origin_y-lasertrim);
+			tp_line(gpath, finger_end_x-lasertrim, front_origin_y-thickness-lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+lasertrim, outline[0][Y]-thickness-lasertrim);
+		tp_line(gpath, front_origin_x+cell_length+lasertrim, front_origin_y-thickness-lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*3);
+		delay(gpath, delay_per_cell*3);
 		CUT_PWR(vertical_power_mult);
 
 		// Right vertical (joins to top main cell board)
 
 		for(int cury = 0; cury < ys[0]; cury++)
 		{
-			float finger_start_y = origin_y + wallgaps[1] + y_step*cury + hole/2.0 - finger_size_y/2.0;
+			float finger_start_y = front_origin_y + L->finger[Y][cury];
 			float finger_end_y = finger_start_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+lasertrim, finger_start_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length-thickness+lasertrim, finger_start_y+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length-thickness+lasertrim, finger_end_y-lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+lasertrim, finger_end_y-lasertrim);
+			tp_line(gpath, front_origin_x+cell_length+lasertrim, finger_start_y+lasertrim);
+			tp_line(gpath, front_origin_x+cell_length-thickness+lasertrim, finger_start_y+lasertrim);
+			tp_line(gpath, front_origin_x+cell_length-thickness+lasertrim, finger_end_y-lasertrim);
+			tp_line(gpath, front_origin_x+cell_length+lasertrim, finger_end_y-lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+lasertrim, outline[2][Y]+thickness+lasertrim);
+		tp_line(gpath, front_origin_x+cell_length+lasertrim, (front_origin_y+L->size[Y])+thickness+lasertrim);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*ys[0]);
+		delay(gpath, delay_per_cell*ys[0]);
 		CUT();
 
 		// Top horizontal (joins to another side board)
@@ -843,36 +1881,682 @@ n ||||  v step
 			float finger_end_x = front_origin_x + thickness +
 				side_front_finger_step*curx;
 			float finger_start_x = finger_end_x + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-lasertrim, outline[2][Y]+thickness+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-lasertrim, outline[2][Y]+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+lasertrim, outline[2][Y]+lasertrim);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+lasertrim, outline[2][Y]+thickness+lasertrim);
+			tp_line(gpath, finger_start_x-lasertrim, (front_origin_y+L->size[Y])+thickness+lasertrim);
+			tp_line(gpath, finger_start_x-lasertrim, (front_origin_y+L->size[Y])+lasertrim);
+			tp_line(gpath, finger_end_x+lasertrim, (front_origin_y+L->size[Y])+lasertrim);
+			tp_line(gpath, finger_end_x+lasertrim, (front_origin_y+L->size[Y])+thickness+lasertrim);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-lasertrim, outline[3][Y]+thickness+lasertrim);
+		tp_line(gpath, front_origin_x-lasertrim, (front_origin_y+L->size[Y])+thickness+lasertrim);
 
 		UNCUT();
-//		delay(gfile, delay_per_cell*3);
+//		delay(gpath, delay_per_cell*3);
+
+	}
+}
+
+// The pack spec for the parameters above.
+void make_spec(packspec* spec, const int* ys, int x)
+{
+	spec->cell = hole;
+	spec->cellgap = cellgap;
+	memcpy(spec->wallgaps, wallgaps, sizeof(spec->wallgaps));
+	spec->spacing_trim = spacing_trim;
+	spec->finger_size[X] = finger_size_x;
+	spec->finger_size[Y] = finger_size_y;
+	spec->walls[X] = do_fronts?thickness:0.0;
+	spec->walls[Y] = do_sides?thickness:0.0;
+	spec->ys[0] = ys[0];
+	spec->ys[1] = ys[1];
+	spec->x = x;
+}
+
+// Sheet nesting.
+// nest_main() cuts the parts of several packs on as few sheets as possible. Each part
+// is a rectangle, its extent as generated plus part_separation. The parts go in order
+// of height, each to the lowest, then leftmost, spot on the skyline (the top edge of
+// what is placed so far) of the first sheet where it fits. Parts are not rotated.
+// Covers are nested on sheets of their own.
+
+float sheet_margin = 5.0; // unused border of the sheet
+
+typedef struct
+{
+	float x, w, h; // a segment of the skyline: from x to x+w, filled up to h
+} skyseg;
+
+typedef struct
+{
+	int num;
+	skyseg* seg;   // left to right
+	float size[2];
+	float used;    // area
+	int parts;
+} skyline;
+
+void sky_init(skyline* s, float w, float h)
+{
+	s->num = 1;
+	s->seg = malloc(sizeof(skyseg));
+	s->seg[0].x = 0.0;
+	s->seg[0].w = w;
+	s->seg[0].h = 0.0;
+	s->size[X] = w;
+	s->size[Y] = h;
+	s->used = 0.0;
+	s->parts = 0;
+}
+
+// Lowest, then leftmost, spot for a w x h rectangle. Returns 0 if it doesn't fit.
+int sky_find(const skyline* s, float w, float h, float* at)
+{
+	int found = 0;
+	for(int i = 0; i < s->num; i++)
+	{
+		float x = s->seg[i].x;
+		if(x + w > s->size[X] + 0.001)
+			break;
+		float y = 0.0;
+		for(int j = i; j < s->num && s->seg[j].x < x + w - 0.001; j++)
+			if(s->seg[j].h > y)
+				y = s->seg[j].h;
+		if(y + h > s->size[Y] + 0.001)
+			continue;
+		if(!found || y < at[Y] || (y == at[Y] && x < at[X]))
+		{
+			at[X] = x;
+			at[Y] = y;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+// Raises the skyline from x to x+w to top.
+void sky_add(skyline* s, float x, float w, float top)
+{
+	skyseg* seg = malloc((s->num+2)*sizeof(skyseg));
+	int n = 0;
+	for(int i = 0; i < s->num && s->seg[i].x < x; i++)
+	{
+		seg[n] = s->seg[i];
+		if(seg[n].x + seg[n].w > x)
+			seg[n].w = x - seg[n].x;
+		n++;
+	}
+	seg[n].x = x;
+	seg[n].w = w;
+	seg[n].h = top;
+	n++;
+	for(int i = 0; i < s->num; i++)
+	{
+		skyseg g = s->seg[i];
+		if(g.x + g.w <= x + w)
+			continue;
+		if(g.x < x + w)
+		{
+			g.w = g.x + g.w - (x + w);
+			g.x = x + w;
+		}
+		seg[n++] = g;
+	}
+	free(s->seg);
+	s->seg = seg;
+	s->num = n;
+}
+
+typedef struct
+{
+	int pack, part;
+	float min[2], size[2];  // extent at the default place
+	int sheet;
+	float at[2];            // where min goes
+} nestpart;
+
+static int cmp_height(const void* a, const void* b)
+{
+	const nestpart* pa = a;
+	const nestpart* pb = b;
+	if(pa->size[Y] != pb->size[Y])
+		return (pa->size[Y] < pb->size[Y])?1:-1;
+	if(pa->size[X] != pb->size[X])
+		return (pa->size[X] < pb->size[X])?1:-1;
+	return (pa->pack != pb->pack)?(pa->pack - pb->pack):(pa->part - pb->part);
+}
+
+// Puts the parts of one kind (main material or covers) on sheets. Returns the number
+// of sheets, -1 if a part is larger than a sheet.
+int nest_parts(nestpart* parts, int n, int covers, const float* sheet, skyline** sheets)
+{
+	int num_sheets = 0;
+	*sheets = NULL;
+	for(int k = 0; k < n; k++)
+	{
+		nestpart* p = &parts[k];
+		if((p->part == PART_COVER) != covers)
+			continue;
+		float w = p->size[X] + part_separation;
+		float h = p->size[Y] + part_separation;
+		int s;
+		for(s = 0; s < num_sheets; s++)
+			if(sky_find(&(*sheets)[s], w, h, p->at))
+				break;
+		if(s == num_sheets)
+		{
+			*sheets = realloc(*sheets, (num_sheets+1)*sizeof(skyline));
+			sky_init(&(*sheets)[num_sheets++], sheet[X]-2.0*sheet_margin+part_separation, sheet[Y]-2.0*sheet_margin+part_separation);
+			if(!sky_find(&(*sheets)[s], w, h, p->at))
+			{
+				printf("The %s of pack %u (%.2f x %.2f) doesn't fit on the sheet\n", part_names[p->part], p->pack+1, p->size[X], p->size[Y]);
+				return -1;
+			}
+		}
+		sky_add(&(*sheets)[s], p->at[X], w, p->at[Y]+h);
+		(*sheets)[s].used += p->size[X]*p->size[Y];
+		(*sheets)[s].parts++;
+		p->sheet = s;
+	}
+	return num_sheets;
+}
+
+// Closes a sheet and writes it. Main sheets are put in cutting order first.
+int finish_sheet(toolpath* tp, const char* filename, int cover, int reorder, int fixed_dwells, const heatmodel* hm,
+	const tubemodel* tm)
+{
+	if(!cover)
+		tp_trailer(tp);
+	tp_rapid(tp, sheet_margin, sheet_margin);
+	delay(tp, 15.0);
+	tp_text(tp, "M2");
+	tp_text(tp, "%%");
+
+	FILE* f = fopen(filename, "wb");
+	if(!f)
+	{
+		printf("Error opening file %s\n", filename);
+		return 0;
+	}
+	if(cover)
+		tp_write(f, tp);
+	else
+	{
+		toolpath ordered;
+		tp_init(&ordered);
+		printf("%s:\n", filename);
+		order_contours(tp, &ordered, reorder, fixed_dwells, power, feedrate, rapid_rate, hm, tm);
+		tp_write(f, &ordered);
+		tp_free(&ordered);
+	}
+	fclose(f);
+	return 1;
+}
+
+// cnc_gen <prefix> nest <width>x<height> <y1>,<y2>,<x>[b] ... [k][f]
+int nest_main(int argc, char** argv, const heatmodel* hm, const tubemodel* tm)
+{
+	float sheet[2];
+	if(sscanf(argv[3], "%fx%f", &sheet[X], &sheet[Y]) != 2 || sheet[X] <= 2.0*sheet_margin || sheet[Y] <= 2.0*sheet_margin)
+	{
+		printf("Invalid sheet size %s, expected <width>x<height> in mm\n", argv[3]);
+		return 1;
+	}
+
+	int reorder = 1, fixed_dwells = 0;
+	int num_packs = 0;
+	packlayout* packs = calloc(argc, sizeof(packlayout));
+	int* bottom = calloc(argc, sizeof(int));
+	for(int i = 4; i < argc; i++)
+	{
+		int ys[2], x;
+		char flags[8] = "";
+		if(!strchr(argv[i], ','))
+		{
+			if(strchr(argv[i], 'k')) reorder = split_passes = 0;
+			if(strchr(argv[i], 'f')) fixed_dwells = 1;
+			continue;
+		}
+		if(sscanf(argv[i], "%d,%d,%d%7s", &ys[0], &ys[1], &x, flags) < 3
+			|| ys[0] < 1 || ys[0] > 100 || ys[1] < ys[0]-1 || ys[1] > ys[0] || x < 1 || x > 100)
+		{
+			printf("Invalid pack %s, expected <y1>,<y2>,<x>[b]\n", argv[i]);
+			return 1;
+		}
+
+		packspec spec;
+		make_spec(&spec, ys, x);
+		if(!layout_build(&packs[num_packs], &spec))
+			return 1;
+		bottom[num_packs] = (strchr(flags, 'b') != NULL);
+
+		char layoutfilename[1000];
+		sprintf(layoutfilename, "%s_pack%u_layout.bin", argv[1], num_packs+1);
+		if(!layout_write(layoutfilename, &packs[num_packs]))
+			return 1;
+		num_packs++;
+	}
+	if(!num_packs)
+	{
+		printf("No packs given\n");
+		return 1;
+	}
+
+	// The extent of each part, from a run at the default place.
+	nestpart* parts = calloc(num_packs*NUM_PARTS, sizeof(nestpart));
+	partplace* places = calloc(num_packs, sizeof(partplace));
+	int num_parts = 0;
+	weld_notes = 0; // the packs are welded from their layout files
+	for(int k = 0; k < num_packs; k++)
+	{
+		toolpath scratch[NUM_PARTS];
+		default_place(&places[k], &packs[k], 0);
+		for(int p = 0; p < NUM_PARTS; p++)
+		{
+			tp_init(&scratch[p]);
+			places[k].tp[p] = &scratch[p];
+		}
+		gen_pack(&packs[k], bottom[k], &places[k]);
+		for(int p = 0; p < NUM_PARTS; p++)
+		{
+			nestpart* np = &parts[num_parts];
+			float max[2];
+			if((p != PART_COVER || do_covers) && tp_bounds(&scratch[p], np->min, max))
+			{
+				np->pack = k;
+				np->part = p;
+				np->size[X] = max[X] - np->min[X];
+				np->size[Y] = max[Y] - np->min[Y];
+				num_parts++;
+			}
+			tp_free(&scratch[p]);
+		}
+	}
+
+	qsort(parts, num_parts, sizeof(nestpart), cmp_height);
+	skyline* sheets[2];
+	int num_sheets[2];
+	for(int cover = 0; cover < 2; cover++)
+	{
+		num_sheets[cover] = nest_parts(parts, num_parts, cover, sheet, &sheets[cover]);
+		if(num_sheets[cover] < 0)
+			return 1;
+	}
+
+	toolpath* tps[2];
+	for(int cover = 0; cover < 2; cover++)
+	{
+		tps[cover] = calloc(num_sheets[cover]+1, sizeof(toolpath));
+		for(int s = 0; s < num_sheets[cover]; s++)
+		{
+			tp_init(&tps[cover][s]);
+			tp_text(&tps[cover][s], "( %s  %s  %s  %s %u/%u )", argv[0], argv[1], argv[2], argv[3], s+1, num_sheets[cover]);
+			if(cover)
+				begin_cover(&tps[cover][s]);
+			else
+				begin_main(&tps[cover][s]);
+		}
+	}
+
+	// Move each part from its default place to its spot, and generate the packs there.
+	for(int k = 0; k < num_parts; k++)
+	{
+		nestpart* np = &parts[k];
+		partplace* at = &places[np->pack];
+		int cover = (np->part == PART_COVER);
+		for(int a = X; a <= Y; a++)
+			at->origin[np->part][a] += sheet_margin + np->at[a] - np->min[a];
+		at->tp[np->part] = &tps[cover][np->sheet];
+	}
+	for(int k = 0; k < num_packs; k++)
+	{
+		if(!do_covers)
+			places[k].tp[PART_COVER] = NULL;
+		gen_pack(&packs[k], bottom[k], &places[k]);
+	}
+
+	for(int cover = 0; cover < 2; cover++)
+	{
+		for(int s = 0; s < num_sheets[cover]; s++)
+		{
+			skyline* sk = &sheets[cover][s];
+			char filename[1000];
+			sprintf(filename, "%s_sheet%u_%s.ngc", argv[1], s+1, cover?"cover":"main");
+			printf("%s: %u parts, %.0f%% of the sheet\n", filename, sk->parts, 100.0*sk->used/(sheet[X]*sheet[Y]));
+			if(!finish_sheet(&tps[cover][s], filename, cover, reorder, fixed_dwells, hm, tm))
+				return 1;
+			tp_free(&tps[cover][s]);
+			free(sk->seg);
+		}
+		free(tps[cover]);
+		free(sheets[cover]);
+	}
+	printf("%u packs on %u sheets and %u cover sheets\n", num_packs, num_sheets[0], num_sheets[1]);
+
+	for(int k = 0; k < num_packs; k++)
+		layout_free(&packs[k]);
+	free(packs);
+	free(bottom);
+	free(parts);
+	free(places);
+	return 0;
+}
+
+// Calibration coupon (see coupon.h): cell holes at each lasertrim, power and feedrate,
+// cut in grid order at absolute power with the fixed dwell after each.
+// cnc_gen <prefix> coupon <lasertrim> <power> <feedrate>, each <value> or <from>:<to>:<count>
+int coupon_main(int argc, char** argv)
+{
+	if(argc != 3+COUPON_PARAMS)
+	{
+		printf("Usage: cnc_gen <outfile_prefix> coupon <lasertrim> <power> <feedrate>\n");
+		printf("Each is <value> or <from>:<to>:<count>\n");
+		return 1;
+	}
+
+	coupon cp;
+	memset(&cp, 0, sizeof(cp));
+	cp.names[0] = "lasertrim";
+	cp.names[1] = "power";
+	cp.names[2] = "feedrate";
+	cp.nominal = hole;
+	cp.pitch = hole + 4.0;
+	cp.per_side = 0.5;
+	cp.fast = 2;
+	for(int k = 0; k < COUPON_PARAMS; k++)
+	{
+		if(!sweep_parse(&cp.sweeps[k], argv[3+k], cp.names[k]))
+			return 1;
+	}
+	for(int k = 0; k < cp.sweeps[1].num; k++)
+	{
+		float pwr = sweep_at(&cp.sweeps[1], k);
+		if(pwr != floorf(pwr) || pwr < 1 || pwr > 99)
+		{
+			printf("Invalid power %.2f, the steps must be whole numbers from 1 to 99\n", pwr);
+			return 1;
+		}
+	}
+	if(!coupon_init(&cp))
+		return 1;
+
+	char filename[1000];
+	sprintf(filename, "%s_coupon.txt", argv[1]);
+	if(!coupon_write_table(filename, &cp, "cnc_gen"))
+		return 1;
+
+	toolpath tp;
+	toolpath* gpath = &tp;
+	tp_init(gpath);
+	tp_text(gpath, "( %s  %s  %s  %s  %s  %s )", argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+	begin_main(gpath);
+
+	float origin[2] = {10.0, 10.0};
+	for(int axis = X; axis <= Y; axis++)
+	{
+		int num = (axis == X)?cp.num_cols:cp.num_rows;
+		for(int idx = 0; idx < num; idx++)
+		{
+			for(int t = 0; t <= idx; t++)
+			{
+				float from[2], to[2];
+				coupon_tick(&cp, origin, axis, idx, t, from, to);
+				tp_rapid(gpath, from[X], from[Y]);
+				CUT_MARK();
+				tp_line(gpath, to[X], to[Y]);
+				tp_feed(gpath, feedrate);
+				UNCUT();
+			}
+		}
+	}
+
+	for(int row = 0; row < cp.num_rows; row++)
+	{
+		for(int col = 0; col < cp.num_cols; col++)
+		{
+			float v[COUPON_PARAMS], mid[2];
+			coupon_values(&cp, row, col, v);
+			coupon_hole(&cp, origin, row, col, mid);
+			float start_x_trimmed = mid[X] - hole/2.0 + v[0];
+			float offset_i = hole/2.0 - v[0];
+
+			tp_rapid(gpath, start_x_trimmed, mid[Y]);
+			tp_note(gpath, "%u;%u", col+1, row+1);
+			tp_on_abs(gpath, (int)v[1]);
+			tp_arc(gpath, OP_CW, start_x_trimmed, mid[Y], offset_i, 0.0);
+			tp_feed(gpath, v[2]);
+			UNCUT();
+			delay(gpath, delay_per_cell);
+		}
+	}
+
+	tp_rapid(gpath, origin[X], origin[Y]);
+	delay(gpath, 15.0);
+	tp_text(gpath, "M2");
+	tp_text(gpath, "%%");
+
+	sprintf(filename, "%s_coupon.ngc", argv[1]);
+	FILE* f = fopen(filename, "wb");
+	if(!f)
+	{
+		printf("Error opening file %s\n", filename);
+		return 1;
+	}
+	tp_write(f, gpath);
+	fclose(f);
+	tp_free(gpath);
+
+	float size[2];
+	coupon_size(&cp, size);
+	printf("%s: %u x %u holes, sheet needed: %.2f x %.2f\n", filename, cp.num_cols, cp.num_rows, origin[X]+size[X], origin[Y]+size[Y]);
+	printf("Measure the holes into %s_coupon.txt, then run: cnc_gen %s fit\n", argv[1], argv[1]);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	cellgap = 20.5-hole;
+	side_bonushole_dist = side_bonushole_size/2.0 + 15.0;
+
+	int ys[2];
+	int x;
+
+	// Heat model for the dwell planner, which replaces delay_per_cell (see heat_run()).
+	heatmodel heat;
+	heat.cell = 4.0;
+	heat.heat_per_mm = 8.0;
+	heat.diffusivity = 2.0;
+	heat.cooling = 60.0;
+	heat.budget = 0.0; // 0 = as hot as the fixed dwells let it get
+	heat.max_dwell = 60.0;
+	heat.lookahead = 16;
+	heat.pass_gap = delay_per_cell;
+
+	// Tube model for the power planner (see heat_run()). To be fitted with the calibration coupon.
+	tubemodel tube;
+	tube.heat_rate = 0.06;
+	tube.cooling = 300.0;
+	tube.loss = 0.01;
+	tube.sheet_gain = 0.005;
+	tube.max_power = 99;
+	tube.min_power = 1;
+	tube.max_wait = 120.0;
+
+	if(argc == 3 && !strcmp(argv[2], "fit"))
+	{
+		char filename[1000];
+		sprintf(filename, "%s_coupon.txt", argv[1]);
+		return !coupon_fit(filename);
+	}
+
+	if(argc < 5 || (!strcmp(argv[2], "coupon") && argc < 6))
+	{
+		printf("Usage: cnc_gen <outfile_prefix> <y1> <y2> <x> [b][k][f][c]\n");
+		printf("Ex.: cnc_gen out 4 3 11\n");
+		printf("__-_-_-_-_-_4_-_-_-_-_-__\n");
+		printf("| O   O   O   O   O   O |\n");
+		printf("|  .O  .O  .O  .O  .O   |\n");
+		printf("| O   O   O   O   O   O |\n");
+		printf("1  .O  .O  .O  .O  .O   3\n");
+		printf("| O   O   O   O   O   O |\n");
+		printf("|  .O  .O  .O  .O  .O   |\n");
+		printf("| O   O   O   O   O   O |\n");
+		printf("------------2------------\n");
+		printf("b = bottom sheet mode (tight special holes)\n");
+		printf("k = keep the generation order of the contours (no rapid travel optimization; the bottom mode\n");
+		printf("    cleanup pass right after its hole, as before, so that kf gives the old output)\n");
+		printf("f = fixed dwells after the cuts (delay_per_cell) instead of planning them with the heat model\n");
+		printf("c = common line: the side and the front one kerf from the main board, the edges between them cut once\n");
+		printf("\n");
+		printf("Nesting: cnc_gen <outfile_prefix> nest <width>x<height> <y1>,<y2>,<x>[b] [...] [k][f]\n");
+		printf("Cuts the parts of all the packs on as few sheets of the given size (mm) as possible:\n");
+		printf("<prefix>_sheet<n>_main.ngc, <prefix>_sheet<n>_cover.ngc, and <prefix>_pack<n>_layout.bin for weld\n");
+		printf("Ex.: cnc_gen batch nest 1000x600 12,11,28 12,11,28b\n");
+		printf("\n");
+		printf("Calibration: cnc_gen <outfile_prefix> coupon <lasertrim> <power> <feedrate>\n");
+		printf("Each is <value> or <from>:<to>:<count>. Cuts a grid of cell holes, one column per lasertrim\n");
+		printf("and one row per power and feedrate, to <prefix>_coupon.ngc, and lists them in <prefix>_coupon.txt.\n");
+		printf("Fill in the measured diameters there, then: cnc_gen <outfile_prefix> fit\n");
+		printf("Ex.: cnc_gen cal coupon 0.06:0.18:5 70:76:3 450:600:3\n");
+		return 1;
+	}
+
+	if(!strcmp(argv[2], "nest"))
+		return nest_main(argc, argv, &heat, &tube);
+
+	if(!strcmp(argv[2], "coupon"))
+		return coupon_main(argc, argv);
+
+	ys[0] = atoi(argv[2]);
+	if(ys[0] < 1 || ys[0] > 100) { printf("Invalid y1\n"); return 1;}
+
+	ys[1] = atoi(argv[3]);
+	if(ys[1] < 1 || ys[1] > 100) { printf("Invalid y2\n"); return 1;}
+	if(ys[1] < ys[0]-1 || ys[1] > ys[0]) { printf("y2 must be y1-1 or y1\n"); return 1;}
+
+	x = atoi(argv[4]);
+	if(x < 1 || x > 100) { printf("Invalid x\n"); return 1;}
+
+	int bottom = 0;
+	if(argc > 5 && strchr(argv[5], 'b'))
+	{
+		printf("bottom mode\n");
+		bottom = 1;
+	}
+
+	int reorder = 1;
+	if(argc > 5 && strchr(argv[5], 'k'))
+		reorder = split_passes = 0;
+
+	int fixed_dwells = 0;
+	if(argc > 5 && strchr(argv[5], 'f'))
+		fixed_dwells = 1;
 
+	int common = 0;
+	if(argc > 5 && strchr(argv[5], 'c'))
+		common = 1;
+
+	packspec spec;
+	make_spec(&spec, ys, x);
+
+	packlayout L;
+	if(!layout_build(&L, &spec))
+		return 1;
+
+	char mainfilename[1000];
+	char coverfilename[1000];
+	char layoutfilename[1000];
+	sprintf(mainfilename, "%s_main.ngc", argv[1]);
+	sprintf(coverfilename, "%s_cover.ngc", argv[1]);
+	sprintf(layoutfilename, "%s_layout.bin", argv[1]);
+
+	if(!layout_write(layoutfilename, &L))
+		return 1;
+
+	FILE* outfile = fopen(mainfilename, "wb");
+	if(!outfile)
+	{
+		printf("Error opening file %s\n", mainfilename);
+		return 1;
+	}
+
+	toolpath main_path, cover_path;
+	toolpath* gpath = &main_path;
+	toolpath* cpath = &cover_path;
+	tp_init(gpath);
+	tp_init(cpath);
+
+	FILE* coverfile = NULL;
+
+	if(do_covers)
+	{
+		coverfile = fopen(coverfilename, "wb");
+		if(!coverfile)
+		{
+			printf("Error opening file %s\n", coverfilename);
+			return 1;
+		}
 	}
 
-	fprintf(gfile, "G00 X%.2f Y%.2f\n", origin_x, origin_y);
-	delay(gfile, 15.0);
-	fprintf(gfile, "M2\n%%\n");
-	fclose(gfile);
+	printf("y_step = %f, x_step = %f\n", L.step[Y], L.step[X]);
+
+	tp_text(gpath, "( %s  %s  %s  %s )", argv[0], argv[1], argv[2], argv[3]);
+	begin_main(gpath);
+	if(do_covers)
+		begin_cover(cpath);
+
+	partplace place;
+	default_place(&place, &L, common);
+	place.tp[PART_BOARD] = place.tp[PART_SIDE] = place.tp[PART_FRONT] = gpath;
+	place.tp[PART_COVER] = cpath;
+	gen_pack(&L, bottom, &place);
+
+	float origin_x = place.origin[PART_BOARD][X];
+	float origin_y = place.origin[PART_BOARD][Y];
+	float cover_origin_x = place.origin[PART_COVER][X];
+	float cover_origin_y = place.origin[PART_COVER][Y];
+
+	printf("Main panel size without fingers: %.2f x %.2f\n", L.size[X], L.size[Y]);
+	printf("Total box size: %.2f x %.2f x %.2f\n", L.size[X]+2.0*thickness, L.size[Y]+2.0*thickness, cell_length+2.0*cover_thickness);
+	printf("Sheet needed: %.2f x %.2f\n", L.size[X]+2.0*thickness+cell_length+part_separation, L.size[Y]+2.0*thickness+cell_length+2.0*cover_thickness+part_separation);
+	if(do_covers)
+		printf("Cover size with fingers (sheet needed): %.2f x %.2f\n", L.size[X]+2.0*thickness, L.size[Y]+2.0*thickness);
+
+	TRAILER();
+	tp_rapid(gpath, origin_x, origin_y);
+	delay(gpath, 15.0);
+	tp_text(gpath, "M2");
+	tp_text(gpath, "%%");
 
-	printf("Power rise during cutting: %d -> %d\n", (int)((float)power), (int)((float)power+extrapower));
+	if(common)
+	{
+		toolpath shared;
+		tp_init(&shared);
+		float len = share_lines(gpath, &shared);
+		tp_free(gpath);
+		*gpath = shared;
+		float min[2], max[2];
+		tp_bounds(gpath, min, max);
+		printf("Common line: %.0f mm cut once for two parts, sheet used: %.2f x %.2f\n", len, max[X], max[Y]);
+	}
 
-	if((int)((float)power+extrapower) > 99)
-		printf("Warning: Power overflows!\n");
+	toolpath ordered;
+	tp_init(&ordered);
+	order_contours(gpath, &ordered, reorder, fixed_dwells, power, feedrate, rapid_rate, &heat, &tube);
+	tp_write(outfile, &ordered);
+	fclose(outfile);
+	tp_free(gpath);
+	tp_free(&ordered);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G00 X%.2f Y%.2f\n", cover_origin_x, cover_origin_y);
-		delay(coverfile, 15.0);
-		fprintf(coverfile, "M2\n%%\n");
+		tp_rapid(cpath, cover_origin_x, cover_origin_y);
+		delay(cpath, 15.0);
+		tp_text(cpath, "M2");
+		tp_text(cpath, "%%");
+		tp_write(coverfile, cpath);
 		fclose(coverfile);
 	}
 
+	tp_free(cpath);
+	layout_free(&L);
 	return 0;
 }
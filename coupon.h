@@ -0,0 +1,275 @@
+#ifndef COUPON_H
+#define COUPON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Calibration coupons shared by cnc_gen and router_gen.
+// A coupon is a grid of test holes of the nominal cell diameter. The columns sweep the
+// offset parameter (lasertrim, toolsize), the rows every combination of the two
+// process parameters (power and feedrate, feedrate and z_feed). Tick marks engraved
+// left of each row and below each column give its index: one tick per index, counting
+// from 1, every fifth tick longer.
+//
+// Along with the G-code the generators write <prefix>_coupon.txt, one line per hole
+// with its parameters. Fill in the measured diameters, and coupon_fit() reads it back:
+// each hole tells the offset that would have cut it at the nominal diameter,
+//   offset + per_side*(measured - nominal)
+// where per_side is 0.5 for an offset taken off each side (lasertrim) and 1 for a
+// diameter (toolsize). The rows are averaged, and the fastest row where every hole
+// came out is recommended, the one with the least spread among equally fast ones.
+
+#define COUPON_PARAMS 3        // offset, then the two process parameters
+#define COUPON_TICK_STEP 1.0   // mm between the ticks
+#define COUPON_TICK_LEN 3.0
+#define COUPON_TICK_LONG 4.5   // every fifth
+#define COUPON_BAND 6.0        // room for the ticks left of and below the holes
+
+typedef struct
+{
+	float from, to;
+	int num;
+} sweep;
+
+typedef struct
+{
+	const char* names[COUPON_PARAMS];
+	sweep sweeps[COUPON_PARAMS];
+	float nominal;    // diameter of the holes
+	float pitch;      // between the hole centres
+	float per_side;   // see above
+	int fast;         // the process parameter to maximize: 1 or 2
+	int num_cols, num_rows;
+} coupon;
+
+// "value" or "from:to:count". Returns 0 on a malformed sweep.
+int sweep_parse(sweep* s, const char* arg, const char* name)
+{
+	int n = sscanf(arg, "%f:%f:%d", &s->from, &s->to, &s->num);
+	if(n == 1)
+	{
+		s->to = s->from;
+		s->num = 1;
+	}
+	else if(n != 3 || s->num < 1 || (s->num == 1 && s->to != s->from))
+	{
+		printf("Invalid %s sweep %s, expected <value> or <from>:<to>:<count>\n", name, arg);
+		return 0;
+	}
+	return 1;
+}
+
+float sweep_at(const sweep* s, int k)
+{
+	if(s->num < 2)
+		return s->from;
+	return s->from + (s->to - s->from)*k/(s->num-1);
+}
+
+// Sizes the grid once the sweeps are set. Returns 0 if the ticks don't fit.
+int coupon_init(coupon* c)
+{
+	c->num_cols = c->sweeps[0].num;
+	c->num_rows = c->sweeps[1].num*c->sweeps[2].num;
+	int max_ticks = (int)((c->pitch - COUPON_TICK_STEP)/COUPON_TICK_STEP);
+	if(c->num_cols > max_ticks || c->num_rows > max_ticks)
+	{
+		printf("At most %d steps per side of the coupon at %.1f mm pitch\n", max_ticks, c->pitch);
+		return 0;
+	}
+	return 1;
+}
+
+// Parameters of the holes in a row and column.
+void coupon_values(const coupon* c, int row, int col, float* v)
+{
+	v[0] = sweep_at(&c->sweeps[0], col);
+	v[1] = sweep_at(&c->sweeps[1], row / c->sweeps[2].num);
+	v[2] = sweep_at(&c->sweeps[2], row % c->sweeps[2].num);
+}
+
+void coupon_hole(const coupon* c, const float* origin, int row, int col, float* mid)
+{
+	mid[0] = origin[0] + COUPON_BAND + c->pitch*(col+0.5);
+	mid[1] = origin[1] + COUPON_BAND + c->pitch*(row+0.5);
+}
+
+// Outer corner of the grid, with the bands.
+void coupon_size(const coupon* c, float* size)
+{
+	size[0] = COUPON_BAND + c->pitch*c->num_cols;
+	size[1] = COUPON_BAND + c->pitch*c->num_rows;
+}
+
+// Tick t of the index mark of column idx (axis 0) or row idx (axis 1), from "from"
+// to "to". There are idx+1 ticks.
+void coupon_tick(const coupon* c, const float* origin, int axis, int idx, int t, float* from, float* to)
+{
+	int other = !axis;
+	float len = (t%5 == 4)?COUPON_TICK_LONG:COUPON_TICK_LEN;
+	// Side by side across the pitch, centred on the hole.
+	from[axis] = to[axis] = origin[axis] + COUPON_BAND + c->pitch*(idx+0.5) + COUPON_TICK_STEP*(t - idx/2.0);
+	from[other] = origin[other] + COUPON_BAND - 1.0;
+	to[other] = from[other] - len;
+}
+
+int coupon_write_table(const char* filename, const coupon* c, const char* generator)
+{
+	FILE* f = fopen(filename, "w");
+	if(!f)
+	{
+		printf("Error opening file %s\n", filename);
+		return 0;
+	}
+	fprintf(f, "# %s calibration coupon. Replace the - at the end of each line with the measured\n", generator);
+	fprintf(f, "# diameter of the hole, or with x if it didn't come out. Then run: %s <prefix> fit\n", generator);
+	fprintf(f, "# nominal %f per_side %f fast %d\n", c->nominal, c->per_side, c->fast);
+	fprintf(f, "# col row %s %s %s diameter\n", c->names[0], c->names[1], c->names[2]);
+	for(int row = 0; row < c->num_rows; row++)
+	{
+		for(int col = 0; col < c->num_cols; col++)
+		{
+			float v[COUPON_PARAMS];
+			coupon_values(c, row, col, v);
+			fprintf(f, "%d %d %g %g %g -\n", col+1, row+1, v[0], v[1], v[2]);
+		}
+	}
+	if(fclose(f))
+	{
+		printf("Error writing %s\n", filename);
+		return 0;
+	}
+	return 1;
+}
+
+typedef struct
+{
+	float v[COUPON_PARAMS-1]; // process parameters
+	int holes, measured, failed;
+	double sum, sum2;         // of the fitted offsets
+} couponrow;
+
+// Reads the measured coupon table and prints the fit. Returns 0 if there is nothing to fit.
+int coupon_fit(const char* filename)
+{
+	FILE* f = fopen(filename, "r");
+	if(!f)
+	{
+		printf("Error opening file %s\n", filename);
+		return 0;
+	}
+
+	char line[1000];
+	char names[COUPON_PARAMS][64];
+	float nominal = 0.0, per_side = 0.0;
+	int fast = 0, have_names = 0;
+	int num_rows = 0;
+	couponrow* rows = NULL;
+	int lineno = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		lineno++;
+		if(line[0] == '#')
+		{
+			float a, b;
+			int d;
+			if(sscanf(line, "# nominal %f per_side %f fast %d", &a, &b, &d) == 3)
+			{
+				nominal = a;
+				per_side = b;
+				fast = d;
+			}
+			else if(sscanf(line, "# col row %63s %63s %63s", names[0], names[1], names[2]) == 3)
+				have_names = 1;
+			continue;
+		}
+
+		int col, row;
+		float v[COUPON_PARAMS];
+		char meas[64];
+		int n = sscanf(line, "%d %d %f %f %f %63s", &col, &row, &v[0], &v[1], &v[2], meas);
+		if(n <= 0)
+			continue;
+		if(n != 6 || row < 1 || row > 10000)
+		{
+			printf("%s:%d: expected <col> <row> <3 parameters> <diameter|-|x>\n", filename, lineno);
+			fclose(f);
+			free(rows);
+			return 0;
+		}
+		if(row > num_rows)
+		{
+			rows = realloc(rows, row*sizeof(couponrow));
+			memset(&rows[num_rows], 0, (row-num_rows)*sizeof(couponrow));
+			num_rows = row;
+		}
+		couponrow* r = &rows[row-1];
+		r->v[0] = v[1];
+		r->v[1] = v[2];
+		r->holes++;
+		if(meas[0] == 'x' || meas[0] == 'X')
+			r->failed++;
+		else if(meas[0] != '-')
+		{
+			double fit = v[0] + per_side*(atof(meas) - nominal);
+			r->measured++;
+			r->sum += fit;
+			r->sum2 += fit*fit;
+		}
+	}
+	fclose(f);
+
+	if(!have_names || nominal <= 0.0 || fast < 1 || fast >= COUPON_PARAMS)
+	{
+		printf("%s: not a coupon table\n", filename);
+		free(rows);
+		return 0;
+	}
+
+	printf("%-10s %-10s %8s %8s %10s\n", names[1], names[2], "holes", "failed", names[0]);
+	int best = -1;
+	double best_spread = 0.0;
+	for(int k = 0; k < num_rows; k++)
+	{
+		couponrow* r = &rows[k];
+		if(!r->holes)
+			continue;
+		printf("%-10.2f %-10.2f %4d/%-3d %8d", r->v[0], r->v[1], r->measured, r->holes, r->failed);
+		if(!r->measured)
+		{
+			printf("\n");
+			continue;
+		}
+		double mean = r->sum/r->measured;
+		double spread = sqrt(fmax(0.0, r->sum2/r->measured - mean*mean));
+		printf(" %10.3f +- %.3f\n", mean, spread);
+
+		// Every hole of the row measured and none failed.
+		if(r->failed || r->measured < r->holes)
+			continue;
+		if(best < 0 || r->v[fast-1] > rows[best].v[fast-1]
+			|| (r->v[fast-1] == rows[best].v[fast-1] && spread < best_spread))
+		{
+			best = k;
+			best_spread = spread;
+		}
+	}
+
+	if(best < 0)
+	{
+		printf("No row with all the holes measured and none failed\n");
+		free(rows);
+		return 0;
+	}
+	couponrow* r = &rows[best];
+	printf("\nBest: row %d\n", best+1);
+	printf("\t%s = %.3f;\n", names[0], r->sum/r->measured);
+	printf("\t%s = %.2f;\n", names[1], r->v[0]);
+	printf("\t%s = %.2f;\n", names[2], r->v[1]);
+	free(rows);
+	return 1;
+}
+
+#endif
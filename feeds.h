@@ -0,0 +1,137 @@
+#ifndef FEEDS_H
+#define FEEDS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Feeds and depths of cut for router_gen.
+// feeds_init() works out, from the tool (diameter, flutes), the spindle speed and the
+// material, the feed of each kind of feature and how deep and wide each pass may cut:
+//   feed = rpm * flutes * chip load * feature factor
+// The chip load of a material is given per mm of tool diameter at full slot width. A
+// pass that engages less than half the diameter makes thinner chips, so its feed is
+// raised by D/(2*sqrt(ae*(D-ae))) (radial chip thinning) to keep the chip load, at most
+// twice. Slots and outlines take the full width of the tool. The pocket passes take
+// the narrow engagement and deeper cut of the material, or the full width at the slot
+// depth, whichever removes more per minute. The feeds are capped at what the machine
+// does.
+
+#define FEAT_SLOT    0 // a groove the width of the tool: the thru-hole, the snapoff cutouts
+#define FEAT_POCKET  1 // clearing beside a cut: the spiral out to the cell pocket
+#define FEAT_OUTLINE 2 // the straight runs of an outline, cut through
+#define FEAT_FINGER  3 // the short runs and inside corners of the fingers
+#define FEATS 4
+
+#define CHIP_THINNING_MAX 2.0
+
+typedef struct
+{
+	const char* name;
+	float chipload;      // mm per tooth and per mm of tool diameter, at full slot width
+	float slot_depth;    // axial depth of a pass at full width, in tool diameters
+	float pocket_depth;  // axial depth of a pass at pocket_width, in tool diameters
+	float pocket_width;  // narrow radial engagement for the pocket passes, in tool diameters
+	float ramp;          // degrees, steepest ramp or helix into the material
+	float plunge;        // straight down feed, relative to the slot feed
+} material;
+
+const material materials[] =
+{
+	// name       chipload  slot  pocket  width  ramp  plunge
+	{"plywood",   0.020,    1.0,  2.0,    0.25,  5.0,  0.3},
+	{"mdf",       0.025,    1.0,  2.0,    0.25,  5.0,  0.3},
+	{"hdpe",      0.040,    1.0,  2.5,    0.3,   5.0,  0.4},
+	{"acrylic",   0.015,    0.5,  1.5,    0.2,   3.0,  0.25},
+	{"aluminium", 0.005,    0.25, 2.0,    0.1,   2.0,  0.2},
+};
+
+// Feed of each feature relative to the chip load feed.
+const float feature_factor[FEATS] = {1.0, 1.0, 0.8, 0.6};
+const char* feature_names[FEATS] = {"slot", "pocket", "outline", "finger"};
+
+typedef struct
+{
+	float feed[FEATS];       // mm/min
+	float step_down[FEATS];  // mm per pass
+	float width[FEATS];      // mm, radial engagement
+	float plunge;            // mm/min, straight down
+	float ramp;              // steepest ramp, depth per length
+} feeds;
+
+// Returns NULL and lists the materials if there is no such one.
+const material* material_find(const char* name)
+{
+	int n = sizeof(materials)/sizeof(materials[0]);
+	for(int k = 0; k < n; k++)
+		if(!strcmp(materials[k].name, name))
+			return &materials[k];
+	printf("Unknown material %s, expected one of:", name);
+	for(int k = 0; k < n; k++)
+		printf(" %s", materials[k].name);
+	printf("\n");
+	return NULL;
+}
+
+// Feed multiplier for a pass engaging width mm of a tool of diameter d.
+float chip_thinning(float width, float d)
+{
+	if(width >= d/2.0)
+		return 1.0;
+	float f = d/(2.0*sqrtf(width*(d - width)));
+	return (f > CHIP_THINNING_MAX)?CHIP_THINNING_MAX:f;
+}
+
+void feeds_init(feeds* f, const material* m, float tool, int flutes, float rpm, float max_feed, float max_z_feed)
+{
+	float slot = rpm*flutes*m->chipload*tool;
+	for(int k = 0; k < FEATS; k++)
+	{
+		f->width[k] = tool;
+		f->step_down[k] = m->slot_depth*tool;
+		f->feed[k] = fminf(slot*feature_factor[k], max_feed);
+	}
+
+	float width = m->pocket_width*tool, depth = m->pocket_depth*tool;
+	float feed = fminf(slot*feature_factor[FEAT_POCKET]*chip_thinning(width, tool), max_feed);
+	if(feed*width*depth > f->feed[FEAT_POCKET]*f->width[FEAT_POCKET]*f->step_down[FEAT_POCKET])
+	{
+		f->width[FEAT_POCKET] = width;
+		f->step_down[FEAT_POCKET] = depth;
+		f->feed[FEAT_POCKET] = feed;
+	}
+
+	f->plunge = fminf(slot*m->plunge, max_z_feed);
+	f->ramp = tanf(m->ramp*3.14159265358979/180.0);
+}
+
+// One feed for everything and each depth in one pass, the pocket at half the tool
+// diameter: how router_gen cut before the feeds were worked out.
+void feeds_fixed(feeds* f, float tool, float feed, float z_feed)
+{
+	for(int k = 0; k < FEATS; k++)
+	{
+		f->feed[k] = feed;
+		f->step_down[k] = 1e9;
+		f->width[k] = (k == FEAT_POCKET)?(tool/2.0):tool;
+	}
+	f->plunge = z_feed;
+	f->ramp = 1e9;
+}
+
+void feeds_print(const feeds* f)
+{
+	for(int k = 0; k < FEATS; k++)
+		printf("%-8s F%-6.0f %.2f mm deep, %.2f mm wide per pass\n", feature_names[k], f->feed[k],
+			f->step_down[k], f->width[k]);
+	printf("plunge   F%-6.0f ramp at most %.1f degrees\n", f->plunge, atanf(f->ramp)*180.0/3.14159265358979);
+}
+
+// Passes to take depth in at most step each.
+int feeds_passes(float depth, float step)
+{
+	int n = (int)ceilf(depth/step - 1e-4);
+	return (n < 1)?1:n;
+}
+
+#endif
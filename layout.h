@@ -0,0 +1,227 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Pack layout shared by cnc_gen, router_gen and weld.
+// layout_build() computes the cell centres, outline, finger positions and
+// alignpoints of a pack once from its spec. Coordinates are in mm from the
+// bottom-left corner of the cell board outline (origin_x, origin_y of the
+// generators). The generators save the layout next to the G-code as
+// <prefix>_layout.bin, and weld reads it instead of the WELDPOINT comments.
+
+#define LAYOUT_MAGIC "PACKLAY"
+#define LAYOUT_VERSION 1
+
+typedef struct
+{
+	float cell;           // hole diameter
+	float cellgap;        // between the holes in a column
+	float wallgaps[4];    // from the outline to the holes: left, bottom, right, top
+	float spacing_trim;   // extra gap between the columns
+	float finger_size[2];
+	float walls[2];       // thickness of the fronts (x) and the sides (y) around the board, 0 for none
+	int ys[2];            // cells in the even and odd columns
+	int x;                // columns
+} packspec;
+
+typedef struct
+{
+	packspec spec;
+	float step[2];        // column pitch, row pitch
+	float size[2];        // outline
+	float align[4][2];    // corners of the finished box: ALIGNPOINT 0;0, 1;0, 1;1, 0;1
+	int num_cells;
+	int (*idx)[2];        // in column order, as cut
+	float (*mid)[2];
+	float* col;           // x of the hole centres in each column
+	float* row;           // y of the hole centres in the even columns
+	float* finger[2];     // start of the finger at each column (x), at each row (y)
+} packlayout;
+
+// On disk: the header, then idx, mid, col, row, finger[X] and finger[Y] as is.
+// Native byte order; the layout is read on the machine family it was made on.
+typedef struct
+{
+	char magic[8];
+	int version;
+	int num_cells;
+	packspec spec;
+	float step[2];
+	float size[2];
+	float align[4][2];
+} layoutheader;
+
+void layout_free(packlayout* l)
+{
+	free(l->idx);
+	free(l->mid);
+	free(l->col);
+	free(l->row);
+	free(l->finger[0]);
+	free(l->finger[1]);
+	memset(l, 0, sizeof(*l));
+}
+
+// Allocates the arrays for spec and num_cells. Returns 0 when out of memory.
+int layout_alloc(packlayout* l, int num_cells)
+{
+	l->num_cells = num_cells;
+	l->idx = malloc(num_cells*sizeof(*l->idx) + 1);
+	l->mid = malloc(num_cells*sizeof(*l->mid) + 1);
+	l->col = malloc(l->spec.x*sizeof(float) + 1);
+	l->row = malloc(l->spec.ys[0]*sizeof(float) + 1);
+	l->finger[0] = malloc(l->spec.x*sizeof(float) + 1);
+	l->finger[1] = malloc(l->spec.ys[0]*sizeof(float) + 1);
+	if(!l->idx || !l->mid || !l->col || !l->row || !l->finger[0] || !l->finger[1])
+	{
+		printf("Out of memory\n");
+		layout_free(l);
+		return 0;
+	}
+	return 1;
+}
+
+// Hex layout: every other column is shifted by half a row and holds ys[1] cells.
+int layout_build(packlayout* l, const packspec* spec)
+{
+	memset(l, 0, sizeof(*l));
+	l->spec = *spec;
+	const packspec* s = &l->spec;
+	float hole = s->cell;
+
+	l->step[1] = hole + s->cellgap;
+	l->step[0] = sqrt(  (3.0*(hole/2.0)*(hole/2.0)) + (2.0*(hole/2.0)*s->cellgap)  ) * 1.05 * s->spacing_trim; // todo: fix math...
+
+	if(!layout_alloc(l, (s->x+1)/2*s->ys[0] + s->x/2*s->ys[1]))
+		return 0;
+
+	for(int curx = 0; curx < s->x; curx++)
+	{
+		l->col[curx] = s->wallgaps[0] + l->step[0]*curx + hole/2.0;
+		l->finger[0][curx] = l->col[curx] - s->finger_size[0]/2.0;
+	}
+	for(int cury = 0; cury < s->ys[0]; cury++)
+	{
+		l->row[cury] = s->wallgaps[1] + l->step[1]*cury + hole/2.0;
+		l->finger[1][cury] = l->row[cury] - s->finger_size[1]/2.0;
+	}
+
+	int c = 0;
+	for(int curx = 0; curx < s->x; curx++)
+	{
+		float y_offset = (curx%2)?(l->step[1]/2.0):(0.0);
+		for(int cury = 0; cury < s->ys[curx%2]; cury++, c++)
+		{
+			l->idx[c][0] = curx;
+			l->idx[c][1] = cury;
+			l->mid[c][0] = l->col[curx];
+			l->mid[c][1] = s->wallgaps[1] + l->step[1]*cury + hole/2.0 + y_offset;
+		}
+	}
+
+	l->size[0] = s->wallgaps[0] + l->step[0]*(s->x-1) + hole + s->wallgaps[2];
+	l->size[1] = s->wallgaps[1] + l->step[1]*(s->ys[0]-1) + hole + s->wallgaps[3];
+	if(s->ys[1] == s->ys[0])
+		l->size[1] += l->step[1]/2.0;
+
+	for(int k = 0; k < 4; k++)
+	{
+		int right = (k == 1 || k == 2), top = (k >= 2);
+		l->align[k][0] = right?(l->size[0]+s->walls[0]):-s->walls[0];
+		l->align[k][1] = top?(l->size[1]+s->walls[1]):-s->walls[1];
+	}
+	return 1;
+}
+
+int layout_write(const char* filename, const packlayout* l)
+{
+	FILE* f = fopen(filename, "wb");
+	if(!f)
+	{
+		printf("Error opening file %s\n", filename);
+		return 0;
+	}
+
+	layoutheader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LAYOUT_MAGIC, sizeof(h.magic));
+	h.version = LAYOUT_VERSION;
+	h.num_cells = l->num_cells;
+	h.spec = l->spec;
+	memcpy(h.step, l->step, sizeof(h.step));
+	memcpy(h.size, l->size, sizeof(h.size));
+	memcpy(h.align, l->align, sizeof(h.align));
+
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	ok &= fwrite(l->idx, sizeof(*l->idx), l->num_cells, f) == (size_t)l->num_cells;
+	ok &= fwrite(l->mid, sizeof(*l->mid), l->num_cells, f) == (size_t)l->num_cells;
+	ok &= fwrite(l->col, sizeof(float), l->spec.x, f) == (size_t)l->spec.x;
+	ok &= fwrite(l->row, sizeof(float), l->spec.ys[0], f) == (size_t)l->spec.ys[0];
+	ok &= fwrite(l->finger[0], sizeof(float), l->spec.x, f) == (size_t)l->spec.x;
+	ok &= fwrite(l->finger[1], sizeof(float), l->spec.ys[0], f) == (size_t)l->spec.ys[0];
+	ok &= fclose(f) == 0;
+	if(!ok)
+		printf("Error writing %s\n", filename);
+	return ok;
+}
+
+// Returns 1 if the file starts like a layout file.
+int layout_is(const void* data, size_t len)
+{
+	return len >= sizeof(layoutheader) && !memcmp(data, LAYOUT_MAGIC, 8);
+}
+
+// Reads a layout file from memory. Returns 0 on a damaged or unknown file.
+int layout_parse(packlayout* l, const void* data, size_t len, const char* filename)
+{
+	memset(l, 0, sizeof(*l));
+	if(!layout_is(data, len))
+	{
+		printf("%s is not a layout file\n", filename);
+		return 0;
+	}
+
+	layoutheader h;
+	memcpy(&h, data, sizeof(h));
+	if(h.version != LAYOUT_VERSION)
+	{
+		printf("%s: layout version %d, expected %d\n", filename, h.version, LAYOUT_VERSION);
+		return 0;
+	}
+
+	const packspec* s = &h.spec;
+	if(s->x < 1 || s->x > 1000 || s->ys[0] < 1 || s->ys[0] > 1000 || s->ys[1] < 0 || s->ys[1] > 1000
+		|| h.num_cells < 0 || h.num_cells > 1000000)
+	{
+		printf("%s: invalid layout size\n", filename);
+		return 0;
+	}
+	size_t need = sizeof(h) + h.num_cells*(sizeof(*l->idx)+sizeof(*l->mid)) + 2*(s->x+s->ys[0])*sizeof(float);
+	if(len != need)
+	{
+		printf("%s: %zu bytes, expected %zu\n", filename, len, need);
+		return 0;
+	}
+
+	l->spec = h.spec;
+	memcpy(l->step, h.step, sizeof(l->step));
+	memcpy(l->size, h.size, sizeof(l->size));
+	memcpy(l->align, h.align, sizeof(l->align));
+	if(!layout_alloc(l, h.num_cells))
+		return 0;
+
+	const char* p = (const char*)data + sizeof(h);
+	memcpy(l->idx, p, h.num_cells*sizeof(*l->idx)); p += h.num_cells*sizeof(*l->idx);
+	memcpy(l->mid, p, h.num_cells*sizeof(*l->mid)); p += h.num_cells*sizeof(*l->mid);
+	memcpy(l->col, p, s->x*sizeof(float)); p += s->x*sizeof(float);
+	memcpy(l->row, p, s->ys[0]*sizeof(float)); p += s->ys[0]*sizeof(float);
+	memcpy(l->finger[0], p, s->x*sizeof(float)); p += s->x*sizeof(float);
+	memcpy(l->finger[1], p, s->ys[0]*sizeof(float));
+	return 1;
+}
+
+#endif
@@ -1,4 +1,6 @@
 #!/bin/sh
 gcc -std=c99 router_gen.c -lm -o router_gen
 #gcc -std=c99 cnc_gen.c -lm -o cnc_gen
-#gcc -std=c99 weld.c -lm -o weld
+#gcc -std=c99 weld.c -lm -lpthread -o weld
+#gcc -std=c99 weld_sim.c -lm -o weld_sim
+#gcc -std=c99 ngc_time.c -lm -o ngc_time
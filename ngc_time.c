@@ -0,0 +1,630 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+
+// Cycle time estimator for the .ngc files of cnc_gen and router_gen.
+// Reads the G-code dialect they emit (G00/G01/G02/G03 with I/J and helical Z,
+// G04, M03/M05, modal F, G90/G91, G21), runs it through a machine model with
+// trapezoidal acceleration on every move, and reports the time split into rapid,
+// cut, dwell and laser (spindle) on, per section: every rapid to a new XY position
+// starts a section, which is a hole when all of its cuts fit in hole_max.
+// Optionally draws a backplot as SVG.
+// ngc_time --bench runs the estimator over the .ngc files in the current directory
+// and over a synthetic 100x100 cell job, and reports its throughput.
+
+#define X 0
+#define Y 1
+#define Z 2
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Machine model. Every move starts and ends at standstill (exact stop, G61).
+float axis_speed[3] = {2000.0, 2000.0, 600.0}; // mm/min, rapid and feed limit per axis
+float axis_accel[3] = {500.0, 500.0, 200.0};   // mm/s^2
+float default_feed = 500.0;                    // mm/min, until the file sets F
+float hole_max = 30.0;                         // mm, largest section counted as a hole
+
+typedef struct
+{
+	const char* name;
+	float* val;
+} param;
+
+param params[] =
+{
+	{"speed_x", &axis_speed[X]},
+	{"speed_y", &axis_speed[Y]},
+	{"speed_z", &axis_speed[Z]},
+	{"accel_x", &axis_accel[X]},
+	{"accel_y", &axis_accel[Y]},
+	{"accel_z", &axis_accel[Z]},
+	{"feed", &default_feed},
+	{"hole_max", &hole_max},
+	{NULL, NULL}
+};
+
+#define SEC_OTHER 0
+#define SEC_HOLE 1
+#define SEC_OUTLINE 2
+#define NUM_SECS 3
+
+const char* sec_names[NUM_SECS] = {"other", "holes", "outlines"};
+
+typedef struct
+{
+	double rapid;
+	double cut;
+	double dwell;
+	double laser_on;
+	double cut_length;
+	int count;
+} times;
+
+#define HIST_BINS 12
+
+typedef struct
+{
+	int lines;
+	int unknown;
+	times sec[NUM_SECS];
+	int num_holes;
+	int holes_size;
+	float* hole_time;
+	float min[2];
+	float max[2];
+} jobstats;
+
+// Current section, until the next rapid to a new position.
+typedef struct
+{
+	times t;
+	float min[2];
+	float max[2];
+	int cuts;
+} section;
+
+// Time to travel d with a trapezoidal (or triangular) speed profile.
+double move_time(double d, double v, double a)
+{
+	if(d <= 0.0)
+		return 0.0;
+	if(d < v*v/a)
+		return 2.0*sqrt(d/a);
+	return d/v + v/a;
+}
+
+// Speed and acceleration along direction u, as limited by the axes.
+void path_limits(const double* u, double* v, double* a)
+{
+	*v = 1e9;
+	*a = 1e9;
+	for(int i = X; i <= Z; i++)
+	{
+		double c = fabs(u[i]);
+		if(c < 1e-9)
+			continue;
+		if(axis_speed[i]/60.0/c < *v) *v = axis_speed[i]/60.0/c;
+		if(axis_accel[i]/c < *a) *a = axis_accel[i]/c;
+	}
+}
+
+// Backplot.
+FILE* plot;
+
+// Y down for SVG, rounded as printed, so that Y = 0 does not come out as -0.00.
+double plot_y(double y)
+{
+	return (fabs(y) < 0.005)?0.0:-y;
+}
+
+void plot_line(const double* from, const double* to, int rapid, int laser)
+{
+	if(!plot)
+		return;
+	fprintf(plot, "<line x1=\"%.2f\" y1=\"%.2f\" x2=\"%.2f\" y2=\"%.2f\" class=\"%s\"/>\n",
+		from[X], plot_y(from[Y]), to[X], plot_y(to[Y]), rapid?"r":(laser?"c":"f"));
+}
+
+void close_section(jobstats* st, section* s)
+{
+	int kind = SEC_OTHER;
+	if(s->cuts)
+		kind = (s->max[X]-s->min[X] <= hole_max && s->max[Y]-s->min[Y] <= hole_max)?SEC_HOLE:SEC_OUTLINE;
+
+	times* t = &st->sec[kind];
+	t->rapid += s->t.rapid;
+	t->cut += s->t.cut;
+	t->dwell += s->t.dwell;
+	t->laser_on += s->t.laser_on;
+	t->cut_length += s->t.cut_length;
+	if(s->cuts)
+		t->count++;
+
+	if(kind == SEC_HOLE)
+	{
+		if(st->num_holes == st->holes_size)
+		{
+			st->holes_size = st->holes_size?2*st->holes_size:256;
+			st->hole_time = realloc(st->hole_time, st->holes_size*sizeof(float));
+		}
+		st->hole_time[st->num_holes++] = s->t.rapid + s->t.cut + s->t.dwell;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->min[X] = s->min[Y] = 1e9;
+	s->max[X] = s->max[Y] = -1e9;
+}
+
+void extend(section* s, jobstats* st, const double* p)
+{
+	for(int i = X; i <= Y; i++)
+	{
+		if(p[i] < s->min[i]) s->min[i] = p[i];
+		if(p[i] > s->max[i]) s->max[i] = p[i];
+		if(p[i] < st->min[i]) st->min[i] = p[i];
+		if(p[i] > st->max[i]) st->max[i] = p[i];
+	}
+}
+
+// The words of one line: the value after each address letter, and a bit per letter present.
+typedef struct
+{
+	unsigned present;
+	double val[26];
+} words;
+
+#define HAS(w, letter) ((w).present & (1u<<((letter)-'A')))
+
+// Reads the number after an address letter: [-]digits[.digits].
+const char* scan_number(const char* p, const char* eol, double* val)
+{
+	int neg = 0;
+	while(p < eol && *p == ' ')
+		p++;
+	if(p < eol && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+	double v = 0.0;
+	while(p < eol && *p >= '0' && *p <= '9')
+		v = v*10.0 + (*p++ - '0');
+	if(p < eol && *p == '.')
+	{
+		double scale = 0.1;
+		for(p++; p < eol && *p >= '0' && *p <= '9'; p++, scale *= 0.1)
+			v += (*p - '0')*scale;
+	}
+	*val = neg?-v:v;
+	return p;
+}
+
+void scan_words(const char* line, const char* eol, words* w)
+{
+	w->present = 0;
+	for(const char* p = line; p < eol; )
+	{
+		char c = *p;
+		if(c == '(')
+		{
+			p = memchr(p, ')', eol-p);
+			if(!p)
+				return;
+			p++;
+			continue;
+		}
+		if(c >= 'a' && c <= 'z')
+			c -= 'a'-'A';
+		if(c >= 'A' && c <= 'Z')
+		{
+			p = scan_number(p+1, eol, &w->val[c-'A']);
+			w->present |= 1u<<(c-'A');
+			continue;
+		}
+		p++;
+	}
+}
+
+void analyze(const char* text, size_t len, jobstats* st)
+{
+	memset(st, 0, sizeof(*st));
+	st->min[X] = st->min[Y] = 1e9;
+	st->max[X] = st->max[Y] = -1e9;
+
+	section s;
+	close_section(st, &s);
+
+	double pos[3] = {0.0, 0.0, 0.0};
+	double feed = default_feed;
+	int motion = 0;      // modal G00..G03
+	int relative = 0;    // G91
+	int laser = 0;
+
+	const char* end = text+len;
+	for(const char* line = text; line < end; )
+	{
+		const char* eol = memchr(line, '\n', end-line);
+		if(!eol)
+			eol = end;
+		st->lines++;
+
+		// The files have at most one G and one M word per line.
+		words w;
+		scan_words(line, eol, &w);
+		double g = HAS(w, 'G')?w.val['G'-'A']:-1.0;
+		double m = HAS(w, 'M')?w.val['M'-'A']:-1.0;
+
+		double dt = 0.0;
+		int is_motion = 0;
+		if(g == 0.0 || g == 1.0 || g == 2.0 || g == 3.0)
+			{motion = (int)g; is_motion = 1;}
+		else if(g == 4.0)
+		{
+			if(HAS(w, 'P'))
+			{
+				s.t.dwell += w.val['P'-'A'];
+				dt = w.val['P'-'A'];
+			}
+		}
+		else if(g == 90.0)
+			relative = 0;
+		else if(g == 91.0)
+			relative = 1;
+		else if(g >= 0.0 && g != 21.0 && g != 61.0 && g != 64.0 && g != 17.0)
+			st->unknown++;
+
+		if(m == 3.0 || m == 4.0)
+			laser = 1;
+		else if(m == 5.0 || m == 2.0 || m == 30.0)
+			laser = 0;
+
+		if(HAS(w, 'F') && w.val['F'-'A'] > 0.0)
+			feed = w.val['F'-'A'];
+
+		double to[3] = {pos[X], pos[Y], pos[Z]};
+		int moved = 0;
+		for(int i = X; i <= Z; i++)
+		{
+			if(HAS(w, 'X'+i))
+			{
+				double v = w.val['X'-'A'+i];
+				to[i] = relative?(pos[i]+v):v;
+				moved = 1;
+			}
+		}
+		if(moved || (is_motion && motion >= 2))
+		{
+			if(motion == 0)
+			{
+				// A rapid to a new XY position starts a section.
+				if(hypot(to[X]-pos[X], to[Y]-pos[Y]) > 1.0)
+					close_section(st, &s);
+
+				double d = sqrt((to[X]-pos[X])*(to[X]-pos[X]) + (to[Y]-pos[Y])*(to[Y]-pos[Y]) + (to[Z]-pos[Z])*(to[Z]-pos[Z]));
+				double u[3] = {0.0, 0.0, 0.0}, vmax, amax;
+				if(d > 0.0)
+					for(int i = X; i <= Z; i++) u[i] = (to[i]-pos[i])/d;
+				path_limits(u, &vmax, &amax);
+				dt = move_time(d, vmax, amax);
+				s.t.rapid += dt;
+				plot_line(pos, to, 1, 0);
+			}
+			else if(motion == 1)
+			{
+				double d = sqrt((to[X]-pos[X])*(to[X]-pos[X]) + (to[Y]-pos[Y])*(to[Y]-pos[Y]) + (to[Z]-pos[Z])*(to[Z]-pos[Z]));
+				double u[3] = {0.0, 0.0, 0.0}, vmax, amax;
+				if(d > 0.0)
+					for(int i = X; i <= Z; i++) u[i] = (to[i]-pos[i])/d;
+				path_limits(u, &vmax, &amax);
+				if(feed/60.0 < vmax)
+					vmax = feed/60.0;
+				dt = move_time(d, vmax, amax);
+				s.t.cut += dt;
+				s.t.cut_length += d;
+				s.cuts++;
+				extend(&s, st, pos);
+				extend(&s, st, to);
+				plot_line(pos, to, 0, laser);
+			}
+			else
+			{
+				double i = HAS(w, 'I')?w.val['I'-'A']:0.0;
+				double j = HAS(w, 'J')?w.val['J'-'A']:0.0;
+				double c[2] = {pos[X]+i, pos[Y]+j};
+				double r = hypot(i, j);
+				double a0 = atan2(pos[Y]-c[Y], pos[X]-c[X]);
+				double a1 = atan2(to[Y]-c[Y], to[X]-c[X]);
+				double sweep = (motion == 2)?(a0-a1):(a1-a0);
+				while(sweep <= 1e-6)
+					sweep += 2.0*M_PI;
+				double d = hypot(r*sweep, to[Z]-pos[Z]);
+
+				// Both XY axes take part in an arc; the centripetal acceleration caps the speed.
+				double vmax = ((axis_speed[X] < axis_speed[Y])?axis_speed[X]:axis_speed[Y])/60.0;
+				double amax = (axis_accel[X] < axis_accel[Y])?axis_accel[X]:axis_accel[Y];
+				if(feed/60.0 < vmax)
+					vmax = feed/60.0;
+				if(r > 0.0 && sqrt(amax*r) < vmax)
+					vmax = sqrt(amax*r);
+				dt = move_time(d, vmax, amax);
+				s.t.cut += dt;
+				s.t.cut_length += d;
+				s.cuts++;
+
+				int n = (int)(r*sweep/2.0)+4;
+				double prev[3] = {pos[X], pos[Y], pos[Z]};
+				for(int k = 1; k <= n; k++)
+				{
+					double a = a0 + ((motion == 2)?-1.0:1.0)*sweep*k/n;
+					double p[3] = {c[X]+r*cos(a), c[Y]+r*sin(a), pos[Z]+(to[Z]-pos[Z])*k/n};
+					extend(&s, st, p);
+					plot_line(prev, p, 0, laser);
+					memcpy(prev, p, sizeof(prev));
+				}
+			}
+			memcpy(pos, to, sizeof(pos));
+		}
+
+		if(laser)
+			s.t.laser_on += dt;
+		line = eol+1;
+	}
+	close_section(st, &s);
+}
+
+void print_times(const char* name, const times* t)
+{
+	printf("  %-14s %5u %9.1f %9.1f %9.1f %9.1f %9.1f %9.0f\n", name, t->count,
+		t->rapid+t->cut+t->dwell, t->rapid, t->cut, t->dwell, t->laser_on, t->cut_length);
+}
+
+int cmp_float(const void* a, const void* b)
+{
+	float fa = *(const float*)a, fb = *(const float*)b;
+	return (fa > fb) - (fa < fb);
+}
+
+void report(const char* name, jobstats* st)
+{
+	times total;
+	memset(&total, 0, sizeof(total));
+	for(int k = 0; k < NUM_SECS; k++)
+	{
+		total.rapid += st->sec[k].rapid;
+		total.cut += st->sec[k].cut;
+		total.dwell += st->sec[k].dwell;
+		total.laser_on += st->sec[k].laser_on;
+		total.cut_length += st->sec[k].cut_length;
+		total.count += st->sec[k].count;
+	}
+
+	double all = total.rapid+total.cut+total.dwell;
+	printf("%s: %u lines, %u not understood, extent %.1f x %.1f mm\n", name, st->lines, st->unknown,
+		st->max[X]-st->min[X], st->max[Y]-st->min[Y]);
+	printf("  %-14s %5s %9s %9s %9s %9s %9s %9s\n", "section", "count", "time s", "rapid", "cut", "dwell", "laser on", "cut mm");
+	for(int k = SEC_HOLE; k < NUM_SECS; k++)
+		print_times(sec_names[k], &st->sec[k]);
+	print_times(sec_names[SEC_OTHER], &st->sec[SEC_OTHER]);
+	print_times("total", &total);
+	printf("  Estimated cycle time %.0f s (%.2f h)\n", all, all/3600.0);
+
+	if(st->num_holes < 2)
+		return;
+
+	// Histogram of the time per hole, including the rapid to it and the dwell after it.
+	qsort(st->hole_time, st->num_holes, sizeof(float), cmp_float);
+	float lo = st->hole_time[0], hi = st->hole_time[st->num_holes-1];
+	float bin = (hi-lo)/HIST_BINS;
+	if(bin < 0.01)
+		bin = 0.01;
+	int counts[HIST_BINS];
+	memset(counts, 0, sizeof(counts));
+	int most = 0;
+	for(int k = 0; k < st->num_holes; k++)
+	{
+		int b = (int)((st->hole_time[k]-lo)/bin);
+		if(b >= HIST_BINS) b = HIST_BINS-1;
+		if(++counts[b] > most) most = counts[b];
+	}
+	printf("  Time per hole: median %.2f s, min %.2f s, max %.2f s\n", st->hole_time[st->num_holes/2], lo, hi);
+	for(int b = 0; b < HIST_BINS; b++)
+	{
+		if(!counts[b])
+			continue;
+		printf("  %7.2f - %7.2f s %5u ", lo+bin*b, lo+bin*(b+1), counts[b]);
+		for(int k = 0; k < (counts[b]*50+most-1)/most; k++)
+			putchar('#');
+		printf("\n");
+	}
+}
+
+char* read_file(const char* filename, size_t* len)
+{
+	FILE* f = fopen(filename, "rb");
+	if(!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* buf = malloc(*len+1);
+	if(fread(buf, 1, *len, f) != *len)
+	{
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	buf[*len] = 0;
+	fclose(f);
+	return buf;
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+// Runs the estimator over text until a second has passed. Prints the throughput.
+void bench_one(const char* name, const char* text, size_t len)
+{
+	jobstats st;
+	int runs = 0;
+	double start = now(), t;
+	do
+	{
+		analyze(text, len, &st);
+		free(st.hole_time);
+		runs++;
+	}
+	while((t = now()-start) < 1.0);
+
+	double job = 0.0;
+	for(int k = 0; k < NUM_SECS; k++)
+		job += st.sec[k].rapid + st.sec[k].cut + st.sec[k].dwell;
+	printf("%-28s %8u lines %8.2f ms %7.1f Mlines/s %7.1f MB/s  (job %.0f s)\n", name, st.lines,
+		t/runs*1000.0, st.lines*(double)runs/t/1e6, len*(double)runs/t/1e6, job);
+}
+
+// A job of n x n cell holes at 20.5 mm with the laser, as cnc_gen writes them.
+char* synthetic_job(int n, size_t* len)
+{
+	char* buf;
+	FILE* f = open_memstream(&buf, len);
+	fprintf(f, "G21\nG61\nM05\nG00 F530.00\nM07 (air on)\nG04 P5.000\n");
+	for(int x = 0; x < n; x++)
+	{
+		for(int y = 0; y < n; y++)
+		{
+			float sx = 20.0 + 20.5*x + 0.12, sy = 20.0 + 20.5*y + 9.215;
+			fprintf(f, "G00 X%.2f Y%.2f (WELDPOINT %u;%u;%.2f;%.2f)\n", sx, sy, x, y, sx+9.1, sy);
+			fprintf(f, "M03 S73\nG02 X%.2f Y%.2f I9.10 J0.00\nM05\nG04 P6.000\n", sx, sy);
+		}
+	}
+	fprintf(f, "G00 X10.00 Y10.00\nM03 S75\nG01 X%.2f Y10.00\nG01 X%.2f Y%.2f\nG01 X10.00 Y%.2f\nG01 X10.00 Y10.00\nM05\n",
+		30.0+20.5*n, 30.0+20.5*n, 30.0+20.5*n, 30.0+20.5*n);
+	fprintf(f, "G00 X0.00 Y0.00\nG04 P15.000\nM2\n%%\n");
+	fclose(f);
+	return buf;
+}
+
+int bench()
+{
+	DIR* dir = opendir(".");
+	struct dirent* de;
+	while(dir && (de = readdir(dir)))
+	{
+		size_t l = strlen(de->d_name);
+		if(l < 4 || strcmp(de->d_name+l-4, ".ngc"))
+			continue;
+		size_t len;
+		char* text = read_file(de->d_name, &len);
+		if(!text)
+			continue;
+		bench_one(de->d_name, text, len);
+		free(text);
+	}
+	if(dir)
+		closedir(dir);
+
+	size_t len;
+	char* text = synthetic_job(100, &len);
+	bench_one("synthetic 100x100 cells", text, len);
+	free(text);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* plotname = NULL;
+	int num_files = 0;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "--bench"))
+			return bench();
+		else if(!strcmp(argv[i], "-p") && i+1 < argc)
+			plotname = argv[++i];
+		else if(!strcmp(argv[i], "-m") && i+1 < argc)
+		{
+			char* eq = strchr(argv[++i], '=');
+			param* p = params;
+			while(eq && p->name && (strncmp(argv[i], p->name, eq-argv[i]) || p->name[eq-argv[i]]))
+				p++;
+			if(!eq || !p->name)
+			{
+				printf("Unknown machine parameter %s. Known:", argv[i]);
+				for(p = params; p->name; p++)
+					printf(" %s=%.1f", p->name, *p->val);
+				printf("\n");
+				return 1;
+			}
+			*p->val = atof(eq+1);
+		}
+		else if(argv[i][0] == '-')
+			num_files = -1000;
+		else
+			num_files++;
+	}
+
+	if(num_files <= 0)
+	{
+		printf("Usage: ngc_time [-m <param>=<value>]... [-p <plot.svg>] <file.ngc>...\n");
+		printf("       ngc_time --bench\n");
+		printf("-m = machine parameter: speed_x/y/z (mm/min), accel_x/y/z (mm/s^2), feed (mm/min), hole_max (mm)\n");
+		printf("-p = write a backplot of the (last) file: rapids gray, laser on red, other feed moves blue\n");
+		printf("--bench = time the estimator on the .ngc files here and on a synthetic 100x100 cell job\n");
+		return 1;
+	}
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-p") || !strcmp(argv[i], "-m"))
+		{
+			i++;
+			continue;
+		}
+
+		size_t len;
+		char* text = read_file(argv[i], &len);
+		if(!text)
+		{
+			printf("Error reading %s\n", argv[i]);
+			return 1;
+		}
+
+		char* plotbuf = NULL;
+		size_t plotsize;
+		if(plotname)
+			plot = open_memstream(&plotbuf, &plotsize);
+
+		jobstats st;
+		analyze(text, len, &st);
+		report(argv[i], &st);
+		free(st.hole_time);
+		free(text);
+
+		if(plot)
+		{
+			fclose(plot);
+			plot = NULL;
+			FILE* f = fopen(plotname, "wb");
+			if(!f)
+			{
+				printf("Error opening %s\n", plotname);
+				return 1;
+			}
+			fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\"%.1f %.1f %.1f %.1f\">\n",
+				st.min[X]-5.0, -st.max[Y]-5.0, st.max[X]-st.min[X]+10.0, st.max[Y]-st.min[Y]+10.0);
+			fprintf(f, "<style>line{stroke-width:0.2} .r{stroke:#aaa;stroke-dasharray:1} .c{stroke:#d00} .f{stroke:#00d}</style>\n");
+			fwrite(plotbuf, 1, plotsize, f);
+			fprintf(f, "</svg>\n");
+			fclose(f);
+			free(plotbuf);
+		}
+	}
+	return 0;
+}
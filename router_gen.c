@@ -1,16 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
+#include "toolpath.h"
+#include "layout.h"
+#include "coupon.h"
+#include "feeds.h"
+#include "tabs.h"
+
 #define M_PI 3.14159265358
 
 #define X 0
 #define Y 1
 
-#define COVER_CUT() {} //  {if(ZMODE) fprintf(coverfile, "G1 Z-5.0\n"); else fprintf(coverfile, "M03 S%02d\n", cover_power);}
-#define COVER_UNCUT() {} //{if(ZMODE) fprintf(coverfile, "G1 Z5.0\n");  else fprintf(coverfile, "M05\n");}
+// Cell pocket clearing, see do_cellhole()
+#define CLEAR_HELICES    0 // the pocket wall and the thru-hole as separate helices, as before
+#define CLEAR_SPIRAL     1
+#define CLEAR_TROCHOIDAL 2
+
+#define COVER_CUT() {} //  {if(ZMODE) tp_text(cpath, "G1 Z-5.0"); else tp_on_abs(cpath, cover_power);}
+#define COVER_UNCUT() {} //{if(ZMODE) tp_text(cpath, "G1 Z5.0");  else tp_off(cpath);}
 
-#define delay(ff, dd)	{fprintf((ff), "G04 P%.3f\n", (dd));}
+#define delay(tp, dd)	{tp_dwell((tp), (dd));}
 
 // Generates main cell board, one side and one front.
 // Run the laser twice to obtain all 6 parts.
@@ -20,6 +32,7 @@
 // (ALIGNPOINT x_idx;y_idx;x_coord;y_coord) defines the coordinates of the corners
 // of the finished box. idx 0;0 is the bottom-left corner.
 // The box can be aligned against physical restrainers on two edges (typically bottom-left)
+// The same geometry is saved as <prefix>_layout.bin (see layout.h), which weld reads directly.
 
 	float part_separation = 2.0; // clearance between main board, side and front
 	float thickness = 4.0; // Thickness of the material.
@@ -32,7 +45,9 @@
 
 	float fullcut_z;
 
-	float hole_snapoffs = 0.35; // thickness of breakout snap thingies
+	// Holding tabs (see tabs.h): count, width, height over the bottom, ramp
+	tabspec snapoff_tabs = {3, 1.0, 0.35, 0.0}; // of the thru-hole plugs: breakout snap thingies
+	tabspec outline_tabs = {4, 3.0, 1.0, 14.0}; // of the main board, count 0 to cut it free
 
 	float toolsize = 2.0;
 	float cell = 18.35; // milled out diameter
@@ -60,7 +75,29 @@
 
 	float cellhold_thickness = 0.35;
 
-	float snapoff_angle = 27.0;
+	float mark_depth = 0.2; // engraved index marks of the calibration coupon
+
+	// Feeds (see feeds.h)
+	int chipload_feeds = 1; // 0: feedrate and z_feed for everything, each depth in one pass
+	const char* material_name = "plywood";
+	int flutes = 2;
+	float spindle_rpm = 12000.0;
+	float max_feed = 2000.0; // mm/min, of the machine
+	float max_z_feed = 600.0;
+	feeds fd;
+
+	int cell_clearing = CLEAR_SPIRAL;
+	float finish_allowance = 0.1; // left on the cell pocket wall for the finishing pass
+	float rapid_rate = 2000.0; // mm/min, G00 travel of the machine, for the time estimate
+	float z_rapid_rate = 600.0; // mm/min, G00 up and down
+
+	// Links between the features (see link_features())
+	int link_order = 1; // 0: cut in the generated order, retracting to z_at_idle in between
+	float link_clearance = 0.5; // over the material, or over a keep-out, on the links
+	// Clamps and fixtures the links pass over: x0, y0, x1, y1 in mm on the machine, and
+	// the height of their top over the surface. E.g. {10.0, 60.0, 30.0, 80.0, 25.0}
+	int num_keepouts = 0;
+	float keepouts[8][5] = {{0.0}};
 
 
 
@@ -114,110 +151,709 @@
 
 
 
-void do_cellhole(FILE* gfile, float mid_x, float mid_y)
+// Cuts the thru-hole plug out from a groove of radius r already down to the top of the
+// snapoff tabs, from its left end. Ends there, on top of the last tab.
+void do_snapoffs(toolpath* gpath, float mid_x, float mid_y, float r)
+{
+	toolpath circle;
+	tp_init(&circle);
+	tp_arc(&circle, OP_CW, mid_x - r, mid_y, r, 0.0);
+	tp_fine(&circle);
+	tp_feed(&circle, fd.feed[FEAT_SLOT]);
+
+	float start[2] = {mid_x - r, mid_y};
+	float z_bottom = z_at_surface - thickness;
+	tabs_cut(gpath, &circle, 0, circle.num, start, z_bottom + snapoff_tabs.height, fullcut_z, z_bottom,
+		toolsize, fd.plunge, &snapoff_tabs);
+	tp_free(&circle);
+}
+
+// Helix from z_from down to z_to at radius r around mid, from its left end, in as many
+// turns as the step-down and the ramp of the feature allow, then once around at depth.
+void helix_down(toolpath* gpath, float mid_x, float mid_y, float r, float z_from, float z_to, int feat)
+{
+	float step = fd.step_down[feat];
+	if(2.0*M_PI*r*fd.ramp < step)
+		step = 2.0*M_PI*r*fd.ramp;
+	int turns = feeds_passes(z_from - z_to, step);
+	for(int k = 1; k <= turns+1; k++)
+	{
+		tp_arc(gpath, OP_CW, mid_x - r, mid_y, r, 0.0);
+		tp_fine(gpath);
+		tp_with_z(gpath, (k >= turns)?z_to:(z_from + (z_to-z_from)*k/turns));
+		tp_feed(gpath, fd.feed[feat]);
+	}
+}
+
+// The cell hole as it used to be milled: the pocket and the thru-hole as two separate
+// helices each, with a retract and a second entry between them.
+void do_cellhole_helices(toolpath* gpath, float mid_x, float mid_y)
 {
+	float r_cell = cell/2.0 - toolsize/2.0;
+	float r_thru = thruhole/2.0 - toolsize/2.0;
+
 	// Do the cell milling:
+	tp_rapid(gpath, mid_x - r_cell, mid_y);
+	tp_fine(gpath); // where the circle ends, or it is a short arc
 
-	float start_x = mid_x - cell/2.0;
-	float start_y = mid_y;
+	tp_z(gpath, OP_LINE, z_at_surface);
+	tp_feed(gpath, fd.plunge);
 
-	float start_x_trimmed = start_x + toolsize/2.0;
-	float start_y_trimmed = start_y;
+	helix_down(gpath, mid_x, mid_y, r_cell, z_at_surface, z_at_surface-thickness+cellhold_thickness, FEAT_SLOT);
 
-	float offset_i = cell/2.0 - toolsize/2.0;
-	float offset_j = 0.0;
+	tp_z(gpath, OP_RAPID, z_at_idle);
 
-	fprintf(gfile, "G00 X%.2f Y%.2f\n", start_x_trimmed, start_y_trimmed);
 
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", z_at_surface, z_feed);
+	// Do the through hole:
+	tp_rapid(gpath, mid_x - r_thru, mid_y);
+	tp_fine(gpath);
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f Z%.2f F%.2f\n", start_x_trimmed, start_y_trimmed,
-		offset_i, offset_j, z_at_surface-thickness+cellhold_thickness, feedrate);
+	tp_z(gpath, OP_LINE, z_at_surface);
+	tp_feed(gpath, fd.plunge);
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f Z%.2f F%.2f\n", start_x_trimmed, start_y_trimmed,
-		offset_i, offset_j, z_at_surface-thickness+cellhold_thickness, feedrate);
+	helix_down(gpath, mid_x, mid_y, r_thru, z_at_surface, z_at_surface-thickness+snapoff_tabs.height, FEAT_SLOT);
 
-	fprintf(gfile, "G00 Z%.2f\n", z_at_idle);
+	do_snapoffs(gpath, mid_x, mid_y, r_thru);
 
+	tp_z(gpath, OP_RAPID, z_at_idle);
+}
 
-	// Do the through hole:
+// Clears the ring from the thru-hole groove of radius r_thru out to r_out with
+// trochoidal loops at the current depth, from and back to the left end of the groove.
+// The loops are full circles from the groove out to r_out, each one step further
+// counterclockwise around the hole, so that each takes at most the pocket engagement.
+// They are linked along the groove, which is cut already.
+void trochoid_ring(toolpath* gpath, float mid_x, float mid_y, float r_thru, float r_out)
+{
+	float rl = (r_out - r_thru)/2.0;
+	int loops = feeds_passes(2.0*M_PI*(r_thru + rl), fd.width[FEAT_POCKET]);
+	float at[2] = {mid_x - r_thru, mid_y};
+	for(int k = 0; k < loops; k++)
+	{
+		float a = M_PI + 2.0*M_PI*k/loops;
+		float u[2] = {cos(a), sin(a)};
+		if(k > 0)
+		{
+			tp_arc(gpath, OP_CCW, mid_x + u[0]*r_thru, mid_y + u[1]*r_thru, mid_x - at[0], mid_y - at[1]);
+			tp_fine(gpath);
+			at[0] = mid_x + u[0]*r_thru;
+			at[1] = mid_y + u[1]*r_thru;
+		}
+		tp_arc(gpath, OP_CW, at[0], at[1], u[0]*rl, u[1]*rl);
+		tp_fine(gpath);
+		if(k == 0)
+			tp_feed(gpath, fd.feed[FEAT_POCKET]);
+	}
+	tp_arc(gpath, OP_CCW, mid_x - r_thru, mid_y, mid_x - at[0], mid_y - at[1]);
+	tp_fine(gpath);
+}
 
-	start_x = mid_x - thruhole/2.0;
-	start_y = mid_y;
+// Mills a cell hole in one go, without leaving the material in between: the thru-hole
+// groove as a helix from the surface down to the snapoff depth, the snapoff cutouts
+// ending on top of the last snapoff, then clears the cell pocket out to finish_allowance
+// from its wall at each level of its depth (see feeds.h), and finishes the wall at full
+// depth in one pass around it.
+// Each level plunges down the groove, so the groove has to reach the pocket floor: with
+// snapoff tabs higher than cellhold_thickness the hole is milled as separate helices.
+// The pocket is cleared with a spiral out, then once around, back in to the groove
+// between the levels; or with the trochoidal loops of trochoid_ring(). The spiral is
+// made of half circles, each centered half a step off the hole center so that it ends
+// one step further out, with at most the pocket engagement per step.
+void do_cellhole(toolpath* gpath, float mid_x, float mid_y)
+{
+	float r_thru = thruhole/2.0 - toolsize/2.0;
+	float r_cell = cell/2.0 - toolsize/2.0;
+	float z_thru = z_at_surface-thickness+snapoff_tabs.height;
+	float z_cell = z_at_surface-thickness+cellhold_thickness;
 
-	start_x_trimmed = start_x + toolsize/2.0;
-	start_y_trimmed = start_y;
+	if(cell_clearing == CLEAR_HELICES || z_cell < z_thru)
+	{
+		do_cellhole_helices(gpath, mid_x, mid_y);
+		return;
+	}
 
-	offset_i = thruhole/2.0 - toolsize/2.0;
-	offset_j = 0.0;
+	// Thru-hole groove
+	tp_rapid(gpath, mid_x - r_thru, mid_y);
+	tp_fine(gpath);
 
-	fprintf(gfile, "G00 X%.2f Y%.2f\n", start_x_trimmed, start_y_trimmed);
+	tp_z(gpath, OP_LINE, z_at_surface);
+	tp_feed(gpath, fd.plunge);
 
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", z_at_surface, z_feed);
+	helix_down(gpath, mid_x, mid_y, r_thru, z_at_surface, z_thru, FEAT_SLOT);
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f Z%.2f F%.2f\n", start_x_trimmed, start_y_trimmed,
-		offset_i, offset_j, z_at_surface-thickness+hole_snapoffs, feedrate);
+	do_snapoffs(gpath, mid_x, mid_y, r_thru);
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f Z%.2f F%.2f\n", start_x_trimmed, start_y_trimmed,
-		offset_i, offset_j, z_at_surface-thickness+hole_snapoffs, feedrate);
+	float r_rough = (finish_allowance > 0.0)?(r_cell - finish_allowance):r_cell;
+	int steps = feeds_passes(r_rough - r_thru, fd.width[FEAT_POCKET]);
+	float step = (r_rough - r_thru)/steps;
+	int levels = feeds_passes(z_at_surface - z_cell, fd.step_down[FEAT_POCKET]);
+	float side = -1.0; // where the spiral starts: the left end, then where the last one ended
+	for(int l = 1; l <= levels; l++)
+	{
+		float z = (l == levels)?z_cell:(z_at_surface - (z_at_surface - z_cell)*l/levels);
 
+		if(l > 1 && cell_clearing != CLEAR_TROCHOIDAL)
+		{
+			tp_line(gpath, mid_x + side*r_thru, mid_y);
+			tp_fine(gpath);
+		}
+		tp_z(gpath, OP_LINE, z);
+		tp_feed(gpath, fd.plunge);
 
-	// Do complete cutouts:
+		if(cell_clearing == CLEAR_TROCHOIDAL)
+			trochoid_ring(gpath, mid_x, mid_y, r_thru, r_rough);
+		else
+		{
+			// Spiral out
+			for(int k = 0; k < steps; k++)
+			{
+				float r0 = r_thru + step*k;
+				float r1 = (k == steps-1)?r_rough:(r0 + step);
+				tp_arc(gpath, OP_CW, mid_x - side*r1, mid_y, -side*(r0+r1)/2.0, 0.0);
+				tp_fine(gpath);
+				if(k == 0)
+					tp_feed(gpath, fd.feed[FEAT_POCKET]);
+				side = -side;
+			}
+			// Also on the last level, so that the finishing pass only takes the allowance.
+			if(l < levels || r_rough < r_cell)
+			{
+				tp_arc(gpath, OP_CW, mid_x + side*r_rough, mid_y, -side*r_rough, 0.0);
+				tp_fine(gpath);
+			}
+		}
+	}
 
+	// Finishing pass around the cell pocket wall
+	float r_from = (cell_clearing == CLEAR_TROCHOIDAL)?r_thru:r_rough;
+	if(r_from < r_cell)
+	{
+		tp_line(gpath, mid_x + side*r_cell, mid_y);
+		tp_fine(gpath);
+	}
+	tp_arc(gpath, OP_CW, mid_x + side*r_cell, mid_y, -side*r_cell, 0.0);
+	tp_fine(gpath);
 
-	// 1. part
-	float angle = (90.0+snapoff_angle/2) * 2*M_PI/360.0;
+	tp_z(gpath, OP_RAPID, z_at_idle);
+}
 
-	float next_x = mid_x + cos(angle)*offset_i;
-	float next_y = mid_y + sin(angle)*offset_i;
+// Appends the moves from..to-1 of tp again, without their comments.
+void repeat_moves(toolpath* tp, int from, int to)
+{
+	for(int k = from; k < to; k++)
+	{
+		int n = tp_op(tp, tp->op[k]);
+		tp->words[n] = tp->words[k];
+		memcpy(tp->pos[n], tp->pos[k], sizeof(tp->pos[n]));
+		memcpy(tp->arc[n], tp->arc[k], sizeof(tp->arc[n]));
+		tp->feed[n] = tp->feed[k];
+		tp->value[n] = tp->value[k];
+	}
+}
 
-	// Cut arc through
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", fullcut_z, z_feed);
+// Time estimate of one cell hole from above its center, cleared as given.
+float cellhole_time(int clearing)
+{
+	int keep = cell_clearing;
+	cell_clearing = clearing;
+	toolpath one;
+	tp_init(&one);
+	tp_z(&one, OP_RAPID, z_at_idle);
+	do_cellhole(&one, 0.0, 0.0);
+	float t = tp_time(&one, rapid_rate);
+	tp_free(&one);
+	cell_clearing = keep;
+	return t;
+}
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f\n", next_x, next_y, offset_i, offset_j);
+// The side and front parts are still drawn as the laser cut them: CUT() before a
+// run of moves, UNCUT() after it. On the router, CUT() goes down one step into the
+// material where the tool is, and UNCUT() cuts the moves since then again at each
+// further step down to cut_z, from their start, then retracts. The laser's power
+// has no meaning here; CUT_MARK() engraves mark_depth deep in one pass instead.
 
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", z_at_surface-thickness+hole_snapoffs, z_feed);
+int cut_from;     // first move of the run
+float cut_at[2];  // where it starts
+float cut_z;
+int cut_steps;
 
-	angle = (90.0-snapoff_angle/2) * 2*M_PI/360.0;
-	float next2_x = mid_x + cos(angle)*offset_i;
-	float next2_y = mid_y + sin(angle)*offset_i;
+void router_cut(toolpath* gpath, float z)
+{
+	for(int k = gpath->num-1; k >= 0; k--)
+	{
+		if((gpath->words[k] & (W_X|W_Y)) == (W_X|W_Y))
+		{
+			cut_at[X] = gpath->pos[k][X];
+			cut_at[Y] = gpath->pos[k][Y];
+			break;
+		}
+	}
+	cut_z = z;
+	cut_steps = feeds_passes(z_at_surface - z, fd.step_down[FEAT_OUTLINE]);
+	tp_z(gpath, OP_LINE, z_at_surface - (z_at_surface - z)/cut_steps);
+	tp_feed(gpath, fd.plunge);
+	tp_op(gpath, OP_LINE);
+	tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+	cut_from = gpath->num;
+}
 
-	// move in arc groove, don't cut.
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f\n", next2_x, next2_y, mid_x-next_x, mid_y-next_y);
+void router_uncut(toolpath* gpath)
+{
+	int to = gpath->num;
+	for(int n = 2; n <= cut_steps; n++)
+	{
+		tp_z(gpath, OP_RAPID, z_at_idle);
+		tp_rapid(gpath, cut_at[X], cut_at[Y]);
+		tp_z(gpath, OP_LINE, z_at_surface - (z_at_surface - cut_z)*n/cut_steps);
+		tp_feed(gpath, fd.plunge);
+		tp_op(gpath, OP_LINE);
+		tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+		repeat_moves(gpath, cut_from, to);
+	}
+	tp_z(gpath, OP_RAPID, z_at_idle);
+}
 
-	// 2. part
-	angle = (-90+snapoff_angle/2) * 2*M_PI/360.0;
+#define CUT()        router_cut(gpath, fullcut_z)
+#define CUT_PWR(pwr) router_cut(gpath, fullcut_z)
+#define CUT_MARK()   router_cut(gpath, z_at_surface - mark_depth)
+#define UNCUT()      router_uncut(gpath)
+
+// Links between the features of the main board.
+// The cell holes and the outline are marked as contours (tp_contour()), each starting
+// with the rapid to its entry and ending with a retract. link_features() copies them
+// out in the order of the least link time: nearest neighbour first, then 2-opt within a
+// window of the order, the cell holes always before the outline around them. A link
+// retracts only as high as the straight line to the next entry needs, link_clearance
+// over the surface or over the top of each keep-out the tool would touch on the way,
+// and rapids down to link_clearance over the entry, where the feature feeds in as it
+// did from z_at_idle. The retracts between the moves of a feature (the separate
+// helices of a cell hole) are lowered the same way.
+// No two features share a pocket, so every link crosses uncut material: the links
+// inside a pocket are the ones the feature makes itself, at depth (see do_cellhole()).
+
+#define LINK_WINDOW 40
+#define LINK_PASSES 20
+
+typedef struct
+{
+	int first;         // operations of the toolpath, the comments before the entry first
+	int entry;         // the rapid to the start
+	int op_end;        // without the retract at the end
+	float start[2];
+	float end[3];      // where the retract starts
+	float min[2];
+	float max[2];
+	int num_outer;     // features that must be cut after this one
+	int* outer;
+} feature;
+
+// Returns 1 if the tool passes over keep-out k on a straight line from a to b.
+int crosses_keepout(const float* a, const float* b, int k)
+{
+	// Clip the line to the keep-out grown by the tool radius.
+	float t0 = 0.0, t1 = 1.0;
+	for(int i = 0; i < 2; i++)
+	{
+		float lo = fminf(keepouts[k][i], keepouts[k][i+2]) - toolsize/2.0;
+		float hi = fmaxf(keepouts[k][i], keepouts[k][i+2]) + toolsize/2.0;
+		float d = b[i] - a[i];
+		if(fabsf(d) < 1e-6)
+		{
+			if(a[i] < lo || a[i] > hi)
+				return 0;
+			continue;
+		}
+		float ta = (lo - a[i])/d, tb = (hi - a[i])/d;
+		if(ta > tb) {float t = ta; ta = tb; tb = t;}
+		if(ta > t0) t0 = ta;
+		if(tb < t1) t1 = tb;
+		if(t0 > t1)
+			return 0;
+	}
+	return 1;
+}
 
-	next_x = mid_x + cos(angle)*offset_i;
-	next_y = mid_y + sin(angle)*offset_i;
+// Lowest safe Z of a rapid from a to b.
+float link_z(const float* a, const float* b)
+{
+	float top = 0.0;
+	for(int k = 0; k < num_keepouts; k++)
+		if(keepouts[k][4] > top && crosses_keepout(a, b, k))
+			top = keepouts[k][4];
+	return z_at_surface + top + link_clearance;
+}
 
-	// Cut arc through
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", fullcut_z, z_feed);
+// Time in s from the end of a feature at from (x, y, z) down to the surface at the entry
+// to, with the feed in from link_clearance, or from z_at_idle all the way if idle.
+float link_time(const float* from, const float* to, int idle)
+{
+	float over = idle?z_at_idle:(z_at_surface + link_clearance);
+	float z = idle?z_at_idle:fmaxf(link_z(from, to), from[2]);
+	return 60.0*((z - from[2] + z - over)/z_rapid_rate + hypotf(to[0]-from[0], to[1]-from[1])/rapid_rate
+		+ (over - z_at_surface)/fd.plunge);
+}
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f\n", next_x, next_y, mid_x-next2_x, mid_y-next2_y);
+double order_link_time(const feature* fs, const int* order, int n, const float* home, int idle)
+{
+	double t = 0.0;
+	const float* at = home;
+	for(int k = 0; k < n; k++)
+	{
+		t += link_time(at, fs[order[k]].start, idle);
+		at = fs[order[k]].end;
+	}
+	return t;
+}
 
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", z_at_surface-thickness+hole_snapoffs, z_feed);
+// Reads the extent and the end of feature f, which first and op_end are set for.
+// Returns 0 if it doesn't start with a rapid.
+int parse_feature(feature* f, const toolpath* tp)
+{
+	f->entry = -1;
+	for(int k = f->first; k < f->op_end && f->entry < 0; k++)
+		if(tp->op[k] == OP_RAPID && (tp->words[k] & (W_X|W_Y)) == (W_X|W_Y))
+			f->entry = k;
+	if(f->entry < 0)
+		return 0;
+
+	int last = f->op_end-1;
+	if(last > f->entry && (tp->op[last] == OP_RAPID || tp->op[last] == OP_LINE) && (tp->words[last] & W_Z)
+		&& !(tp->words[last] & (W_X|W_Y)))
+		f->op_end = last;
+
+	float pos[3] = {0.0, 0.0, z_at_idle};
+	f->min[0] = f->min[1] = 1e9;
+	f->max[0] = f->max[1] = -1e9;
+	for(int k = f->entry; k < f->op_end; k++)
+	{
+		int w = tp->words[k];
+		if(tp->op[k] == OP_TEXT)
+			continue;
+		if(w & W_IJ)
+		{
+			float c[2] = {pos[0] + tp->arc[k][0], pos[1] + tp->arc[k][1]};
+			float r = hypotf(tp->arc[k][0], tp->arc[k][1]);
+			for(int a = 0; a < 2; a++)
+			{
+				f->min[a] = fminf(f->min[a], c[a]-r);
+				f->max[a] = fmaxf(f->max[a], c[a]+r);
+			}
+		}
+		for(int a = 0; a < 3; a++)
+			if(w & (1<<a))
+				pos[a] = tp->pos[k][a];
+		for(int a = 0; a < 2; a++)
+		{
+			f->min[a] = fminf(f->min[a], pos[a]);
+			f->max[a] = fmaxf(f->max[a], pos[a]);
+		}
+	}
+	f->start[0] = tp->pos[f->entry][0];
+	f->start[1] = tp->pos[f->entry][1];
+	memcpy(f->end, pos, sizeof(f->end));
 
-	angle = (-90.0-snapoff_angle/2) * 2*M_PI/360.0;
-	next2_x = mid_x + cos(angle)*offset_i;
-	next2_y = mid_y + sin(angle)*offset_i;
+	for(int k = 0; k < num_keepouts; k++)
+	{
+		int apart = 0;
+		for(int a = 0; a < 2; a++)
+			if(f->max[a] + toolsize/2.0 < fminf(keepouts[k][a], keepouts[k][a+2])
+				|| f->min[a] - toolsize/2.0 > fmaxf(keepouts[k][a], keepouts[k][a+2]))
+				apart = 1;
+		if(!apart)
+			printf("Warning: the feature at %.1f;%.1f - %.1f;%.1f cuts into keep-out %d\n",
+				f->min[X], f->min[Y], f->max[X], f->max[Y], k);
+	}
+	return 1;
+}
 
-	// move in arc groove, don't cut.
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f\n", next2_x, next2_y, mid_x-next_x, mid_y-next_y);
+// Appends feature f for the head at pos, and leaves pos where the feature ends.
+void write_feature(toolpath* out, const toolpath* tp, const feature* f, float* pos)
+{
+	for(int k = f->first; k < f->entry; k++)
+		tp_copy(out, tp, k);
+
+	float over = z_at_surface + link_clearance;
+	float z = link_z(pos, f->start);
+	if(pos[2] < z)
+		tp_z(out, OP_RAPID, z);
+	else
+		z = pos[2];
+	tp_copy(out, tp, f->entry);
+	if(z > over)
+		tp_z(out, OP_RAPID, over);
+	pos[0] = f->start[0];
+	pos[1] = f->start[1];
+	pos[2] = fminf(z, over);
+
+	for(int k = f->entry+1; k < f->op_end; k++)
+	{
+		// A retract before a rapid to the next move of the feature
+		if(tp->op[k] == OP_RAPID && tp->words[k] == W_Z && k+1 < f->op_end && tp->op[k+1] == OP_RAPID
+			&& tp->words[k+1] & W_X && tp->words[k+1] & W_Y && !(tp->words[k+1] & W_Z) && tp->pos[k][2] > pos[2])
+		{
+			pos[2] = fminf(tp->pos[k][2], link_z(pos, tp->pos[k+1]));
+			tp_z(out, OP_RAPID, pos[2]);
+			continue;
+		}
+		tp_copy(out, tp, k);
+		for(int a = 0; a < 3; a++)
+			if(tp->words[k] & (1<<a) && tp->op[k] != OP_TEXT)
+				pos[a] = tp->pos[k][a];
+	}
+}
 
-	// 3. (final) part
+// Copies tp to out with the features linked, see above.
+void link_features(const toolpath* tp, toolpath* out)
+{
+	int n = tp->num_tags;
+	feature* fs = calloc(n+1, sizeof(feature));
+	int preamble_end = -1, trailer = -1;
+	for(int k = 0; k < tp->num; k++)
+	{
+		int tag = tp->tag[k];
+		if(tag > 0 && tag <= n)
+		{
+			feature* f = &fs[tag-1];
+			if(!f->op_end)
+				f->first = k;
+			f->op_end = k+1;
+			if(preamble_end < 0)
+				preamble_end = k;
+		}
+		else if(tag == TAG_TRAILER && trailer < 0)
+			trailer = k;
+	}
+	int ok = n && trailer >= 0;
+	for(int k = 0; k < n && ok; k++)
+		ok = parse_feature(&fs[k], tp);
+	if(!ok)
+	{
+		printf("Internal error: features not marked\n");
+		for(int k = 0; k < tp->num; k++)
+			tp_copy(out, tp, k);
+		free(fs);
+		return;
+	}
 
-	angle = (-180+snapoff_angle) * 2*M_PI/360.0;
+	// The features inside another one come first.
+	for(int a = 0; a < n; a++)
+		fs[a].outer = malloc(n*sizeof(int));
+	for(int a = 0; a < n; a++)
+	{
+		for(int b = 0; b < n; b++)
+		{
+			if(a != b && fs[a].min[X] >= fs[b].min[X] && fs[a].min[Y] >= fs[b].min[Y] &&
+				fs[a].max[X] <= fs[b].max[X] && fs[a].max[Y] <= fs[b].max[Y] &&
+				(fs[a].max[X]-fs[a].min[X])*(fs[a].max[Y]-fs[a].min[Y]) < (fs[b].max[X]-fs[b].min[X])*(fs[b].max[Y]-fs[b].min[Y]))
+			{
+				fs[a].outer[fs[a].num_outer++] = b;
+			}
+		}
+	}
 
-	next_x = mid_x + cos(angle)*offset_i;
-	next_y = mid_y + sin(angle)*offset_i;
+	float home[3] = {0.0, 0.0, z_at_idle};
+	int* order = calloc(n, sizeof(int));
+	int* pos_of = malloc(n*sizeof(int));
+	for(int k = 0; k < n; k++)
+		order[k] = k;
+	double before = order_link_time(fs, order, n, home, 1);
+
+	// Nearest neighbour among the features whose inner features are all done
+	int* inner_left = calloc(n, sizeof(int));
+	int* done = calloc(n, sizeof(int));
+	for(int a = 0; a < n; a++)
+		for(int o = 0; o < fs[a].num_outer; o++)
+			inner_left[fs[a].outer[o]]++;
+	const float* at = home;
+	for(int k = 0; k < n; k++)
+	{
+		int best = -1;
+		float best_t = 0.0;
+		for(int c = 0; c < n; c++)
+		{
+			if(done[c] || inner_left[c])
+				continue;
+			float t = link_time(at, fs[c].start, 0);
+			if(best < 0 || t < best_t)
+				{best = c; best_t = t;}
+		}
+		order[k] = best;
+		done[best] = 1;
+		for(int o = 0; o < fs[best].num_outer; o++)
+			inner_left[fs[best].outer[o]]--;
+		at = fs[best].end;
+	}
+	free(inner_left);
+	free(done);
 
-	// Cut arc through
-	fprintf(gfile, "G01 Z%.2f F%.2f\n", fullcut_z, z_feed);
+	// 2-opt: reverse a stretch of the order where that keeps the inner features first.
+	double cur = order_link_time(fs, order, n, home, 0);
+	for(int pass = 0; pass < LINK_PASSES; pass++)
+	{
+		int improved = 0;
+		for(int k = 0; k < n; k++)
+			pos_of[order[k]] = k;
 
-	fprintf(gfile, "G02 X%.6f Y%.6f I%.6f J%.6f\n", next_x, next_y, mid_x-next2_x, mid_y-next2_y);
+		for(int i = 0; i < n-1; i++)
+		{
+			for(int j = i+1; j < n && j <= i+LINK_WINDOW; j++)
+			{
+				int valid = 1;
+				for(int k = i; k <= j && valid; k++)
+					for(int o = 0; o < fs[order[k]].num_outer; o++)
+						if(pos_of[fs[order[k]].outer[o]] >= i && pos_of[fs[order[k]].outer[o]] <= j)
+							{valid = 0; break;}
+				if(!valid)
+					break; // a longer stretch from i contains the same pair
+
+				for(int a = i, b = j; a < b; a++, b--)
+					{int t = order[a]; order[a] = order[b]; order[b] = t;}
+				double t = order_link_time(fs, order, n, home, 0);
+				if(t < cur - 0.001)
+				{
+					cur = t;
+					improved = 1;
+					for(int k = i; k <= j; k++)
+						pos_of[order[k]] = k;
+				}
+				else
+				{
+					for(int a = i, b = j; a < b; a++, b--)
+						{int t = order[a]; order[a] = order[b]; order[b] = t;}
+				}
+			}
+		}
+		if(!improved)
+			break;
+	}
 
-	fprintf(gfile, "G00 Z%.2f\n", z_at_idle);
+	for(int k = 0; k < preamble_end; k++)
+		tp_copy(out, tp, k);
+	float pos[3] = {home[0], home[1], home[2]};
+	for(int k = 0; k < n; k++)
+		write_feature(out, tp, &fs[order[k]], pos);
+
+	// The trailer moves at z_at_idle, over all the keep-outs.
+	float z = z_at_idle;
+	for(int k = 0; k < num_keepouts; k++)
+		z = fmaxf(z, z_at_surface + keepouts[k][4] + link_clearance);
+	tp_z(out, OP_RAPID, z);
+	for(int k = trailer; k < tp->num; k++)
+		tp_copy(out, tp, k);
+
+	printf("%u features. Links %.0f s in the generated order over z_at_idle, %.0f s linked\n", n, before, cur);
+
+	for(int k = 0; k < n; k++)
+		free(fs[k].outer);
+	free(fs);
+	free(order);
+	free(pos_of);
+}
+
+// Calibration coupon (see coupon.h): cell holes milled at each toolsize, feedrate and
+// z_feed, which the holes are cut at instead of the feeds of feeds.h. The fitted toolsize
+// is the diameter the tool actually cuts.
+// router_gen <prefix> coupon <toolsize> <feedrate> <z_feed>, each <value> or <from>:<to>:<count>
+int coupon_main(int argc, char** argv)
+{
+	if(argc != 3+COUPON_PARAMS)
+	{
+		printf("Usage: router_gen <outfile_prefix> coupon <toolsize> <feedrate> <z_feed>\n");
+		printf("Each is <value> or <from>:<to>:<count>\n");
+		return 1;
+	}
+
+	coupon cp;
+	memset(&cp, 0, sizeof(cp));
+	cp.names[0] = "toolsize";
+	cp.names[1] = "feedrate";
+	cp.names[2] = "z_feed";
+	cp.nominal = cell;
+	cp.pitch = cell + 4.0;
+	cp.per_side = 1.0;
+	cp.fast = 1;
+	for(int k = 0; k < COUPON_PARAMS; k++)
+	{
+		if(!sweep_parse(&cp.sweeps[k], argv[3+k], cp.names[k]))
+			return 1;
+	}
+	if(!coupon_init(&cp))
+		return 1;
+
+	char filename[1000];
+	sprintf(filename, "%s_coupon.txt", argv[1]);
+	if(!coupon_write_table(filename, &cp, "router_gen"))
+		return 1;
+
+	toolpath tp;
+	toolpath* gpath = &tp;
+	tp_init(gpath);
+	tp_text(gpath, "( %s  %s  %s  %s  %s  %s )", argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+	tp_text(gpath, "G21");
+	tp_text(gpath, "G90"); // absolute coords.
+	tp_z(gpath, OP_RAPID, z_at_idle);
+
+	float origin[2] = {10.0, 10.0};
+	for(int axis = X; axis <= Y; axis++)
+	{
+		int num = (axis == X)?cp.num_cols:cp.num_rows;
+		for(int idx = 0; idx < num; idx++)
+		{
+			for(int t = 0; t <= idx; t++)
+			{
+				float from[2], to[2];
+				coupon_tick(&cp, origin, axis, idx, t, from, to);
+				tp_rapid(gpath, from[X], from[Y]);
+				tp_z(gpath, OP_LINE, z_at_surface-mark_depth);
+				tp_feed(gpath, z_feed);
+				tp_line(gpath, to[X], to[Y]);
+				tp_feed(gpath, feedrate);
+				tp_z(gpath, OP_RAPID, z_at_idle);
+			}
+		}
+	}
+
+	float nominal_toolsize = toolsize, nominal_feedrate = feedrate, nominal_z_feed = z_feed;
+	for(int row = 0; row < cp.num_rows; row++)
+	{
+		for(int col = 0; col < cp.num_cols; col++)
+		{
+			float v[COUPON_PARAMS], mid[2];
+			coupon_values(&cp, row, col, v);
+			coupon_hole(&cp, origin, row, col, mid);
+			toolsize = v[0];
+			feedrate = v[1];
+			z_feed = v[2];
+			feeds_fixed(&fd, toolsize, feedrate, z_feed);
+			tp_text(gpath, "(HOLE %u;%u)", col+1, row+1);
+			do_cellhole(gpath, mid[X], mid[Y]);
+		}
+	}
+	toolsize = nominal_toolsize;
+	feedrate = nominal_feedrate;
+	z_feed = nominal_z_feed;
+
+	tp_rapid(gpath, origin[X], origin[Y]);
+	delay(gpath, 15.0);
+	tp_text(gpath, "M2");
+	tp_text(gpath, "%%");
+
+	sprintf(filename, "%s_coupon.ngc", argv[1]);
+	FILE* f = fopen(filename, "wb");
+	if(!f)
+	{
+		printf("Error opening file %s\n", filename);
+		return 1;
+	}
+	tp_write(f, gpath);
+	fclose(f);
+	tp_free(gpath);
+
+	float size[2];
+	coupon_size(&cp, size);
+	printf("%s: %u x %u holes, sheet needed: %.2f x %.2f\n", filename, cp.num_cols, cp.num_rows, origin[X]+size[X], origin[Y]+size[Y]);
+	printf("Measure the holes into %s_coupon.txt, then run: router_gen %s fit\n", argv[1], argv[1]);
+	return 0;
 }
 
 int main(int argc, char** argv)
@@ -243,10 +879,18 @@ int main(int argc, char** argv)
 */
 
 
-	if(argc < 5)
+	if(argc == 3 && !strcmp(argv[2], "fit"))
+	{
+		char filename[1000];
+		sprintf(filename, "%s_coupon.txt", argv[1]);
+		return !coupon_fit(filename);
+	}
+
+	if(argc < 5 || (!strcmp(argv[2], "coupon") && argc < 6))
 	{
 		printf("Usage: cnc_gen <outfile_prefix> <y1> <y2> <x> <y cellgap|offset> <x scaling factor> <gap1> <gap2> <gap3> <gap4>\n");
 		printf("Ex.: cnc_gen out 4 3 11\n");
+		printf("k after x keeps the cut order as generated, retracting to z_at_idle between the features.\n");
                 printf("      ---- X ---->       \n");
 		printf("__-_-_-_-_-_4_-_-_-_-_-__\n");
 		printf("| O   O   O   O   O   O |\n");
@@ -257,12 +901,33 @@ int main(int argc, char** argv)
 		printf("|   O   O   O   O   O   |\n");
 		printf("| O   O   O   O   O   O |\n");
 		printf("------------2------------\n");
+		printf("\n");
+		printf("Calibration: router_gen <outfile_prefix> coupon <toolsize> <feedrate> <z_feed>\n");
+		printf("Each is <value> or <from>:<to>:<count>. Mills a grid of cell holes, one column per toolsize\n");
+		printf("and one row per feedrate and z_feed, to <prefix>_coupon.ngc, and lists them in <prefix>_coupon.txt.\n");
+		printf("Fill in the measured diameters there, then: router_gen <outfile_prefix> fit\n");
+		printf("Ex.: router_gen cal coupon 1.9:2.1:5 200:300:3 190\n");
 		return 1;
 	}
 
 	fullcut_z = z_at_surface - thickness - cut_through_base;
 	cellgap = cell_to_cell-cell;
 
+	if(!strcmp(argv[2], "coupon"))
+		return coupon_main(argc, argv);
+
+	if(chipload_feeds)
+	{
+		const material* m = material_find(material_name);
+		if(!m)
+			return 1;
+		feeds_init(&fd, m, toolsize, flutes, spindle_rpm, max_feed, max_z_feed);
+		printf("Feeds for %s, %.2f mm %u flute tool at %.0f rpm:\n", m->name, toolsize, flutes, spindle_rpm);
+		feeds_print(&fd);
+	}
+	else
+		feeds_fixed(&fd, toolsize, feedrate, z_feed);
+
 
 	ys[0] = atoi(argv[2]);
 	if(ys[0] < 1 || ys[0] > 100) { printf("Invalid y1\n"); return 1;}
@@ -274,19 +939,44 @@ int main(int argc, char** argv)
 	x = atoi(argv[4]);
 	if(x < 1 || x > 100) { printf("Invalid x\n"); return 1;}
 
+	if(argc > 5 && strchr(argv[5], 'k'))
+		link_order = 0;
+
+	packspec spec;
+	spec.cell = cell;
+	spec.cellgap = cellgap;
+	memcpy(spec.wallgaps, wallgaps, sizeof(spec.wallgaps));
+	spec.spacing_trim = spacing_trim;
+	spec.finger_size[X] = finger_size_x;
+	spec.finger_size[Y] = finger_size_y;
+	spec.walls[X] = do_fronts?thickness:0.0;
+	spec.walls[Y] = do_sides?thickness:0.0;
+	spec.ys[0] = ys[0];
+	spec.ys[1] = ys[1];
+	spec.x = x;
+
+	packlayout L;
+	if(!layout_build(&L, &spec))
+		return 1;
+
 	char mainfilename[1000];
 	char coverfilename[1000];
+	char layoutfilename[1000];
 	sprintf(mainfilename, "%s_main.ngc", argv[1]);
 	sprintf(coverfilename, "%s_cover.ngc", argv[1]);
+	sprintf(layoutfilename, "%s_layout.bin", argv[1]);
 
-	FILE* gfile = fopen(mainfilename, "wb");
-	if(!gfile)
+	if(!layout_write(layoutfilename, &L))
+		return 1;
+
+	FILE* outfile = fopen(mainfilename, "wb");
+	if(!outfile)
 	{
 		printf("Error opening file %s\n", mainfilename);
 		return 1;
 	}
 
-	FILE* coverfile;
+	FILE* coverfile = NULL;
 
 	if(do_covers)
 	{
@@ -298,37 +988,39 @@ int main(int argc, char** argv)
 		}
 	}
 
-	float y_step = cell + cellgap;
-	float x_step = sqrt(  (3.0*(cell/2.0)*(cell/2.0)) + (2.0*(cell/2.0)*cellgap)  ) * 1.05 * spacing_trim; // todo: fix math...
+	toolpath main_path, cover_path;
+	toolpath* gpath = &main_path;
+	toolpath* cpath = &cover_path;
+	tp_init(gpath);
+	tp_init(cpath);
 
-	printf("y_step = %f, x_step = %f\n", y_step, x_step);
+	printf("y_step = %f, x_step = %f\n", L.step[Y], L.step[X]);
+	float t_spiral = cellhole_time(CLEAR_SPIRAL), t_helices = cellhole_time(CLEAR_HELICES);
+	float t_trochoidal = cellhole_time(CLEAR_TROCHOIDAL);
+	printf("Cell hole %.1f s as a spiral, %.1f s with trochoidal loops, %.1f s as separate helices\n",
+		t_spiral, t_trochoidal, t_helices);
 
-	fprintf(gfile, "(");
-	for(int i = 0; i < 4; i++)
-	{
-		fprintf(gfile, " %s ", argv[i]);
-	}
-	fprintf(gfile, ")\n");
+	tp_text(gpath, "( %s  %s  %s  %s )", argv[0], argv[1], argv[2], argv[3]);
 
-	fprintf(gfile, "G21\n");
-	fprintf(gfile, "G90\n"); // absolute coords.
-//	fprintf(gfile, "G61\n"); // forces complete stop in corners, resulting in less rounding of corners.
+	tp_text(gpath, "G21");
+	tp_text(gpath, "G90"); // absolute coords.
+//	tp_text(gpath, "G61"); // forces complete stop in corners, resulting in less rounding of corners.
 
-	fprintf(gfile, "G00 Z%.2f\n", z_at_idle);
+	tp_z(gpath, OP_RAPID, z_at_idle);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G21\n");
-		fprintf(coverfile, "G61\n");
+		tp_text(cpath, "G21");
+		tp_text(cpath, "G61");
 		COVER_UNCUT();
-		fprintf(coverfile, "G00 F%.2f\n", cover_feedrate);
-		fprintf(coverfile, "M07 (air on)\n");
-		delay(coverfile, 5.0);
+		tp_op(cpath, OP_RAPID);
+		tp_feed(cpath, cover_feedrate);
+		tp_text(cpath, "M07 (air on)");
+		delay(cpath, 5.0);
 
 	}
 
 	float front_origin_x = 10.0;
-	float front_origin_y = 10.0;
 	float side_origin_x = 10.0;
 	float side_origin_y = 10.0;
 
@@ -348,28 +1040,28 @@ int main(int argc, char** argv)
 	{
 		if(side_at_back)
 		{
-			side_origin_x = origin_x + wallgaps[0] + x_step*(x-1) + cell + wallgaps[2] + part_separation
+			side_origin_x = origin_x + L.size[X] + part_separation
 				+ thickness*2.0;
 		}
 		else
 		{
 			origin_y += cell_length + part_separation + (do_covers?(cover_thickness*2.0):0.0);
-			front_origin_y = origin_y;
 		}
 	}
 
+	int c = 0; // cell in the layout
 	for(int curx = 0; curx < x; curx++)
 	{
 		int y = ys[curx%2];
-		float y_offset = (curx%2)?(y_step/2.0):(0.0);
-		for(int cury = 0; cury < y; cury++)
+		for(int cury = 0; cury < y; cury++, c++)
 		{
 
-			float mid_x = origin_x + wallgaps[0] + x_step*curx + cell/2.0;
-			float mid_y = origin_y + wallgaps[1] + y_step*cury + cell/2.0 + y_offset;
+			float mid_x = origin_x + L.mid[c][X];
+			float mid_y = origin_y + L.mid[c][Y];
 
-			fprintf(gfile, "(WELDPOINT %u;%u;%.2f;%.2f)\n", curx, cury, mid_x-origin_x, mid_y-origin_y);
-			do_cellhole(gfile, mid_x, mid_y);
+			tp_contour(gpath);
+			tp_text(gpath, "(WELDPOINT %u;%u;%.2f;%.2f)", curx, cury, mid_x-origin_x, mid_y-origin_y);
+			do_cellhole(gpath, mid_x, mid_y);
 
 /*
 			// Do end bms bonusholes:
@@ -378,7 +1070,7 @@ int main(int argc, char** argv)
 				float bonushole_midx = mid_x;
 				if(curx == 0) bonushole_midx -= cell/2.0; else bonushole_midx += cell/2.0;
 
-				float bonushole_midy = origin_y + wallgaps[1] + y_step*(ys[0]-1) + cell/2.0;
+				float bonushole_midy = origin_y + L.row[ys[0]-1];
 				float shift = cell/2.0 + end_bonusholes/2.0 + end_bonusholes_dist;
 				bonushole_midy += shift;
 				float bonushole_startx = bonushole_midx - end_bonusholes/2.0;
@@ -388,13 +1080,12 @@ int main(int argc, char** argv)
 				float bonushole_offset_i = end_bonusholes/2.0 - toolsize;
 				float bonushole_offset_j = 0.0;
 
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed);
+				tp_rapid(gpath, bonushole_startx_trimmed, bonushole_starty_trimmed);
 				CUT();
-				fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed,
-					bonushole_offset_i, bonushole_offset_j);
+				tp_arc(gpath, OP_CW, bonushole_startx_trimmed, bonushole_starty_trimmed, bonushole_offset_i, bonushole_offset_j);
 
 				UNCUT();
-				delay(gfile, delay_per_cell*0.25);
+				delay(gpath, delay_per_cell*0.25);
 
 
 			}
@@ -417,17 +1108,16 @@ int main(int argc, char** argv)
 				float bonushole_offset_i = bonushole/2.0 - toolsize;
 				float bonushole_offset_j = 0.0;
 
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed);
+				tp_rapid(gpath, bonushole_startx_trimmed, bonushole_starty_trimmed);
 				CUT();
-				fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed,
-					bonushole_offset_i, bonushole_offset_j);
+				tp_arc(gpath, OP_CW, bonushole_startx_trimmed, bonushole_starty_trimmed, bonushole_offset_i, bonushole_offset_j);
 
 				UNCUT();
-				delay(gfile, delay_per_cell*0.25);
+				delay(gpath, delay_per_cell*0.25);
 			}
 
 */
-//			delay(gfile, delay_per_cell);
+//			delay(gpath, delay_per_cell);
 
 		}
 	}
@@ -437,37 +1127,35 @@ int main(int argc, char** argv)
 	float cover_outline[4][2];
 	outline[0][X] = origin_x;
 	outline[0][Y] = origin_y;
-	outline[1][X] = origin_x + wallgaps[0] + x_step*(x-1) + cell + wallgaps[2];
+	outline[1][X] = origin_x + L.size[X];
 	outline[1][Y] = outline[0][Y];
 	outline[2][X] = outline[1][X];
-	outline[2][Y] = origin_y + wallgaps[1] + y_step*(ys[0]-1) + cell + wallgaps[3];
-	if(ys[1] == ys[0])
-		outline[2][Y] += y_step/2.0;
+	outline[2][Y] = origin_y + L.size[Y];
 	outline[3][X] = origin_x;
 	outline[3][Y] = outline[2][Y];
 
 	side_outline[0][X] = side_origin_x;
 	side_outline[0][Y] = side_origin_y;
-	side_outline[1][X] = side_origin_x + wallgaps[0] + x_step*(x-1) + cell + wallgaps[2];
+	side_outline[1][X] = side_origin_x + L.size[X];
 	side_outline[1][Y] = side_outline[0][Y];
 
 	cover_outline[0][X] = cover_origin_x;
 	cover_outline[0][Y] = cover_origin_y;
-	cover_outline[1][X] = cover_origin_x + wallgaps[0] + x_step*(x-1) + cell + wallgaps[2];
+	cover_outline[1][X] = cover_origin_x + L.size[X];
 	cover_outline[1][Y] = cover_outline[0][Y];
 	cover_outline[2][X] = cover_outline[1][X];
-	cover_outline[2][Y] = cover_origin_y + wallgaps[1] + y_step*(ys[0]-1) + cell + wallgaps[3];
-	if(ys[1] == ys[0])
-		cover_outline[2][Y] += y_step/2.0;
+	cover_outline[2][Y] = cover_origin_y + L.size[Y];
 	cover_outline[3][X] = cover_outline[0][X];
 	cover_outline[3][Y] = cover_outline[2][Y];
 
-	fprintf(gfile, "G00 X%.2f Y%.2f (ALIGNPOINT 0;0;%.2f;%.2f)\n", outline[0][X]-toolsize, outline[0][Y]-toolsize,
-		outline[0][X]-(do_fronts?thickness:0.0), outline[0][Y]-(do_sides?thickness:0.0));
+	tp_contour(gpath);
+	tp_rapid(gpath, outline[0][X]-toolsize, outline[0][Y]-toolsize);
+	tp_note(gpath, "ALIGNPOINT 0;0;%.2f;%.2f", origin_x+L.align[0][X], origin_y+L.align[0][Y]);
+	int outline_first = gpath->num;
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G00 X%.2f Y%.2f\n", cover_outline[0][X]-thickness-cover_toolsize, cover_outline[0][Y]-cover_toolsize);
+		tp_rapid(cpath, cover_outline[0][X]-thickness-cover_toolsize, cover_outline[0][Y]-cover_toolsize);
 		COVER_CUT();
 	}
 
@@ -477,45 +1165,50 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int curx = 0; curx < x; curx++)
 		{
-			float finger_start_x = origin_x + wallgaps[0] + x_step*curx + cell/2.0 - finger_size_x/2.0;
+			float finger_start_x = origin_x + L.finger[X][curx];
 			float finger_end_x = finger_start_x + finger_size_x;
 
-			float cfinger_start_x = cover_origin_x + wallgaps[0] + x_step*curx + cell/2.0 - finger_size_x/2.0;
+			float cfinger_start_x = cover_origin_x + L.finger[X][curx];
 			float cfinger_end_x = cfinger_start_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f Z%.2f F%.2f\n", finger_start_x-toolsize, outline[0][Y]-toolsize, fullcut_z, feedrate);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-toolsize, outline[0][Y]
+			tp_line(gpath, finger_start_x-toolsize, outline[0][Y]-toolsize);
+			tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+			tp_line(gpath, finger_start_x-toolsize, outline[0][Y]
 				-thickness-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+toolsize, outline[0][Y]
+			tp_feed(gpath, fd.feed[FEAT_FINGER]);
+			tp_line(gpath, finger_end_x+toolsize, outline[0][Y]
 				-thickness-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+toolsize, outline[0][Y]-toolsize);
+			tp_line(gpath, finger_end_x+toolsize, outline[0][Y]-toolsize);
 
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f F%.2f\n", cfinger_start_x-cover_toolsize, cover_outline[0][Y]-cover_toolsize, cover_feedrate);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_start_x-cover_toolsize, cover_outline[0][Y]
+				tp_line(cpath, cfinger_start_x-cover_toolsize, cover_outline[0][Y]-cover_toolsize);
+				tp_feed(cpath, cover_feedrate);
+				tp_line(cpath, cfinger_start_x-cover_toolsize, cover_outline[0][Y]
 					-thickness-cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x+cover_toolsize, cover_outline[0][Y]
+				tp_line(cpath, cfinger_end_x+cover_toolsize, cover_outline[0][Y]
 					-thickness-cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x+cover_toolsize, cover_outline[0][Y]-cover_toolsize);
+				tp_line(cpath, cfinger_end_x+cover_toolsize, cover_outline[0][Y]-cover_toolsize);
 			}
 
 		}
 	}
 
-	fprintf(gfile, "G01 X%.2f Y%.2f (ALIGNPOINT 1;0;%.2f;%.2f)\n", outline[1][X]+toolsize, outline[1][Y]-toolsize,
-		outline[1][X]+(do_fronts?thickness:0.0), outline[1][Y]-(do_sides?thickness:0.0));
+	tp_line(gpath, outline[1][X]+toolsize, outline[1][Y]-toolsize);
+	tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+	tp_note(gpath, "ALIGNPOINT 1;0;%.2f;%.2f", origin_x+L.align[1][X], origin_y+L.align[1][Y]);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f F%.2f\n", cover_outline[1][X]+thickness+cover_toolsize, cover_outline[1][Y]-cover_toolsize, cover_feedrate);
+		tp_line(cpath, cover_outline[1][X]+thickness+cover_toolsize, cover_outline[1][Y]-cover_toolsize);
+		tp_feed(cpath, cover_feedrate);
 
 	}
 
 	if(do_covers)
 	{
 		COVER_UNCUT();
-		delay(coverfile, cover_delay_per_cell*x);
+		delay(cpath, cover_delay_per_cell*x);
 		COVER_CUT();
 	}
 
@@ -526,40 +1219,43 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int cury = 0; cury < ys[0]; cury++)
 		{
-			float finger_start_y = origin_y + wallgaps[1] + y_step*cury + cell/2.0 - finger_size_y/2.0;
+			float finger_start_y = origin_y + L.finger[Y][cury];
 			float finger_end_y = finger_start_y + finger_size_y;
-			float cfinger_start_y = cover_origin_y + wallgaps[1] + y_step*cury + cell/2.0 - finger_size_y/2.0;
-			float cfinger_end_y = cfinger_start_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+toolsize, finger_start_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+thickness+toolsize, finger_start_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+thickness+toolsize, finger_end_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[1][X]+toolsize, finger_end_y+toolsize);
+			tp_line(gpath, outline[1][X]+toolsize, finger_start_y-toolsize);
+			tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+			tp_line(gpath, outline[1][X]+thickness+toolsize, finger_start_y-toolsize);
+			tp_feed(gpath, fd.feed[FEAT_FINGER]);
+			tp_line(gpath, outline[1][X]+thickness+toolsize, finger_end_y+toolsize);
+			tp_line(gpath, outline[1][X]+toolsize, finger_end_y+toolsize);
 
 /*
+			float cfinger_start_y = cover_origin_y + L.finger[Y][cury];
+			float cfinger_end_y = cfinger_start_y + finger_size_y;
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+cover_toolsize, cfinger_start_y-cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+thickness+cover_toolsize, cfinger_start_y-cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+thickness+cover_toolsize, cfinger_end_y+cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[1][X]+cover_toolsize, cfinger_end_y+cover_toolsize);
+				tp_line(cpath, cover_outline[1][X]+cover_toolsize, cfinger_start_y-cover_toolsize);
+				tp_line(cpath, cover_outline[1][X]+thickness+cover_toolsize, cfinger_start_y-cover_toolsize);
+				tp_line(cpath, cover_outline[1][X]+thickness+cover_toolsize, cfinger_end_y+cover_toolsize);
+				tp_line(cpath, cover_outline[1][X]+cover_toolsize, cfinger_end_y+cover_toolsize);
 
 			}
 */
 		}
 	}
 
-	fprintf(gfile, "G01 X%.2f Y%.2f (ALIGNPOINT 1;1;%.2f;%.2f)\n", outline[2][X]+toolsize, outline[2][Y]+toolsize,
-		outline[2][X]+(do_fronts?thickness:0.0), outline[2][Y]+(do_sides?thickness:0.0));
+	tp_line(gpath, outline[2][X]+toolsize, outline[2][Y]+toolsize);
+	tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+	tp_note(gpath, "ALIGNPOINT 1;1;%.2f;%.2f", origin_x+L.align[2][X], origin_y+L.align[2][Y]);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[2][X]+thickness+cover_toolsize, cover_outline[2][Y]+cover_toolsize);
+		tp_line(cpath, cover_outline[2][X]+thickness+cover_toolsize, cover_outline[2][Y]+cover_toolsize);
 	}
 
 	if(do_covers)
 	{
 		COVER_UNCUT();
-		delay(coverfile, 0.7*cover_delay_per_cell*ys[0]);
+		delay(cpath, 0.7*cover_delay_per_cell*ys[0]);
 		COVER_CUT();
 	}
 
@@ -572,38 +1268,41 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int curx = x-1; curx >= 0; curx--)
 		{
-			float finger_end_x = origin_x + wallgaps[0] + x_step*curx + cell/2.0 - finger_size_x/2.0;
+			float finger_end_x = origin_x + L.finger[X][curx];
 			float finger_start_x = finger_end_x + finger_size_x;
-			float cfinger_end_x = cover_origin_x + wallgaps[0] + x_step*curx + cell/2.0 - finger_size_x/2.0;
+			float cfinger_end_x = cover_origin_x + L.finger[X][curx];
 			float cfinger_start_x = cfinger_end_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+toolsize, outline[2][Y]+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+toolsize, outline[2][Y]+thickness+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-toolsize, outline[2][Y]+thickness+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-toolsize, outline[2][Y]+toolsize);
+			tp_line(gpath, finger_start_x+toolsize, outline[2][Y]+toolsize);
+			tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+			tp_line(gpath, finger_start_x+toolsize, outline[2][Y]+thickness+toolsize);
+			tp_feed(gpath, fd.feed[FEAT_FINGER]);
+			tp_line(gpath, finger_end_x-toolsize, outline[2][Y]+thickness+toolsize);
+			tp_line(gpath, finger_end_x-toolsize, outline[2][Y]+toolsize);
 
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_start_x+cover_toolsize, cover_outline[2][Y]+cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_start_x+cover_toolsize, cover_outline[2][Y]+thickness+cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x-cover_toolsize, cover_outline[2][Y]+thickness+cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cfinger_end_x-cover_toolsize, cover_outline[2][Y]+cover_toolsize);
+				tp_line(cpath, cfinger_start_x+cover_toolsize, cover_outline[2][Y]+cover_toolsize);
+				tp_line(cpath, cfinger_start_x+cover_toolsize, cover_outline[2][Y]+thickness+cover_toolsize);
+				tp_line(cpath, cfinger_end_x-cover_toolsize, cover_outline[2][Y]+thickness+cover_toolsize);
+				tp_line(cpath, cfinger_end_x-cover_toolsize, cover_outline[2][Y]+cover_toolsize);
 			}
 		}
 	}
 
-	fprintf(gfile, "G01 X%.2f Y%.2f (ALIGNPOINT 0;1;%.2f;%.2f)\n", outline[3][X]-toolsize, outline[3][Y]+toolsize,
-		outline[3][X]-(do_fronts?thickness:0.0), outline[3][Y]+(do_sides?thickness:0.0));
+	tp_line(gpath, outline[3][X]-toolsize, outline[3][Y]+toolsize);
+	tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+	tp_note(gpath, "ALIGNPOINT 0;1;%.2f;%.2f", origin_x+L.align[3][X], origin_y+L.align[3][Y]);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-thickness-cover_toolsize, cover_outline[3][Y]+cover_toolsize);
+		tp_line(cpath, cover_outline[3][X]-thickness-cover_toolsize, cover_outline[3][Y]+cover_toolsize);
 	}
 
 	if(do_covers)
 	{
 		COVER_UNCUT();
-		delay(coverfile, cover_delay_per_cell*x);
+		delay(cpath, cover_delay_per_cell*x);
 		COVER_CUT();
 	}
 
@@ -614,22 +1313,24 @@ int main(int argc, char** argv)
 		// Finger cut
 		for(int cury = ys[0]-1; cury >=0; cury--)
 		{
-			float finger_end_y = origin_y + wallgaps[1] + y_step*cury + cell/2.0 - finger_size_y/2.0;
+			float finger_end_y = origin_y + L.finger[Y][cury];
 			float finger_start_y = finger_end_y + finger_size_y;
-			float cfinger_end_y = cover_origin_y + wallgaps[1] + y_step*cury + cell/2.0 - finger_size_y/2.0;
-			float cfinger_start_y = cfinger_end_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-toolsize, finger_start_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-thickness-toolsize, finger_start_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-thickness-toolsize, finger_end_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[3][X]-toolsize, finger_end_y-toolsize);
+			tp_line(gpath, outline[3][X]-toolsize, finger_start_y+toolsize);
+			tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+			tp_line(gpath, outline[3][X]-thickness-toolsize, finger_start_y+toolsize);
+			tp_feed(gpath, fd.feed[FEAT_FINGER]);
+			tp_line(gpath, outline[3][X]-thickness-toolsize, finger_end_y-toolsize);
+			tp_line(gpath, outline[3][X]-toolsize, finger_end_y-toolsize);
 
 /*
+			float cfinger_end_y = cover_origin_y + L.finger[Y][cury];
+			float cfinger_start_y = cfinger_end_y + finger_size_y;
 			if(do_covers)
 			{
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-cover_toolsize, cfinger_start_y+cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-thickness-cover_toolsize, cfinger_start_y+cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-thickness-cover_toolsize, cfinger_end_y-cover_toolsize);
-				fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[3][X]-cover_toolsize, cfinger_end_y-cover_toolsize);
+				tp_line(cpath, cover_outline[3][X]-cover_toolsize, cfinger_start_y+cover_toolsize);
+				tp_line(cpath, cover_outline[3][X]-thickness-cover_toolsize, cfinger_start_y+cover_toolsize);
+				tp_line(cpath, cover_outline[3][X]-thickness-cover_toolsize, cfinger_end_y-cover_toolsize);
+				tp_line(cpath, cover_outline[3][X]-cover_toolsize, cfinger_end_y-cover_toolsize);
 			}
 */
 		}
@@ -637,19 +1338,44 @@ int main(int argc, char** argv)
 	}
 
 
-	fprintf(gfile, "G01 X%.2f Y%.2f\n", outline[0][X]-toolsize, outline[0][Y]-toolsize);
-	fprintf(gfile, "G01 Z%.2f\n", z_at_idle);
+	tp_line(gpath, outline[0][X]-toolsize, outline[0][Y]-toolsize);
+	tp_feed(gpath, fd.feed[FEAT_OUTLINE]);
+
+	// Around again a step deeper each time, ramping down along the first line.
+	// Down to the top of the tabs, then through but for the tabs.
+	int outline_end = gpath->num;
+	float z_bottom = z_at_surface - thickness;
+	float z_tab = outline_tabs.count?fmaxf(z_bottom + outline_tabs.height, fullcut_z):fullcut_z;
+	int passes = feeds_passes(z_at_surface - z_tab, fd.step_down[FEAT_OUTLINE]);
+	for(int p = 1; p <= passes; p++)
+	{
+		int first = (p == 1)?outline_first:gpath->num;
+		if(p > 1)
+			repeat_moves(gpath, outline_first, outline_end);
+		gpath->words[first] |= W_Z;
+		gpath->pos[first][2] = (p == passes)?z_tab:(z_at_surface - (z_at_surface - z_tab)*p/passes);
+	}
+	int tab_passes = (z_tab > fullcut_z)?feeds_passes(z_tab - fullcut_z, fd.step_down[FEAT_OUTLINE]):0;
+	float outline_start[2] = {gpath->pos[outline_first-1][X], gpath->pos[outline_first-1][Y]};
+	for(int p = 1; p <= tab_passes; p++)
+	{
+		float z = (p == tab_passes)?fullcut_z:(z_tab - (z_tab - fullcut_z)*p/tab_passes);
+		tabs_cut(gpath, gpath, outline_first, outline_end, outline_start, z_tab, z, z_bottom,
+			toolsize, fd.plunge, &outline_tabs);
+	}
+	tp_z(gpath, OP_LINE, z_at_idle);
+	tp_trailer(gpath);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G01 X%.2f Y%.2f\n", cover_outline[0][X]-thickness-cover_toolsize, cover_outline[0][Y]-cover_toolsize);
+		tp_line(cpath, cover_outline[0][X]-thickness-cover_toolsize, cover_outline[0][Y]-cover_toolsize);
 
 	}
 
 	if(do_covers)
 	{
 		COVER_UNCUT();
-//		delay(coverfile, 0.7*cover_delay_per_cell*ys[0]);
+//		delay(cpath, 0.7*cover_delay_per_cell*ys[0]);
 	}
 
 
@@ -680,24 +1406,24 @@ n ||||  v step
 	// Do side panel
 	if(do_sides)
 	{
-		fprintf(gfile, "G00 X%.2f Y%.2f\n", side_outline[0][X]-toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
+		tp_rapid(gpath, side_outline[0][X]-toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
 		CUT();
 		// Bottom horizontal
 		for(int curx = 0; curx < x; curx++)
 		{
-			float finger_start_x = side_origin_x + wallgaps[0] + x_step*curx + cell/2.0 - finger_size_x/2.0;
+			float finger_start_x = side_origin_x + L.finger[X][curx];
 			float finger_end_x = finger_start_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+toolsize, side_origin_y+thickness-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-toolsize, side_origin_y+thickness-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
+			tp_line(gpath, finger_start_x+toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
+			tp_line(gpath, finger_start_x+toolsize, side_origin_y+thickness-toolsize);
+			tp_line(gpath, finger_end_x-toolsize, side_origin_y+thickness-toolsize);
+			tp_line(gpath, finger_end_x-toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
+		tp_line(gpath, side_outline[1][X]+toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*x);
+		delay(gpath, delay_per_cell*x);
 		CUT_PWR(vertical_power_mult);
 
 		// Right vertical
@@ -706,34 +1432,34 @@ n ||||  v step
 			float finger_start_y = side_origin_y + thickness +
 				side_front_finger_step*cury;
 			float finger_end_y = finger_start_y + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+toolsize, finger_start_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+thickness+toolsize, finger_start_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+thickness+toolsize, finger_end_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+toolsize, finger_end_y+toolsize);
+			tp_line(gpath, side_outline[1][X]+toolsize, finger_start_y-toolsize);
+			tp_line(gpath, side_outline[1][X]+thickness+toolsize, finger_start_y-toolsize);
+			tp_line(gpath, side_outline[1][X]+thickness+toolsize, finger_end_y+toolsize);
+			tp_line(gpath, side_outline[1][X]+toolsize, finger_end_y+toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[1][X]+toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
+		tp_line(gpath, side_outline[1][X]+toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*3);
+		delay(gpath, delay_per_cell*3);
 		CUT();
 
 		// Top horizontal
 		for(int curx = x-1; curx >= 0; curx--)
 		{
-			float finger_end_x = side_origin_x + wallgaps[0] + x_step*curx + cell/2.0 - finger_size_x/2.0;
+			float finger_end_x = side_origin_x + L.finger[X][curx];
 			float finger_start_x = finger_end_x + finger_size_x;
 
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-toolsize, side_origin_y+cell_length-thickness+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+toolsize, side_origin_y+cell_length-thickness+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
+			tp_line(gpath, finger_start_x-toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
+			tp_line(gpath, finger_start_x-toolsize, side_origin_y+cell_length-thickness+toolsize);
+			tp_line(gpath, finger_end_x+toolsize, side_origin_y+cell_length-thickness+toolsize);
+			tp_line(gpath, finger_end_x+toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
+		tp_line(gpath, side_outline[0][X]-toolsize, side_origin_y+cell_length+(do_covers?cover_thickness:0.0)+toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*x);
+		delay(gpath, delay_per_cell*x);
 		CUT_PWR(vertical_power_mult);
 
 		// Left vertical
@@ -743,28 +1469,26 @@ n ||||  v step
 			float finger_end_y = side_origin_y + thickness +
 				side_front_finger_step*cury;
 			float finger_start_y = finger_end_y + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-toolsize, finger_start_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-thickness-toolsize, finger_start_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-thickness-toolsize, finger_end_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-toolsize, finger_end_y-toolsize);
+			tp_line(gpath, side_outline[0][X]-toolsize, finger_start_y+toolsize);
+			tp_line(gpath, side_outline[0][X]-thickness-toolsize, finger_start_y+toolsize);
+			tp_line(gpath, side_outline[0][X]-thickness-toolsize, finger_end_y-toolsize);
+			tp_line(gpath, side_outline[0][X]-toolsize, finger_end_y-toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", side_outline[0][X]-toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
+		tp_line(gpath, side_outline[0][X]-toolsize, side_origin_y-(do_covers?cover_thickness:0.0)-toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*3);
+		delay(gpath, delay_per_cell*3);
 
 		if(do_side_bonusholes)
 		{
 			for(int curx = 0; curx < x; curx++)
 			{
-				int y = ys[curx%2];
-				float y_offset = (curx%2)?(y_step/2.0):(0.0);
 				for(int cury = 0; cury < 2; cury++)
 				{
 					if(curx%2)
 					{
-						float bonushole_midx = side_origin_x + wallgaps[0] + x_step*curx + cell/2.0;
+						float bonushole_midx = side_origin_x + L.col[curx];
 						float bonushole_midy = cury?
 							(side_origin_y+cell_length-thickness-side_bonushole_dist):
 							(side_origin_y+thickness+side_bonushole_dist);
@@ -775,7 +1499,7 @@ n ||||  v step
 						float bonushole_offset_i = side_bonushole_size/2.0 - toolsize;
 						float bonushole_offset_j = 0.0;
 
-						fprintf(gfile, "G00 X%.2f Y%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed);
+						tp_rapid(gpath, bonushole_startx_trimmed, bonushole_starty_trimmed);
 						if(do_side_bonusholes == 2)
 						{
 							CUT_MARK();
@@ -784,12 +1508,11 @@ n ||||  v step
 						{
 							CUT();
 						}
-						fprintf(gfile, "G02 X%.2f Y%.2f I%.2f J%.2f\n", bonushole_startx_trimmed, bonushole_starty_trimmed,
-							bonushole_offset_i, bonushole_offset_j);
+						tp_arc(gpath, OP_CW, bonushole_startx_trimmed, bonushole_starty_trimmed, bonushole_offset_i, bonushole_offset_j);
 						UNCUT();
 						if(do_side_bonusholes != 2)
 						{
-							delay(gfile, delay_per_cell*0.25);
+							delay(gpath, delay_per_cell*0.25);
 						}
 					}
 				}
@@ -809,7 +1532,7 @@ n ||||  v step
 
 		for(int cury = 0; cury < ys[0]; cury++)
 		{
-			float fhole_start_y = origin_y + wallgaps[1] + y_step*cury + cell/2.0 - fhole_width/2.0;
+			float fhole_start_y = origin_y + L.row[cury] - fhole_width/2.0;
 			if(ys[0] == ys[1])
 				fhole_start_y += (cell+cellgap)/4.0;
 
@@ -821,36 +1544,36 @@ n ||||  v step
 						+ front_mid_width/2.0;
 				float fhole_end_x = fhole_start_x + fhole_height;
 
-				fprintf(gfile, "G00 X%.2f Y%.2f\n", fhole_start_x+toolsize, fhole_start_y+toolsize);
+				tp_rapid(gpath, fhole_start_x+toolsize, fhole_start_y+toolsize);
 				CUT();
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_end_x-toolsize, fhole_start_y+toolsize);
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_end_x-toolsize, fhole_end_y-toolsize);
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_start_x+toolsize, fhole_end_y-toolsize);
-				fprintf(gfile, "G01 X%.2f Y%.2f\n", fhole_start_x+toolsize, fhole_start_y+toolsize);
+				tp_line(gpath, fhole_end_x-toolsize, fhole_start_y+toolsize);
+				tp_line(gpath, fhole_end_x-toolsize, fhole_end_y-toolsize);
+				tp_line(gpath, fhole_start_x+toolsize, fhole_end_y-toolsize);
+				tp_line(gpath, fhole_start_x+toolsize, fhole_start_y+toolsize);
 				UNCUT();
-				delay(gfile, delay_per_cell);
+				delay(gpath, delay_per_cell);
 
 			}
 		}
 
 
 		// Left vertical (joins bottom main cell board)
-		fprintf(gfile, "G00 X%.2f Y%.2f\n", front_origin_x-toolsize, outline[3][Y]+thickness+toolsize);
+		tp_rapid(gpath, front_origin_x-toolsize, outline[3][Y]+thickness+toolsize);
 		CUT_PWR(vertical_power_mult);
 		for(int cury = ys[0]-1; cury >=0; cury--)
 		{
-			float finger_end_y = origin_y + wallgaps[1] + y_step*cury + cell/2.0 - finger_size_y/2.0;
+			float finger_end_y = origin_y + L.finger[Y][cury];
 			float finger_start_y = finger_end_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-toolsize, finger_start_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+thickness-toolsize, finger_start_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+thickness-toolsize, finger_end_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-toolsize, finger_end_y+toolsize);
+			tp_line(gpath, front_origin_x-toolsize, finger_start_y-toolsize);
+			tp_line(gpath, front_origin_x+thickness-toolsize, finger_start_y-toolsize);
+			tp_line(gpath, front_origin_x+thickness-toolsize, finger_end_y+toolsize);
+			tp_line(gpath, front_origin_x-toolsize, finger_end_y+toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-toolsize, outline[0][Y]-thickness-toolsize);
+		tp_line(gpath, front_origin_x-toolsize, outline[0][Y]-thickness-toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*ys[0]);
+		delay(gpath, delay_per_cell*ys[0]);
 		CUT();
 
 		// Bottom horizontal (joins to a side board)
@@ -860,34 +1583,34 @@ n ||||  v step
 			float finger_start_x = front_origin_x + thickness +
 				side_front_finger_step*curx;
 			float finger_end_x = finger_start_x + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+toolsize, outline[0][Y]-thickness-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x+toolsize, outline[0][Y]-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-toolsize, outline[0][Y]-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x-toolsize, outline[0][Y]-thickness-toolsize);
+			tp_line(gpath, finger_start_x+toolsize, outline[0][Y]-thickness-toolsize);
+			tp_line(gpath, finger_start_x+toolsize, outline[0][Y]-toolsize);
+			tp_line(gpath, finger_end_x-toolsize, outline[0][Y]-toolsize);
+			tp_line(gpath, finger_end_x-toolsize, outline[0][Y]-thickness-toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+toolsize, outline[0][Y]-thickness-toolsize);
+		tp_line(gpath, front_origin_x+cell_length+toolsize, outline[0][Y]-thickness-toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*3);
+		delay(gpath, delay_per_cell*3);
 		CUT_PWR(vertical_power_mult);
 
 		// Right vertical (joins to top main cell board)
 
 		for(int cury = 0; cury < ys[0]; cury++)
 		{
-			float finger_start_y = origin_y + wallgaps[1] + y_step*cury + cell/2.0 - finger_size_y/2.0;
+			float finger_start_y = origin_y + L.finger[Y][cury];
 			float finger_end_y = finger_start_y + finger_size_y;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+toolsize, finger_start_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length-thickness+toolsize, finger_start_y+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length-thickness+toolsize, finger_end_y-toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+toolsize, finger_end_y-toolsize);
+			tp_line(gpath, front_origin_x+cell_length+toolsize, finger_start_y+toolsize);
+			tp_line(gpath, front_origin_x+cell_length-thickness+toolsize, finger_start_y+toolsize);
+			tp_line(gpath, front_origin_x+cell_length-thickness+toolsize, finger_end_y-toolsize);
+			tp_line(gpath, front_origin_x+cell_length+toolsize, finger_end_y-toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x+cell_length+toolsize, outline[2][Y]+thickness+toolsize);
+		tp_line(gpath, front_origin_x+cell_length+toolsize, outline[2][Y]+thickness+toolsize);
 
 		UNCUT();
-		delay(gfile, delay_per_cell*ys[0]);
+		delay(gpath, delay_per_cell*ys[0]);
 		CUT();
 
 		// Top horizontal (joins to another side board)
@@ -897,33 +1620,49 @@ n ||||  v step
 			float finger_end_x = front_origin_x + thickness +
 				side_front_finger_step*curx;
 			float finger_start_x = finger_end_x + side_front_finger_step/2.0;
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-toolsize, outline[2][Y]+thickness+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_start_x-toolsize, outline[2][Y]+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+toolsize, outline[2][Y]+toolsize);
-			fprintf(gfile, "G01 X%.2f Y%.2f\n", finger_end_x+toolsize, outline[2][Y]+thickness+toolsize);
+			tp_line(gpath, finger_start_x-toolsize, outline[2][Y]+thickness+toolsize);
+			tp_line(gpath, finger_start_x-toolsize, outline[2][Y]+toolsize);
+			tp_line(gpath, finger_end_x+toolsize, outline[2][Y]+toolsize);
+			tp_line(gpath, finger_end_x+toolsize, outline[2][Y]+thickness+toolsize);
 		}
 
-		fprintf(gfile, "G01 X%.2f Y%.2f\n", front_origin_x-toolsize, outline[3][Y]+thickness+toolsize);
+		tp_line(gpath, front_origin_x-toolsize, outline[3][Y]+thickness+toolsize);
 
 		UNCUT();
-//		delay(gfile, delay_per_cell*3);
+//		delay(gpath, delay_per_cell*3);
 
 	}
 
-	fprintf(gfile, "G00 X%.2f Y%.2f\n", origin_x, origin_y);
-	delay(gfile, 15.0);
+	tp_rapid(gpath, origin_x, origin_y);
+	delay(gpath, 15.0);
 
 
-	fprintf(gfile, "M2\n%%\n");
-	fclose(gfile);
+	tp_text(gpath, "M2");
+	tp_text(gpath, "%%");
+	if(link_order)
+	{
+		toolpath linked;
+		tp_init(&linked);
+		link_features(gpath, &linked);
+		tp_write(outfile, &linked);
+		tp_free(&linked);
+	}
+	else
+		tp_write(outfile, gpath);
+	fclose(outfile);
+	tp_free(gpath);
 
 	if(do_covers)
 	{
-		fprintf(coverfile, "G00 X%.2f Y%.2f\n", cover_origin_x, cover_origin_y);
-		delay(coverfile, 15.0);
-		fprintf(coverfile, "M2\n%%\n");
+		tp_rapid(cpath, cover_origin_x, cover_origin_y);
+		delay(cpath, 15.0);
+		tp_text(cpath, "M2");
+		tp_text(cpath, "%%");
+		tp_write(coverfile, cpath);
 		fclose(coverfile);
 	}
+	tp_free(cpath);
+	layout_free(&L);
 
 	return 0;
 }
@@ -0,0 +1,203 @@
+#ifndef TABS_H
+#define TABS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "toolpath.h"
+
+// Holding tabs for router_gen.
+// tabs_cut() cuts a closed contour through but for count tabs of material left evenly
+// along it, up to height over the bottom of the material, so that the part stays in
+// place while it is cut free at full depth. Over each tab the tool path leaves a gap
+// of the tab width plus the tool diameter. It goes up to the top of the tab and back
+// down along ramp mm of the path on each side, or straight up and down for no ramp.
+// The contour is any lines and arcs of a toolpath, with their feeds. The last tab
+// ends where the contour does, so that the head ends on top of it, and the passes
+// over the contour at several depths leave the same tabs.
+
+#define TAB_EPS 1e-4
+
+typedef struct
+{
+	int count;
+	float width;   // of the material left, along the contour
+	float height;  // over the bottom of the material
+	float ramp;    // length of the path going down from the top of a tab, on each side
+} tabspec;
+
+// Length of move k of tp from pos. For an arc also the angle of pos around the center,
+// and the signed angle it sweeps: a full circle if it ends where it starts.
+float tab_move(const toolpath* tp, int k, const float* pos, float* center, float* a0, float* sweep)
+{
+	if(!(tp->words[k] & W_IJ))
+		return hypotf(tp->pos[k][0]-pos[0], tp->pos[k][1]-pos[1]);
+
+	center[0] = pos[0] + tp->arc[k][0];
+	center[1] = pos[1] + tp->arc[k][1];
+	float r = hypotf(tp->arc[k][0], tp->arc[k][1]);
+	*a0 = atan2f(-tp->arc[k][1], -tp->arc[k][0]);
+	float a1 = atan2f(tp->pos[k][1]-center[1], tp->pos[k][0]-center[0]);
+	float s = (tp->op[k] == OP_CW)?(*a0 - a1):(a1 - *a0);
+	while(s <= TAB_EPS)
+		s += 2.0*3.14159265358979;
+	*sweep = (tp->op[k] == OP_CW)?-s:s;
+	return r*s;
+}
+
+// Z at s along a contour of length len with tabs centered at c[0..n-1]: z_tab over the
+// tabs, z between them.
+float tab_z(const tabspec* t, const float* c, int n, float half, float len, float s, float z, float z_tab)
+{
+	float zz = z;
+	for(int k = 0; k < n; k++)
+	{
+		float u = fabsf(s - c[k]);
+		if(len - u < u)
+			u = len - u;
+		if(u <= half)
+			return z_tab;
+		if(u < half + t->ramp)
+			zz = fmaxf(zz, z_tab - (z_tab - z)*(u - half)/t->ramp);
+	}
+	return zz;
+}
+
+static int cmp_float(const void* a, const void* b)
+{
+	float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+// Appends the moves from..to-1 of src, a closed contour from start, at depth z with
+// the tabs of t on a material whose bottom is z_bottom. The head comes in at z_from
+// over start, and ends there on top of the last tab. src may be tp.
+void tabs_cut(toolpath* tp, const toolpath* src, int from, int to, const float* start, float z_from,
+	float z, float z_bottom, float tool, float plunge, const tabspec* t)
+{
+	float pos[2] = {start[0], start[1]}, center[2], a0, sweep;
+	float len = 0.0;
+	for(int k = from; k < to; k++)
+	{
+		if((src->op[k] != OP_LINE && src->op[k] != OP_CW && src->op[k] != OP_CCW) || !(src->words[k] & (W_X|W_Y)))
+			continue;
+		len += tab_move(src, k, pos, center, &a0, &sweep);
+		pos[0] = src->pos[k][0];
+		pos[1] = src->pos[k][1];
+	}
+
+	// As many tabs as there is room for with their ramps.
+	float half = (t->width + tool)/2.0;
+	int n = t->count;
+	if(n > (int)(len/(2.0*(half + t->ramp))))
+	{
+		n = (int)(len/(2.0*(half + t->ramp)));
+		printf("Room for %d of the %d tabs on a contour of %.1f mm\n", n, t->count, len);
+	}
+	float z_tab = z_bottom + t->height;
+	if(z_tab <= z)
+		n = 0;
+
+	float* c = malloc((n+1)*sizeof(float));
+	float* br = malloc((4*n+1)*sizeof(float));
+	int num_br = 0;
+	for(int k = 0; k < n; k++)
+	{
+		c[k] = len*(k+1)/n - half;
+		float b[4] = {c[k] - half - t->ramp, c[k] - half, c[k] + half, c[k] + half + t->ramp};
+		for(int i = 0; i < 4; i++)
+		{
+			float s = fmodf(b[i] + len, len);
+			if(s > TAB_EPS && s < len - TAB_EPS)
+				br[num_br++] = s;
+		}
+	}
+	qsort(br, num_br, sizeof(float), cmp_float);
+
+	float cur_z = z_from, s = 0.0, feed = 0.0;
+	int next_br = 0;
+	pos[0] = start[0];
+	pos[1] = start[1];
+	for(int k = from; k < to; k++)
+	{
+		int op = src->op[k];
+		if((op != OP_LINE && op != OP_CW && op != OP_CCW) || !(src->words[k] & (W_X|W_Y)))
+			continue;
+		float end[2] = {src->pos[k][0], src->pos[k][1]};
+		int need_feed = 0;
+		if(src->words[k] & W_F)
+		{
+			feed = src->feed[k];
+			need_feed = 1;
+		}
+		float l = tab_move(src, k, pos, center, &a0, &sweep);
+		float r = hypotf(src->arc[k][0], src->arc[k][1]);
+		float s0 = s;
+		while(s < s0 + l - TAB_EPS)
+		{
+			while(next_br < num_br && br[next_br] <= s + TAB_EPS)
+				next_br++;
+			float e = s0 + l;
+			int last = 1;
+			if(next_br < num_br && br[next_br] < e - TAB_EPS)
+			{
+				e = br[next_br];
+				last = 0;
+			}
+
+			float z0 = tab_z(t, c, n, half, len, s + TAB_EPS, z, z_tab);
+			float z1 = tab_z(t, c, n, half, len, e - TAB_EPS, z, z_tab);
+			if(fabsf(z0 - cur_z) > TAB_EPS)
+			{
+				tp_z(tp, OP_LINE, z0);
+				tp_feed(tp, plunge);
+				need_feed = 1;
+			}
+
+			float p[2] = {end[0], end[1]};
+			if(!last && op == OP_LINE)
+			{
+				p[0] = pos[0] + (end[0]-pos[0])*(e-s)/(s0+l-s);
+				p[1] = pos[1] + (end[1]-pos[1])*(e-s)/(s0+l-s);
+			}
+			else if(!last)
+			{
+				float a = a0 + sweep*(e-s0)/l;
+				p[0] = center[0] + cosf(a)*r;
+				p[1] = center[1] + sinf(a)*r;
+			}
+
+			if(op == OP_LINE)
+				tp_line(tp, p[0], p[1]);
+			else
+				tp_arc(tp, op, p[0], p[1], center[0]-pos[0], center[1]-pos[1]);
+			if(op != OP_LINE || (src->words[k] & W_FINE) || !last)
+				tp_fine(tp);
+			if(fabsf(z1 - z0) > TAB_EPS)
+				tp_with_z(tp, z1);
+			if(need_feed && feed > 0.0)
+				tp_feed(tp, feed);
+			need_feed = 0;
+
+			cur_z = z1;
+			pos[0] = p[0];
+			pos[1] = p[1];
+			s = e;
+		}
+		pos[0] = end[0];
+		pos[1] = end[1];
+		s = s0 + l;
+	}
+
+	// Up on the last tab, where it ends at the start.
+	if(n && fabsf(cur_z - z_tab) > TAB_EPS)
+	{
+		tp_z(tp, OP_LINE, z_tab);
+		tp_feed(tp, plunge);
+	}
+	free(c);
+	free(br);
+}
+
+#endif
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Plans a small pack and then a larger one on the same station, so that the second
+# one has to grow the cell store the first left behind. weld returns 1 when all
+# stations succeed; AddressSanitizer reports make it return 66.
+gcc -std=gnu99 -g -fsanitize=address weld.c -lm -lpthread -o /tmp/weld_asan || exit 1
+head -60 finalv2_top_main.ngc > /tmp/weld_small.ngc
+ASAN_OPTIONS=detect_leaks=0:exitcode=66 /tmp/weld_asan /tmp/weld_small.ngc,finalv2_top_main.ngc 2 +sp none > /tmp/weld_test.txt
+if [ $? -ne 1 ]; then
+	echo "weld: two packs on one store FAILED, see /tmp/weld_test.txt"
+	exit 1
+fi
+echo "weld: two packs on one store ok"
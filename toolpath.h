@@ -0,0 +1,472 @@
+#ifndef TOOLPATH_H
+#define TOOLPATH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+
+// Toolpath IR shared by cnc_gen and router_gen.
+// The generators append operations to a toolpath instead of printing G-code.
+// Passes (cut order, dwells, power) work on the flat arrays, and tp_write()
+// serializes the result in one buffered pass. Each operation is one output line.
+
+#define OP_TEXT  0 // a line as is: header, comments, codes without arguments
+#define OP_RAPID 1 // G00
+#define OP_LINE  2 // G01
+#define OP_CW    3 // G02
+#define OP_CCW   4 // G03
+#define OP_ON    5 // M03. value: power multiplier, or the S word itself with W_ABS
+#define OP_OFF   6 // M05
+#define OP_DWELL 7 // G04. value: seconds
+
+// Words of a line
+#define W_X    1
+#define W_Y    2
+#define W_Z    4
+#define W_IJ   8
+#define W_F    16
+#define W_FINE 32  // X, Y, I and J with 6 decimals instead of 2
+#define W_ABS  64  // OP_ON: value is the S word
+
+#define TAG_NONE 0     // preamble
+#define TAG_TRAILER -1
+
+typedef struct
+{
+	int num;
+	int size;
+	unsigned char* op;
+	unsigned char* words;
+	float (*pos)[3];
+	float (*arc)[2];   // I, J: arc center relative to the start
+	float* feed;
+	float* value;
+	int* tag;          // contour the operation belongs to, see tp_contour()
+	int* text;         // offset in pool: the line of OP_TEXT, or a comment after the words, -1 for none
+
+	char* pool;
+	int pool_len;
+	int pool_size;
+
+	int cur_tag;
+	int num_tags;
+	int* follows;      // per contour: the contour it is a later pass over, see tp_pass(). 0 for none
+	int tags_size;
+} toolpath;
+
+void tp_init(toolpath* tp)
+{
+	memset(tp, 0, sizeof(*tp));
+}
+
+void tp_free(toolpath* tp)
+{
+	free(tp->op);
+	free(tp->words);
+	free(tp->pos);
+	free(tp->arc);
+	free(tp->feed);
+	free(tp->value);
+	free(tp->tag);
+	free(tp->text);
+	free(tp->pool);
+	free(tp->follows);
+	memset(tp, 0, sizeof(*tp));
+}
+
+// Appends an operation without words. Returns its index.
+int tp_op(toolpath* tp, int op)
+{
+	if(tp->num == tp->size)
+	{
+		tp->size = tp->size?2*tp->size:1024;
+		tp->op = realloc(tp->op, tp->size*sizeof(*tp->op));
+		tp->words = realloc(tp->words, tp->size*sizeof(*tp->words));
+		tp->pos = realloc(tp->pos, tp->size*sizeof(*tp->pos));
+		tp->arc = realloc(tp->arc, tp->size*sizeof(*tp->arc));
+		tp->feed = realloc(tp->feed, tp->size*sizeof(*tp->feed));
+		tp->value = realloc(tp->value, tp->size*sizeof(*tp->value));
+		tp->tag = realloc(tp->tag, tp->size*sizeof(*tp->tag));
+		tp->text = realloc(tp->text, tp->size*sizeof(*tp->text));
+	}
+	int k = tp->num++;
+	tp->op[k] = op;
+	tp->words[k] = 0;
+	tp->pos[k][0] = tp->pos[k][1] = tp->pos[k][2] = 0.0;
+	tp->arc[k][0] = tp->arc[k][1] = 0.0;
+	tp->feed[k] = 0.0;
+	tp->value[k] = 0.0;
+	tp->tag[k] = tp->cur_tag;
+	tp->text[k] = -1;
+	return k;
+}
+
+int tp_pool_add(toolpath* tp, const char* s, int len)
+{
+	if(tp->pool_len+len+1 > tp->pool_size)
+	{
+		tp->pool_size = 2*(tp->pool_len+len+1) + 4096;
+		tp->pool = realloc(tp->pool, tp->pool_size);
+	}
+	int offs = tp->pool_len;
+	memcpy(tp->pool+offs, s, len);
+	tp->pool[offs+len] = 0;
+	tp->pool_len += len+1;
+	return offs;
+}
+
+int tp_vpool(toolpath* tp, const char* fmt, va_list ap)
+{
+	char line[1024];
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	if(len >= (int)sizeof(line))
+		len = sizeof(line)-1;
+	return tp_pool_add(tp, line, len);
+}
+
+// A line as is, printf style, without the newline.
+int tp_text(toolpath* tp, const char* fmt, ...)
+{
+	int k = tp_op(tp, OP_TEXT);
+	va_list ap;
+	va_start(ap, fmt);
+	tp->text[k] = tp_vpool(tp, fmt, ap);
+	va_end(ap);
+	return k;
+}
+
+int tp_xy(toolpath* tp, int op, float x, float y)
+{
+	int k = tp_op(tp, op);
+	tp->words[k] = W_X | W_Y;
+	tp->pos[k][0] = x;
+	tp->pos[k][1] = y;
+	return k;
+}
+
+int tp_rapid(toolpath* tp, float x, float y) { return tp_xy(tp, OP_RAPID, x, y); }
+int tp_line(toolpath* tp, float x, float y) { return tp_xy(tp, OP_LINE, x, y); }
+
+// G02 (OP_CW) or G03 (OP_CCW) to x, y around the center at i, j from the start.
+int tp_arc(toolpath* tp, int op, float x, float y, float i, float j)
+{
+	int k = tp_xy(tp, op, x, y);
+	tp->words[k] |= W_IJ;
+	tp->arc[k][0] = i;
+	tp->arc[k][1] = j;
+	return k;
+}
+
+// A Z only move (OP_RAPID or OP_LINE).
+int tp_z(toolpath* tp, int op, float z)
+{
+	int k = tp_op(tp, op);
+	tp->words[k] = W_Z;
+	tp->pos[k][2] = z;
+	return k;
+}
+
+// Words added to the last operation.
+void tp_with_z(toolpath* tp, float z)
+{
+	tp->words[tp->num-1] |= W_Z;
+	tp->pos[tp->num-1][2] = z;
+}
+
+void tp_feed(toolpath* tp, float feed)
+{
+	tp->words[tp->num-1] |= W_F;
+	tp->feed[tp->num-1] = feed;
+}
+
+void tp_fine(toolpath* tp)
+{
+	tp->words[tp->num-1] |= W_FINE;
+}
+
+// A comment after the words of the last operation, printf style, without the parentheses.
+void tp_note(toolpath* tp, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	tp->text[tp->num-1] = tp_vpool(tp, fmt, ap);
+	va_end(ap);
+}
+
+int tp_on(toolpath* tp, float mult)
+{
+	int k = tp_op(tp, OP_ON);
+	tp->value[k] = mult;
+	return k;
+}
+
+int tp_on_abs(toolpath* tp, int s)
+{
+	int k = tp_op(tp, OP_ON);
+	tp->words[k] = W_ABS;
+	tp->value[k] = s;
+	return k;
+}
+
+int tp_off(toolpath* tp) { return tp_op(tp, OP_OFF); }
+
+int tp_dwell(toolpath* tp, float seconds)
+{
+	int k = tp_op(tp, OP_DWELL);
+	tp->value[k] = seconds;
+	return k;
+}
+
+// Like tp_contour(), for a later pass over the feature cut by contour 'of' (a tag),
+// which the cut order pass keeps after it, and after the first passes of the others.
+void tp_pass(toolpath* tp, int of)
+{
+	if(tp->num_tags == tp->tags_size)
+	{
+		tp->tags_size = tp->tags_size?2*tp->tags_size:256;
+		tp->follows = realloc(tp->follows, tp->tags_size*sizeof(int));
+	}
+	tp->follows[tp->num_tags] = of;
+	tp->cur_tag = ++tp->num_tags;
+}
+
+// Takes over the contours of another toolpath, for a pass that copies its operations.
+void tp_copy_contours(toolpath* tp, const toolpath* from)
+{
+	free(tp->follows);
+	tp->follows = NULL;
+	tp->tags_size = 0;
+	if(from->num_tags)
+	{
+		tp->tags_size = from->num_tags;
+		tp->follows = malloc(tp->tags_size*sizeof(int));
+		memcpy(tp->follows, from->follows, tp->tags_size*sizeof(int));
+	}
+	tp->num_tags = from->num_tags;
+	tp->cur_tag = from->cur_tag;
+}
+
+// Operations from here on belong to a new closed contour, which the cut order
+// pass may move as a whole. tp_trailer() marks the end of the last one.
+void tp_contour(toolpath* tp)
+{
+	tp_pass(tp, 0);
+}
+
+void tp_trailer(toolpath* tp)
+{
+	tp->cur_tag = TAG_TRAILER;
+}
+
+// Appends operation k of another toolpath, with its tag.
+int tp_copy(toolpath* tp, const toolpath* from, int k)
+{
+	int n = tp_op(tp, from->op[k]);
+	tp->words[n] = from->words[k];
+	memcpy(tp->pos[n], from->pos[k], sizeof(tp->pos[n]));
+	memcpy(tp->arc[n], from->arc[k], sizeof(tp->arc[n]));
+	tp->feed[n] = from->feed[k];
+	tp->value[n] = from->value[k];
+	tp->tag[n] = from->tag[k];
+	if(from->text[k] >= 0)
+		tp->text[n] = tp_pool_add(tp, from->pool+from->text[k], strlen(from->pool+from->text[k]));
+	return n;
+}
+
+// Extent of the XY positions, with each arc as its full circle. Returns 0 if there are none.
+int tp_bounds(const toolpath* tp, float* min, float* max)
+{
+	float pos[2] = {0.0, 0.0};
+	int found = 0;
+	min[0] = min[1] = 1e9;
+	max[0] = max[1] = -1e9;
+	for(int k = 0; k < tp->num; k++)
+	{
+		if((tp->words[k] & (W_X|W_Y)) != (W_X|W_Y))
+			continue;
+		float r = 0.0, c[2] = {tp->pos[k][0], tp->pos[k][1]};
+		if(tp->words[k] & W_IJ)
+		{
+			c[0] = pos[0] + tp->arc[k][0];
+			c[1] = pos[1] + tp->arc[k][1];
+			r = hypotf(tp->arc[k][0], tp->arc[k][1]);
+		}
+		for(int a = 0; a < 2; a++)
+		{
+			if(c[a]-r < min[a]) min[a] = c[a]-r;
+			if(c[a]+r > max[a]) max[a] = c[a]+r;
+			if(tp->pos[k][a] < min[a]) min[a] = tp->pos[k][a];
+			if(tp->pos[k][a] > max[a]) max[a] = tp->pos[k][a];
+		}
+		pos[0] = tp->pos[k][0];
+		pos[1] = tp->pos[k][1];
+		found = 1;
+	}
+	return found;
+}
+
+// Run time estimate in s, starting at x, y, z = 0: the feed moves at the modal F, arcs
+// along their helix, the rapids at rapid_rate (mm/min), and the dwells.
+float tp_time(const toolpath* tp, float rapid_rate)
+{
+	float pos[3] = {0.0, 0.0, 0.0};
+	float feed = 0.0;
+	double t = 0.0;
+	for(int k = 0; k < tp->num; k++)
+	{
+		int op = tp->op[k];
+		if(tp->words[k] & W_F)
+			feed = tp->feed[k];
+		if(op == OP_DWELL)
+			t += tp->value[k];
+		if(op != OP_RAPID && op != OP_LINE && op != OP_CW && op != OP_CCW)
+			continue;
+
+		float to[3] = {pos[0], pos[1], pos[2]};
+		if(tp->words[k] & W_X) to[0] = tp->pos[k][0];
+		if(tp->words[k] & W_Y) to[1] = tp->pos[k][1];
+		if(tp->words[k] & W_Z) to[2] = tp->pos[k][2];
+
+		float len;
+		if((op == OP_CW || op == OP_CCW) && (tp->words[k] & W_IJ))
+		{
+			float c[2] = {pos[0] + tp->arc[k][0], pos[1] + tp->arc[k][1]};
+			float a0 = atan2f(pos[1]-c[1], pos[0]-c[0]);
+			float a1 = atan2f(to[1]-c[1], to[0]-c[0]);
+			float sweep = (op == OP_CW)?(a0-a1):(a1-a0);
+			while(sweep <= 1e-4)
+				sweep += 2.0*3.14159265358979; // the same end point is a full circle
+			len = hypotf(sweep*hypotf(tp->arc[k][0], tp->arc[k][1]), to[2]-pos[2]);
+		}
+		else
+			len = sqrtf((to[0]-pos[0])*(to[0]-pos[0]) + (to[1]-pos[1])*(to[1]-pos[1]) + (to[2]-pos[2])*(to[2]-pos[2]));
+
+		float rate = (op == OP_RAPID)?rapid_rate:feed;
+		if(rate > 0.0)
+			t += len*60.0/rate;
+		memcpy(pos, to, sizeof(pos));
+	}
+	return t;
+}
+
+// Writer.
+// Formats a number like printf("%.<decimals>f"), including the rounding of halfway cases
+// to even and the sign of negative numbers that round to zero.
+char* tp_fixed(char* p, double v, int decimals)
+{
+	static const double scale[7] = {1.0, 10.0, 100.0, 1000.0, 1e4, 1e5, 1e6};
+	if(signbit(v))
+	{
+		*p++ = '-';
+		v = -v;
+	}
+	double s = v*scale[decimals];
+	double whole = floor(s);
+	double frac = s - whole;
+	unsigned long long n = (unsigned long long)whole;
+	if(frac > 0.5)
+		n++;
+	else if(frac == 0.5)
+	{
+		// The product may have been rounded to the halfway point: its error decides.
+		double err = fma(v, scale[decimals], -s);
+		if(err > 0.0 || (err == 0.0 && (n & 1)))
+			n++;
+	}
+
+	char digits[24];
+	int len = 0;
+	do
+	{
+		digits[len++] = '0' + n%10;
+		n /= 10;
+	}
+	while(n || len <= decimals);
+
+	while(len > decimals)
+		*p++ = digits[--len];
+	if(decimals)
+	{
+		*p++ = '.';
+		while(len > 0)
+			*p++ = digits[--len];
+	}
+	return p;
+}
+
+char* tp_word(char* p, char letter, double v, int decimals)
+{
+	*p++ = ' ';
+	*p++ = letter;
+	return tp_fixed(p, v, decimals);
+}
+
+#define TP_WRITE_BUF 65536
+
+// Writes the toolpath as G-code. OP_ON with a multiplier is written as M03 R<mult>;
+// the generators resolve those to S words before writing.
+void tp_write(FILE* f, const toolpath* tp)
+{
+	char* buf = malloc(TP_WRITE_BUF);
+	char* p = buf;
+	static const char* codes[8] = {"", "G00", "G01", "G02", "G03", "M03", "M05", "G04"};
+
+	for(int k = 0; k < tp->num; k++)
+	{
+		// Pool strings are shorter than 1024, see tp_vpool().
+		const char* comment = (tp->text[k] >= 0)?(tp->pool+tp->text[k]):NULL;
+		int len = comment?strlen(comment):0;
+		if(p-buf > TP_WRITE_BUF-2048)
+		{
+			fwrite(buf, 1, p-buf, f);
+			p = buf;
+		}
+
+		int op = tp->op[k];
+		int w = tp->words[k];
+		if(op == OP_TEXT)
+		{
+			memcpy(p, comment, len);
+			p += len;
+			*p++ = '\n';
+			continue;
+		}
+
+		memcpy(p, codes[op], 3);
+		p += 3;
+		int dec = (w & W_FINE)?6:2;
+		if(op == OP_ON)
+		{
+			if(w & W_ABS)
+				p += sprintf(p, " S%02d", (int)tp->value[k]);
+			else
+				p = tp_word(p, 'R', tp->value[k], 3);
+		}
+		else if(op == OP_DWELL)
+			p = tp_word(p, 'P', tp->value[k], 3);
+		if(w & W_X) p = tp_word(p, 'X', tp->pos[k][0], dec);
+		if(w & W_Y) p = tp_word(p, 'Y', tp->pos[k][1], dec);
+		if(w & W_IJ)
+		{
+			p = tp_word(p, 'I', tp->arc[k][0], dec);
+			p = tp_word(p, 'J', tp->arc[k][1], dec);
+		}
+		if(w & W_Z) p = tp_word(p, 'Z', tp->pos[k][2], 2);
+		if(w & W_F) p = tp_word(p, 'F', tp->feed[k], 2);
+		if(comment)
+		{
+			*p++ = ' ';
+			*p++ = '(';
+			memcpy(p, comment, len);
+			p += len;
+			*p++ = ')';
+		}
+		*p++ = '\n';
+	}
+	fwrite(buf, 1, p-buf, f);
+	free(buf);
+}
+
+#endif
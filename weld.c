@@ -7,11 +7,20 @@
 #include <stdio_ext.h>
 #include <stdlib.h>
 #include <fcntl.h>
-#include <stropts.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <errno.h>
 #include <math.h>
+#include <time.h>
+
+#include "layout.h"
 
 #define X 0
 #define Y 1
@@ -19,23 +28,7 @@
 #define ALIGN_X 15.5
 #define ALIGN_Y 6.0
 
-#define TESTMODE 0
-
-int kbhit()
-{
-	static const int STDIN = 0;
-/*	static bool initialized = false;
-
-	if(!initialized)
-	{
-		termios term;
-		tcgetattr(STDIN, &term)
-	}
-*/
-	int bytesWaiting;
-	ioctl(STDIN, FIONREAD, &bytesWaiting);
-	return bytesWaiting;
-}
+int verbose = 0; // echo commands and trace progress
 
 int set_interface_attribs(int fd, int speed)
 {
@@ -74,6 +67,62 @@ int set_interface_attribs(int fd, int speed)
 	return 0;
 }
 
+// Transports: where the command stream goes.
+//   serial:<device>  the controller on a serial port at 9600 baud
+//   pty:<device>     pseudo terminal slave, e.g. the one printed by weld_sim
+//   file:<path>      capture the command stream into a file
+//   none             discard the commands
+// A bare device name means serial.
+
+#define DEFAULT_TRANSPORT "serial:/dev/ttyS0"
+
+#define TRANSPORT_SERIAL 0
+#define TRANSPORT_PTY    1
+#define TRANSPORT_FILE   2
+#define TRANSPORT_NONE   3
+
+const char* transport_names[4] = {"serial", "pty", "file", "none"};
+
+// Returns the file descriptor, or -1 on error. The kind is returned in *kind.
+int transport_open(const char* spec, int* kind)
+{
+	const char* path = spec;
+	int fd;
+
+	*kind = TRANSPORT_SERIAL;
+	if(!strncmp(spec, "serial:", 7))
+		path = spec+7;
+	else if(!strncmp(spec, "pty:", 4))
+		{*kind = TRANSPORT_PTY; path = spec+4;}
+	else if(!strncmp(spec, "file:", 5))
+		{*kind = TRANSPORT_FILE; path = spec+5;}
+	else if(!strcmp(spec, "none"))
+		{*kind = TRANSPORT_NONE; path = "/dev/null";}
+
+	if(*kind == TRANSPORT_FILE || *kind == TRANSPORT_NONE)
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else
+		fd = open(path, O_RDWR | O_NOCTTY | O_SYNC);
+
+	if(fd < 0)
+	{
+		printf("error %d opening %s: %s\n", errno, path, strerror(errno));
+		return -1;
+	}
+
+	// A pty slave takes the same settings; the speed is simply ignored.
+	if(*kind == TRANSPORT_SERIAL || *kind == TRANSPORT_PTY)
+	{
+		if(set_interface_attribs(fd, B9600))
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
 int wr(int fd, const char* buf)
 {
 	int len = 0;
@@ -82,26 +131,119 @@ int wr(int fd, const char* buf)
 	write(fd, buf, len);
 }
 
-#define MAX_X_POINTS 100
-#define MAX_Y_POINTS 100
 #define MAX_WELDS_PER_POINT 5
 
-#define STATE_UNINITIALIZED 0
-#define STATE_INITIALIZED 1
+// Weld cells, one entry per WELDPOINT in the data file, kept as parallel arrays.
+// process_file() sorts them by index and drops duplicates.
+typedef struct
+{
+	int num;
+	int size;
+	int (*idx)[2];    // x and y index from the data file
+	float (*mid)[2];  // midpoint, mm
+	int* num_welds;
+	int* extra_power;
+} cellstore;
+
+// The dots to weld, produced by process_file() in raster order:
+// dot by dot over the whole pack.
+typedef struct
+{
+	int num;
+	int* cell;
+	int* dot;
+	float (*pos)[2];  // mm
+} dotlist;
+
+// The store and everything else that belongs to one pack being welded is thread
+// local: each station runs in its own thread (see Stations below).
+__thread cellstore cells;
+__thread dotlist dots;
+__thread int num_points[2] = {0, 0}; // extent of the index grid
 
 typedef struct
 {
-	int state;
-	float midpoint[2];
-	int num_welds;
-	int extra_power;
-	float weldpoints[MAX_WELDS_PER_POINT][2];
-} weldpoint;
+	int idx[2];
+	float pos[2];
+} alignpoint;
+
+__thread int num_alignpoints = 0;
+__thread int alignpoints_size = 0;
+__thread alignpoint* alignpoints = NULL;
+
+// Stores one WELDPOINT. Returns 0 on a fatal error.
+int add_weldpoint(int linenum, int idx_x, int idx_y, float point_x, float point_y)
+{
+	if(idx_x < 0 || idx_y < 0)
+	{
+		printf("Invalid weldpoint index on line %u: (%d;%d)\n",
+			linenum, idx_x, idx_y);
+		return 0;
+	}
+
+	if(point_x < 0.0 || point_x > 2000.0 || point_y < 0.0 || point_y > 2000.0)
+	{
+		printf("Invalid weldpoint coordinates on line %u: (%f ; %f)\n",
+			linenum, point_x, point_y);
+	}
+
+	if((idx_x+1) > num_points[X]) num_points[X] = (idx_x+1);
+	if((idx_y+1) > num_points[Y]) num_points[Y] = (idx_y+1);
+
+	if(cells.num == cells.size)
+	{
+		int new_size = cells.size?cells.size*2:256;
+		void* idx = realloc(cells.idx, new_size*sizeof(*cells.idx));
+		if(idx) cells.idx = idx;
+		void* mid = realloc(cells.mid, new_size*sizeof(*cells.mid));
+		if(mid) cells.mid = mid;
+		void* num_welds = realloc(cells.num_welds, new_size*sizeof(int));
+		if(num_welds) cells.num_welds = num_welds;
+		void* extra_power = realloc(cells.extra_power, new_size*sizeof(int));
+		if(extra_power) cells.extra_power = extra_power;
+		if(!idx || !mid || !num_welds || !extra_power)
+		{
+			printf("Out of memory\n");
+			return 0;
+		}
+		cells.size = new_size;
+	}
 
-int num_points[2] = {0, 0};
-weldpoint points[MAX_X_POINTS][MAX_Y_POINTS];
+	if(verbose) printf("Added point %u, %u\n", idx_x, idx_y);
+	int c = cells.num++;
+	cells.idx[c][X] = idx_x;
+	cells.idx[c][Y] = idx_y;
+	cells.mid[c][X] = point_x;
+	cells.mid[c][Y] = point_y;
+	cells.num_welds[c] = 0;
+	cells.extra_power[c] = 0;
+	return 1;
+}
+
+int add_alignpoint(int idx_x, int idx_y, float point_x, float point_y)
+{
+	if(num_alignpoints == alignpoints_size)
+	{
+		int new_size = alignpoints_size?alignpoints_size*2:8;
+		alignpoint* new_points = realloc(alignpoints, new_size*sizeof(alignpoint));
+		if(!new_points)
+		{
+			printf("Out of memory\n");
+			return 0;
+		}
+		alignpoints = new_points;
+		alignpoints_size = new_size;
+	}
+	alignpoint* a = &alignpoints[num_alignpoints++];
+	a->idx[X] = idx_x;
+	a->idx[Y] = idx_y;
+	a->pos[X] = point_x;
+	a->pos[Y] = point_y;
+	return 1;
+}
 
-int parse_file(FILE* datafile)
+// Line-by-line reference parser. Only used by the parser benchmark.
+int parse_file_stdio(FILE* datafile)
 {
 	int linenum = 0;
 	while(1)
@@ -117,60 +259,269 @@ int parse_file(FILE* datafile)
 		const char MARKER[] = "WELDPOINT";
 		char* pnt = strstr(line, MARKER);
 		if(!pnt)
-		{
 			continue;
+
+		pnt += strlen(MARKER);
+		int idx_x, idx_y;
+		float point_x, point_y;
+		int ret = sscanf(pnt, " %u ; %u ; %f ; %f", &idx_x, &idx_y, &point_x, &point_y);
+		if(ret != 4)
+		{
+			printf("Read error on line %u: %u fields out of 4 required was read.\n-->%s\n",
+				linenum, ret, pnt);
+			return 0;
 		}
+
+		if(!add_weldpoint(linenum, idx_x, idx_y, point_x, point_y))
+			return 0;
+	}
+}
+
+// Number parsing for the scanner. Each skips leading blanks, stops at end,
+// and returns 0 if no number was found.
+
+static int scan_int(const char** pp, const char* end, int* out)
+{
+	const char* p = *pp;
+	while(p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	int neg = 0;
+	if(p < end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+	if(p >= end || *p < '0' || *p > '9')
+		return 0;
+	int v = 0;
+	while(p < end && *p >= '0' && *p <= '9')
+		v = v*10 + (*p++ - '0');
+	*out = neg?-v:v;
+	*pp = p;
+	return 1;
+}
+
+static int scan_float(const char** pp, const char* end, float* out)
+{
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+	const char* p = *pp;
+	while(p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	int neg = 0;
+	if(p < end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+
+	long long mant = 0;
+	int digits = 0, frac = 0;
+	while(p < end && *p >= '0' && *p <= '9')
+		{if(digits < 18) mant = mant*10 + (*p - '0'); else frac--; p++; digits++;}
+	if(p < end && *p == '.')
+	{
+		p++;
+		while(p < end && *p >= '0' && *p <= '9')
+			{if(digits < 18) {mant = mant*10 + (*p - '0'); frac++;} p++; digits++;}
+	}
+	if(!digits)
+		return 0;
+
+	int exp10 = -frac;
+	if(p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* e = p+1;
+		int ev;
+		if(scan_int(&e, end, &ev))
+			{exp10 += ev; p = e;}
+	}
+
+	double v = (double)mant;
+	while(exp10 > 9) {v *= 1e9; exp10 -= 9;}
+	while(exp10 < -9) {v /= 1e9; exp10 += 9;}
+	v = (exp10 < 0)?(v/pow10[-exp10]):(v*pow10[exp10]);
+	*out = neg?-v:v;
+	*pp = p;
+	return 1;
+}
+
+static int scan_sep(const char** pp, const char* end)
+{
+	const char* p = *pp;
+	while(p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if(p >= end || *p != ';')
+		return 0;
+	*pp = p+1;
+	return 1;
+}
+
+// Reads "<idx_x>;<idx_y>;<x>;<y>". Returns the number of fields read.
+static int scan_point(const char** pp, const char* end, int* idx, float* pos)
+{
+	if(!scan_int(pp, end, &idx[X])) return 0;
+	if(!scan_sep(pp, end) || !scan_int(pp, end, &idx[Y])) return 1;
+	if(!scan_sep(pp, end) || !scan_float(pp, end, &pos[X])) return 2;
+	if(!scan_sep(pp, end) || !scan_float(pp, end, &pos[Y])) return 3;
+	return 4;
+}
+
+// Advances the line count from *from up to p. Only needed for messages, so the
+// scanner itself never looks at line ends.
+static int line_at(const char** from, const char* p, int line)
+{
+	const char* q = *from;
+	while((q = memchr(q, '\n', p-q)))
+		{line++; q++;}
+	*from = p;
+	return line;
+}
+
+// Stores the cells and alignpoints of a layout file made by cnc_gen or router_gen.
+int load_layout(const char* data, size_t len, const char* filename)
+{
+	packlayout l;
+	if(!layout_parse(&l, data, len, filename))
+		return 0;
+
+	int ok = 1;
+	for(int c = 0; c < l.num_cells && ok; c++)
+		ok = add_weldpoint(c+1, l.idx[c][X], l.idx[c][Y], l.mid[c][X], l.mid[c][Y]);
+	for(int k = 0; k < 4 && ok; k++)
+		ok = add_alignpoint(k == 1 || k == 2, k >= 2, l.align[k][X], l.align[k][Y]);
+	layout_free(&l);
+	return ok;
+}
+
+// Maps the data file and scans it for (WELDPOINT ...) and (ALIGNPOINT ...) comments:
+// memchr for the '(' and a compare of the marker, instead of a search on every line.
+// A layout file (<prefix>_layout.bin) is read as is.
+int parse_file(const char* filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("Couldn't open %s\n", filename);
+		return 0;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+	{
+		printf("Couldn't stat %s\n", filename);
+		close(fd);
+		return 0;
+	}
+
+	if(st.st_size == 0)
+	{
+		close(fd);
+		return 1;
+	}
+
+	const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		printf("Couldn't map %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	if(layout_is(data, st.st_size))
+	{
+		int ok = load_layout(data, st.st_size, filename);
+		munmap((void*)data, st.st_size);
+		return ok;
+	}
+
+	const char* end = data + st.st_size;
+	const char* p = data;
+	const char* counted = data;
+	int line = 1;
+	int ok = 1;
+
+	while((p = memchr(p, '(', end-p)))
+	{
+		p++;
+		int align;
+		if(end-p >= 9 && !memcmp(p, "WELDPOINT", 9))
+			{align = 0; p += 9;}
+		else if(end-p >= 10 && !memcmp(p, "ALIGNPOINT", 10))
+			{align = 1; p += 10;}
 		else
+			continue;
+
+		int idx[2];
+		float pos[2];
+		const char* fields = p;
+		int ret = scan_point(&p, end, idx, pos);
+		if(ret != 4)
 		{
-//			int extra_pwr = 0;
-//			if(*(pnt-1) == '+')
-//			{
-//				extra_pwr = 1;
-//			}
-
-			pnt += strlen(MARKER);
-			int idx_x, idx_y;
-			float point_x, point_y;
-			int ret = sscanf(pnt, " %u ; %u ; %f ; %f", &idx_x, &idx_y, &point_x, &point_y);
-			if(ret != 4)
-			{
-				printf("Read error on line %u: %u fields out of 4 required was read.\n-->%s\n",
-					linenum, ret, pnt);
-				return 0;
-			}
+			const char* eol = memchr(fields, '\n', end-fields);
+			printf("Read error on line %u: %u fields out of 4 required was read.\n-->%.*s\n",
+				line_at(&counted, fields, line), ret, (int)((eol?eol:end)-fields), fields);
+			ok = 0;
+			break;
+		}
 
-			if(idx_x < 0 || idx_x > MAX_X_POINTS-1 || idx_y < 0 || idx_y > MAX_Y_POINTS-1)
-			{
-				printf("Invalid weldpoint index on line %u: (%u;%u)\n",
-					linenum, idx_x, idx_y);
-				return 0;
-			}
+		if(align)
+			ok = add_alignpoint(idx[X], idx[Y], pos[X], pos[Y]);
+		else
+			ok = add_weldpoint(line = line_at(&counted, fields, line), idx[X], idx[Y], pos[X], pos[Y]);
+		if(!ok)
+			break;
+	}
 
-			if(point_x < 0.0 || point_x > 2000.0 || point_y < 0.0 || point_y > 2000.0)
-			{
-				printf("Invalid weldpoint coordinates on line %u: (%f ; %f)\n",
-					linenum, point_x, point_y);
-			}
+	munmap((void*)data, st.st_size);
+	return ok;
+}
 
-			if((idx_x+1) > num_points[X]) num_points[X] = (idx_x+1);
-			if((idx_y+1) > num_points[Y]) num_points[Y] = (idx_y+1);
+static int cmp_cell(const void* a, const void* b)
+{
+	int ca = *(const int*)a, cb = *(const int*)b;
+	if(cells.idx[ca][X] != cells.idx[cb][X]) return cells.idx[ca][X] - cells.idx[cb][X];
+	if(cells.idx[ca][Y] != cells.idx[cb][Y]) return cells.idx[ca][Y] - cells.idx[cb][Y];
+	return ca - cb; // file order among duplicates
+}
 
-			if(TESTMODE) printf("Added point %u, %u\n", idx_x, idx_y);
-			points[idx_x][idx_y].state = STATE_INITIALIZED;
-			points[idx_x][idx_y].midpoint[X] = point_x;
-			points[idx_x][idx_y].midpoint[Y] = point_y;
-			points[idx_x][idx_y].extra_power = 0;
+// Sorts the cells by (x, y) index. Of duplicate indices, the last one in the file wins.
+// The sorted arrays keep the capacity of the store, cells.size.
+static int sort_cells()
+{
+	int* order = malloc(cells.num*sizeof(int) + 1);
+	int (*idx)[2] = malloc(cells.size*sizeof(*idx) + 1);
+	float (*mid)[2] = malloc(cells.size*sizeof(*mid) + 1);
+	if(!order || !idx || !mid)
+	{
+		printf("Out of memory\n");
+		free(order);
+		free(idx);
+		free(mid);
+		return 0;
+	}
 
-//			if(extra_pwr)
-//			{
-//				points[idx_x][idx_y].extra_power = 1;
-//				if(TESTMODE)
-//					printf("(With extra power)\n");
-//			}
+	for(int c = 0; c < cells.num; c++)
+		order[c] = c;
+	qsort(order, cells.num, sizeof(int), cmp_cell);
 
+	int n = 0;
+	for(int k = 0; k < cells.num; k++)
+	{
+		int c = order[k];
+		if(k+1 < cells.num && cells.idx[order[k+1]][X] == cells.idx[c][X] && cells.idx[order[k+1]][Y] == cells.idx[c][Y])
+		{
+			printf("Warning: weldpoint %u;%u defined more than once, the last one is used\n", cells.idx[c][X], cells.idx[c][Y]);
+			continue;
 		}
-
+		idx[n][X] = cells.idx[c][X];
+		idx[n][Y] = cells.idx[c][Y];
+		mid[n][X] = cells.mid[c][X];
+		mid[n][Y] = cells.mid[c][Y];
+		n++;
 	}
+
+	free(cells.idx);
+	free(cells.mid);
+	free(order);
+	cells.idx = idx;
+	cells.mid = mid;
+	cells.num = n;
+	return 1;
 }
 
 int process_file(int* n_weld_points, float* point_distance, int parallel_rows, int* powers)
@@ -230,265 +581,1934 @@ int process_file(int* n_weld_points, float* point_distance, int parallel_rows, i
 
 	}
 
-	int size_select = 1; // swapped to 0 on the first round before anything happens.
-	for(int curx=0; curx<num_points[X]; curx++)
+	if(!sort_cells())
+		return 0;
+
+	// Weld sizes alternate every parallel_rows columns, starting with size 0.
+	int max_dots = 0;
+	for(int c = 0; c < cells.num; c++)
+	{
+		int size_select = (cells.idx[c][X] / parallel_rows) % 2;
+		cells.num_welds[c] = n_weld_points[size_select];
+		cells.extra_power[c] = powers[size_select];
+		if(cells.num_welds[c] > max_dots)
+			max_dots = cells.num_welds[c];
+		dots.num += cells.num_welds[c];
+	}
+
+	dots.cell = malloc(dots.num*sizeof(int) + 1);
+	dots.dot = malloc(dots.num*sizeof(int) + 1);
+	dots.pos = malloc(dots.num*sizeof(*dots.pos) + 1);
+	if(!dots.cell || !dots.dot || !dots.pos)
 	{
-		if((curx % parallel_rows) == 0)
-		{
-			size_select = size_select?0:1;
-		}
+		printf("Out of memory\n");
+		return 0;
+	}
 
-		for(int cury=0; cury<num_points[Y]; cury++)
+	int i = 0;
+	for(int dot = 0; dot < max_dots; dot++)
+	{
+		for(int c = 0; c < cells.num; c++)
 		{
-			points[curx][cury].num_welds = n_weld_points[size_select];
-			points[curx][cury].extra_power = powers[size_select];
-			for(int dot = 0; dot < n_weld_points[size_select]; dot++)
-			{
-				for(int coord = 0; coord < 2; coord++)
-					points[curx][cury].weldpoints[dot][coord] =
-						points[curx][cury].midpoint[coord] + point_offsets[size_select][dot][coord];
-			}
+			if(dot >= cells.num_welds[c])
+				continue;
+			int size_select = (cells.idx[c][X] / parallel_rows) % 2;
+			dots.cell[i] = c;
+			dots.dot[i] = dot;
+			for(int coord = 0; coord < 2; coord++)
+				dots.pos[i][coord] = cells.mid[c][coord] + point_offsets[size_select][dot][coord];
+			i++;
 		}
 	}
+	return 1;
 }
 
+// Durations of the per-dot phases, queued on the controller with WA.
+#define T_DROP    0.4
+#define T_SQUEEZE 0.3
+#define T_WELD    0.5
+#define T_HOLD    0.3
+#define T_PURGE   0.3
+#define DOT_SEQUENCE_TIME (T_DROP+T_SQUEEZE+T_WELD+T_HOLD+T_PURGE)
+
 #define GAS_VALVE 16
 #define Z_VALVE_DOWN 2
 #define Z_VALVE_UP_RELEASE 1
 #define WELDER_ON 4
 #define EXTRA_PWR_RELAY 8
 
-void automove_outp(int fd, int val)
+// Event loop.
+// Whenever the host waits, it runs an epoll loop over a timerfd for the wait itself,
+// stdin for operator commands, the transport for whatever the controller sends, and
+// a signalfd so that Ctrl-C becomes a safe abort instead of killing the process
+// with the welder down. Operator commands, one per line:
+//   p = pause after the current dot
+//   r = resume
+//   s = skip the remaining dots of the current cell
+//   a = abort: drop what has not been sent yet, all outputs off, stop
+//   g = the next pack is loaded (several stations, real runs)
+
+#define EV_TIMER     0
+#define EV_STDIN     1
+#define EV_TRANSPORT 2
+#define EV_SIGNAL    3
+
+__thread int loop_fd = -1;
+__thread int timer_fd = -1;
+__thread int signal_fd = -1;
+__thread int loop_transport = -1;
+
+// Operator requests, per station. The operator loop sets them, the stations poll them.
+int num_stations = 1;
+__thread int station_index = 0;
+volatile int* op_paused;
+volatile int* op_skip;
+volatile int* op_go;
+volatile int op_abort = 0;
+
+// The operator's stdin and the signals go to one loop only: the single station's,
+// or with several stations, the main thread's.
+void loop_init(int transport_fd, int operator)
 {
-	char buf[1000];
-	sprintf(buf, "CD %u;", val);
-	if(TESTMODE)
-		puts(buf);
-	if(TESTMODE != 1)
-		wr(fd, buf);
-}
+	loop_fd = epoll_create1(0);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if(loop_fd < 0 || timer_fd < 0)
+	{
+		printf("error %d setting up the event loop: %s. Operator commands are off\n", errno, strerror(errno));
+		loop_fd = -1;
+		return;
+	}
 
-void automove_init(int fd)
-{
-	wr(fd, ";IN;");
-}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = EV_TIMER;
+	epoll_ctl(loop_fd, EPOLL_CTL_ADD, timer_fd, &ev);
 
-void automove_find_home(int fd)
-{
-	wr(fd, "FH;");
-}
+	if(operator)
+	{
+		// Blocked before any station thread starts, so that they inherit the mask.
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+		signal_fd = signalfd(-1, &mask, 0);
+
+		ev.data.u32 = EV_SIGNAL;
+		if(signal_fd >= 0)
+			epoll_ctl(loop_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+		// Regular files can't be polled: with stdin or the transport redirected
+		// from or to a file, these just fail and are left out.
+		ev.data.u32 = EV_STDIN;
+		epoll_ctl(loop_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+	}
 
-void automove_wait(int fd, float seconds)
-{
-	char buf[1000];
-	sprintf(buf, "WA %.3f;", seconds);
-	if(TESTMODE)
-		puts(buf);
-	if(TESTMODE != 1)
-		wr(fd, buf);
+	ev.data.u32 = EV_TRANSPORT;
+	if(transport_fd >= 0 && epoll_ctl(loop_fd, EPOLL_CTL_ADD, transport_fd, &ev) == 0)
+		loop_transport = transport_fd;
 }
 
-//#define MM_TO_MILS 39.3700787
-//#define MM_TO_MILS 50
-
-void automove_goto(int fd, float x_mm, float y_mm)
+// A command applies to every station, or to the one numbered after it ("p 2").
+static void loop_command(const char* line)
 {
-	static float prev_x_mil = 0.0;
-	static float prev_y_mil = 0.0;
-
-	float x_mil = x_mm * 48.66; // MILLENNIUM-tekstin suuntainen suunta (leveys)
-	float y_mil = y_mm * 49.26; // syvyyssuunta kayttajasta poispain
-
-	int sleep_time = 400000 + 130*sqrtf(powf(fabs(prev_x_mil-x_mil),2) + powf(fabs(prev_y_mil-y_mil), 2));
+	while(*line == ' ' || *line == '\t')
+		line++;
 
-	prev_x_mil = x_mil;
-	prev_y_mil = y_mil;
+	int first = 0, last = num_stations-1;
+	int n = atoi(line+1);
+	if(n >= 1 && n <= num_stations)
+		first = last = n-1;
 
-
-	char buf[1000];
-	sprintf(buf, "MA %u,%u;", (int)x_mil, (int)y_mil);
-	if(TESTMODE)
+	for(int s = first; s <= last; s++)
 	{
-		puts(buf);
-		printf("\nSleeping %d us", sleep_time); fflush(stdout);
+		switch(*line)
+		{
+		case 'p': op_paused[s] = 1; break;
+		case 'r': op_paused[s] = 0; break;
+		case 's': op_skip[s] = 1; break;
+		case 'g': op_go[s] = 1; break;
+		}
 	}
-	else
-		wr(fd, buf);
 
+	const char* which = "";
+	char buf[32];
+	if(num_stations > 1)
+	{
+		snprintf(buf, sizeof(buf), "%s%u", (first == last)?" on station ":" on stations 1-", last+1);
+		which = buf;
+	}
 
-	usleep(sleep_time);
-
-	if(TESTMODE)
-		printf("... done\n");
+	switch(*line)
+	{
+	case 'p': printf("\nPausing after the current dot%s\n", which); break;
+	case 'r': printf("\nResuming%s\n", which); break;
+	case 's': printf("\nSkipping the rest of the current cell%s\n", which); break;
+	case 'g': printf("\nPack loaded%s\n", which); break;
+	case 'a': op_abort = 1; printf("\nAborting\n"); break;
+	case '\n': case 0: break;
+	default: printf("\nCommands: p = pause, r = resume, s = skip cell, a = abort%s\n",
+		(num_stations > 1)?", g = pack loaded; add a station number to address one station":""); break;
+	}
+}
 
+// Waits for one round of events and handles them. Returns 1 if the timer expired.
+static int loop_dispatch(int timeout_ms)
+{
+	struct epoll_event evs[4];
+	int n = epoll_wait(loop_fd, evs, 4, timeout_ms);
+	int expired = 0;
+	for(int e = 0; e < n; e++)
+	{
+		char buf[256];
+		int ret;
+		switch(evs[e].data.u32)
+		{
+		case EV_TIMER:
+		{
+			uint64_t ticks;
+			if(read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+				expired = 1;
+			break;
+		}
+		case EV_STDIN:
+			ret = read(STDIN_FILENO, buf, sizeof(buf)-1);
+			if(ret <= 0)
+			{
+				epoll_ctl(loop_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+				break;
+			}
+			buf[ret] = 0;
+			for(char* line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"))
+				loop_command(line);
+			break;
+		case EV_TRANSPORT:
+			ret = read(loop_transport, buf, sizeof(buf)-1);
+			if(ret <= 0)
+			{
+				epoll_ctl(loop_fd, EPOLL_CTL_DEL, loop_transport, NULL);
+				break;
+			}
+			buf[ret] = 0;
+			if(verbose)
+				printf("controller: %s\n", buf);
+			break;
+		case EV_SIGNAL:
+		{
+			struct signalfd_siginfo si;
+			if(read(signal_fd, &si, sizeof(si)) == sizeof(si))
+			{
+				op_abort = 1;
+				printf("\nSignal %u, aborting\n", si.ssi_signo);
+			}
+			break;
+		}
+		}
+	}
+	return expired;
 }
 
-int main(int argc, char** argv)
+// Waits for the given time while handling events. Returns early on abort.
+// A zero wait only picks up pending events.
+void loop_wait(double seconds)
 {
-	if(argc < 4)
+	if(loop_fd < 0)
 	{
-		printf("Usage: weld <weld_data_file> <parallel_rows> <+|- (start)>[s]\n");
-		printf("Data file as generated from cnc_gen: use (ALIGNPOINT <idx_x>;<idx_y>;<x>;<y>)\n");
-		printf("     and (WELDPOINT <idx_x>;<idx_y>;<x>;<y>)\n");
-		printf("num_weld_points can currently be 1...5\n");
-		printf("+|- defines whether welding starts from + (smaller weld) or - (larger weld)\n");
-		printf("s = simulate (no gas, no weld) S = simulate with midpoints\n");
-		return 1;
+		if(seconds > 0.0)
+			usleep(seconds*1000000.0);
+		return;
 	}
 
-	int n_weld_points[2]    = {3, 5};
-	int powers[2]           = {1, 0};
-	float point_distance[2] = {3.0, 4.0};
+	if(seconds <= 0.0)
+	{
+		loop_dispatch(0);
+		return;
+	}
 
-	int parallel_rows = 0;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = (time_t)seconds;
+	its.it_value.tv_nsec = (long)((seconds - its.it_value.tv_sec)*1000000000.0);
+	if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	timerfd_settime(timer_fd, 0, &its, NULL);
 
-	int automove;
+	while(!op_abort && !loop_dispatch(-1))
+		;
 
-	int simu = 0;
-	int midsimu = 0;
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(timer_fd, 0, &its, NULL);
+}
 
-	const char handle[] = "/dev/ttyS0";
+// Time keeping.
+// Every delay goes through the clock: host_sleep() for the host pacing itself,
+// clock_account() for time the machine spends in a phase. With virtual_clock
+// set, the host sleeps are skipped and only counted, so a simulated run
+// finishes at once and still projects the real cycle time.
+
+#define PH_SETUP    0
+#define PH_TRAVEL   1
+#define PH_COOLDOWN 2
+#define PH_DROP     3
+#define PH_SQUEEZE  4
+#define PH_WELD     5
+#define PH_HOLD     6
+#define PH_PURGE    7
+#define NUM_PHASES  8
+
+const char* phase_names[NUM_PHASES] = {"setup", "travel", "cooldown", "drop", "squeeze", "weld", "hold", "purge"};
+
+__thread int virtual_clock = 0;
+__thread double host_time = 0.0;        // s the host has slept, real or virtual
+__thread double phase_time[NUM_PHASES]; // s of machine time per phase
+__thread int phase_count[NUM_PHASES];
+
+void host_sleep(double seconds)
+{
+	if(seconds <= 0.0)
+		return;
+	host_time += seconds;
+	loop_wait(virtual_clock?0.0:seconds);
+}
 
-	if(!TESTMODE)
-	{
-		automove = open(handle, O_RDWR | O_NOCTTY | O_SYNC);
-		if(automove < 0)
-		{
-			printf("error %d opening %s: %s\n", errno, handle, strerror(errno));
-			return 1;
-		}
+// Now on the clock host_sleep() keeps: real or virtual.
+double clock_now()
+{
+	if(virtual_clock)
+		return host_time;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
 
-		set_interface_attribs(automove, B9600);
-	}
+void clock_account(int phase, double seconds)
+{
+	phase_time[phase] += seconds;
+	phase_count[phase]++;
+}
 
-	FILE* datafile = fopen(argv[1], "rb");
-	if(!datafile)
-	{
-		printf("Couldn't open %s\n", argv[1]);
-		return 1;
-	}
+void print_hms(double seconds)
+{
+	int s = seconds + 0.5;
+	printf("%u:%02u:%02u", s/3600, (s/60)%60, s%60);
+}
 
-	parallel_rows = atoi(argv[2]);
-	if(parallel_rows < 1 || parallel_rows > 20)
-		{printf("invalid parallel_rows\n"); return 1;}
+void clock_reset()
+{
+	host_time = 0.0;
+	memset(phase_time, 0, sizeof(phase_time));
+	memset(phase_count, 0, sizeof(phase_count));
+}
 
-	if(argv[3][0] != '+' && argv[3][0] != '-')
-		{printf("must define start argument (+ or -)\n"); return 1;}
+double clock_machine()
+{
+	double machine = 0.0;
+	for(int p = 0; p < NUM_PHASES; p++)
+		machine += phase_time[p];
+	return machine;
+}
 
-	if(argv[3][0] == '-')
-	{
-		int tmp = n_weld_points[0];
-		n_weld_points[0] = n_weld_points[1];
-		n_weld_points[1] = tmp;
+// The run takes as long as the slower of the host pacing and the machine itself.
+double clock_wall()
+{
+	double machine = clock_machine();
+	return (host_time > machine)?host_time:machine;
+}
 
-		tmp = powers[0];
-		powers[0] = powers[1];
-		powers[1] = tmp;
+void clock_report()
+{
+	double machine = clock_machine();
+	double wall = clock_wall();
+
+	flockfile(stdout); // one report at a time when several stations finish together
+	printf("Projected wall time ");
+	print_hms(wall);
+	printf(" (%.1f s; host paced %.1f s, machine %.1f s)\n", wall, host_time, machine);
+	printf("  %-10s %6s %10s\n", "phase", "count", "time");
+	for(int p = 0; p < NUM_PHASES; p++)
+		printf("  %-10s %6u %8.1f s\n", phase_names[p], phase_count[p], phase_time[p]);
+	printf("Travel %.1f s, weld on %.1f s, idle %.1f s\n", phase_time[PH_TRAVEL], phase_time[PH_WELD],
+		wall - phase_time[PH_TRAVEL] - phase_time[PH_WELD]);
+	funlockfile(stdout);
+}
 
-		float tmpf = point_distance[0];
-		point_distance[0] = point_distance[1];
-		point_distance[1] = tmpf;
-	}
+// Streaming mode: instead of writing each command and pacing the host with
+// sleeps, the commands of a dot are collected and written out in one go. The
+// controller runs its queue in order and does the timing with WA; XON/XOFF
+// flow control (see set_interface_attribs) holds the host back when the
+// controller's input buffer is full.
 
+// The controller has no command to drop its queue, so an abort only takes effect
+// after whatever it has already taken. A dot is therefore held back until the one
+// before it is about done, which keeps at most one dot queued ahead of the machine.
 
-	if(argv[3][1] == 's' || argv[3][1] == 'S')
-		{printf("Simulation mode\n"); simu = 1;}
+// The controller does not confirm what it has done either, so a streamed dot counts
+// as done for the journal only once the controller has taken it and the machine time
+// accounted for it and everything queued before it has passed, with a margin.
 
-	if(argv[3][1] == 'S')
-		midsimu = 1;
+#define STREAM_LEAD 0.5          // s before the previous dot is done
+#define STREAM_RECORD_MARGIN 1.0 // s
 
+__thread int streaming = 0;
+__thread char* stream_buf = NULL;
+__thread int stream_len = 0;
+__thread int stream_size = 0;
 
-	if(!parse_file(datafile))
-	{
-		printf("Fatal error parsing datafile. Stop.\n");
-		return 0;
-	}
+void automove_send(int fd, const char* cmd)
+{
+	if(verbose)
+		puts(cmd);
 
-	if(!process_file(n_weld_points, point_distance, parallel_rows, powers))
+	if(streaming)
+	{
+		int len = strlen(cmd);
+		if(stream_len + len + 1 > stream_size)
+		{
+			int new_size = (stream_size?stream_size*2:4096) + len;
+			char* new_buf = realloc(stream_buf, new_size);
+			if(!new_buf)
+			{
+				printf("Out of memory in stream buffer\n");
+				exit(1);
+			}
+			stream_buf = new_buf;
+			stream_size = new_size;
+		}
+		memcpy(stream_buf+stream_len, cmd, len+1);
+		stream_len += len;
+		return;
+	}
+
+	wr(fd, cmd);
+}
+
+// Writes out the collected commands and waits until it has been transmitted.
+// Returns 0 on a write error.
+int automove_flush(int fd)
+{
+	int ok = 1;
+	int done = 0;
+	while(done < stream_len)
+	{
+		int ret = write(fd, stream_buf+done, stream_len-done);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			printf("error %d writing command block: %s\n", errno, strerror(errno));
+			ok = 0;
+			break;
+		}
+		done += ret;
+	}
+	// Instead of blocking in tcdrain() while the controller holds us back with
+	// XOFF, keep handling events until the output queue is empty.
+	int queued;
+	while(ok && isatty(fd) && !op_abort && ioctl(fd, TIOCOUTQ, &queued) == 0 && queued > 0)
+		loop_wait(0.05);
+	stream_len = 0;
+	return ok;
+}
+
+void automove_outp(int fd, int val)
+{
+	char buf[1000];
+	sprintf(buf, "CD %u;", val);
+	automove_send(fd, buf);
+}
+
+// Brings the machine to a safe state: whatever has not been sent yet is dropped,
+// and all outputs go off, which lifts the welder and closes the gas. When streaming,
+// the controller first runs out the dot it has queued.
+void automove_abort(int fd)
+{
+	streaming = 0;
+	stream_len = 0;
+	if(isatty(fd))
+		tcflush(fd, TCOFLUSH);
+	automove_outp(fd, 0);
+}
+
+void automove_init(int fd)
+{
+	automove_send(fd, ";IN;");
+}
+
+__thread float automove_pos_mil[2]; // last commanded position
+
+void automove_find_home(int fd)
+{
+	automove_send(fd, "FH;");
+	automove_pos_mil[X] = automove_pos_mil[Y] = 0.0;
+}
+
+void automove_wait(int fd, float seconds, int phase)
+{
+	char buf[1000];
+	sprintf(buf, "WA %.3f;", seconds);
+	automove_send(fd, buf);
+	clock_account(phase, seconds);
+}
+
+//#define MM_TO_MILS 39.3700787
+//#define MM_TO_MILS 50
+
+#define MM_TO_MIL_X 48.66 // MILLENNIUM-tekstin suuntainen suunta (leveys)
+#define MM_TO_MIL_Y 49.26 // syvyyssuunta kayttajasta poispain
+
+// Travel time estimate used to pace the host: fixed settle time plus 130 us per mil.
+int travel_time_us(float x0_mil, float y0_mil, float x1_mil, float y1_mil)
+{
+	return 400000 + 130*sqrtf(powf(fabs(x0_mil-x1_mil),2) + powf(fabs(y0_mil-y1_mil), 2));
+}
+
+void automove_goto(int fd, float x_mm, float y_mm)
+{
+	float x_mil = x_mm * MM_TO_MIL_X;
+	float y_mil = y_mm * MM_TO_MIL_Y;
+
+	int sleep_time = travel_time_us(automove_pos_mil[X], automove_pos_mil[Y], x_mil, y_mil);
+
+	automove_pos_mil[X] = x_mil;
+	automove_pos_mil[Y] = y_mil;
+
+
+	char buf[1000];
+	sprintf(buf, "MA %u,%u;", (int)x_mil, (int)y_mil);
+	automove_send(fd, buf);
+	clock_account(PH_TRAVEL, sleep_time/1000000.0);
+
+	if(streaming)
+		return;
+
+	if(verbose)
+		{printf("Sleeping %d us", sleep_time); fflush(stdout);}
+
+	host_sleep(sleep_time/1000000.0);
+
+	if(verbose)
+		printf("... done\n");
+
+}
+
+// Queues the phases of one dot at the current position. The host has to wait
+// DOT_SEQUENCE_TIME (or the controller queue has to run it) before the next move.
+void automove_weld_dot(int fd, int extra_power, int simu)
+{
+	int cmd;
+
+	cmd = Z_VALVE_UP_RELEASE;
+	if(!simu) cmd |= GAS_VALVE;
+	automove_outp(fd, cmd); // let it drop with gravity, put gas on.
+	automove_wait(fd, T_DROP, PH_DROP);
+
+	cmd = Z_VALVE_UP_RELEASE | Z_VALVE_DOWN; // apply force, keep gas on.
+	if(!simu) cmd |= GAS_VALVE;
+	if(extra_power) cmd |= EXTRA_PWR_RELAY;
+	automove_outp(fd, cmd);
+	automove_wait(fd, T_SQUEEZE, PH_SQUEEZE);
+
+	cmd = Z_VALVE_UP_RELEASE | Z_VALVE_DOWN; // Weld while applying force
+	if(!simu) cmd |= GAS_VALVE | WELDER_ON;
+	if(extra_power) cmd |= EXTRA_PWR_RELAY;
+	automove_outp(fd, cmd);
+	automove_wait(fd, T_WELD, PH_WELD); // weld stops once energy level is reached, but this is a safety timeout.
+
+	cmd = Z_VALVE_UP_RELEASE | Z_VALVE_DOWN;
+	if(!simu) cmd |= GAS_VALVE;
+	automove_outp(fd, cmd); // keep pressure and gas
+	automove_wait(fd, T_HOLD, PH_HOLD);
+
+	cmd = 0;
+	if(!simu) cmd |= GAS_VALVE;
+	automove_outp(fd, cmd); // keep gas for a little bit to purge smoke and cool the electrode
+	automove_wait(fd, T_PURGE, PH_PURGE);
+
+	automove_outp(fd, 0);  // all off, welder up.
+}
+
+// Weld tour planning.
+// Every (cell, dot) pair is one job. The jobs are ordered for minimum automove
+// travel time: nearest neighbour construction first, then 2-opt and Or-opt
+// improvement. Two dots of the same cell are kept at least min_cell_gap jobs
+// apart, so that the same cell is never welded twice back-to-back.
+
+typedef struct
+{
+	int cell;      // index in cells
+	int dot;
+	float pos[2];  // target in mm, alignment offset included
+	float cooldown; // s, extra wait on arrival before the dot is welded
+} weldjob;
+
+#define TOUR_NEIGHBOURS 10
+#define TOUR_MAX_PASSES 100
+#define OR_OPT_MAX_LEN 3
+
+// Not calibrated against measured cell temperatures yet, so kept well apart: with the
+// fixed sleep this is over 24 s between two dots of a cell. The raster order had a
+// whole pass over the pack in between.
+int min_cell_gap = 8; // number of other dots required between two dots of the same cell
+
+float job_time(const weldjob* a, const weldjob* b)
+{
+	float ax = a?a->pos[X]:0.0, ay = a?a->pos[Y]:0.0; // NULL = home position after FH
+	return travel_time_us(ax*MM_TO_MIL_X, ay*MM_TO_MIL_Y, b->pos[X]*MM_TO_MIL_X, b->pos[Y]*MM_TO_MIL_Y)/1000000.0;
+}
+
+// Travel time of the whole tour in seconds, starting from home.
+double tour_time(const weldjob* jobs, const int* order, int n)
+{
+	double t = 0.0;
+	for(int i = 0; i < n; i++)
+		t += job_time(i?&jobs[order[i-1]]:NULL, &jobs[order[i]]);
+	return t;
+}
+
+// Checks that no two dots of one cell are closer than min_cell_gap in tour positions lo..hi.
+int tour_spacing_ok(const weldjob* jobs, const int* order, int n, int lo, int hi)
+{
+	if(lo < 0) lo = 0;
+	if(hi > n-1) hi = n-1;
+	for(int k = lo; k <= hi; k++)
+	{
+		for(int m = k+1; m <= k+min_cell_gap && m < n; m++)
+		{
+			if(jobs[order[k]].cell == jobs[order[m]].cell)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// Cost of the edge entering tour position i (position -1 is home).
+#define EDGE(i) (((i) < 0 || (i) >= n)?0.0:job_time((i)?&jobs[order[(i)-1]]:NULL, &jobs[order[(i)]]))
+#define LINK(a, b) (((b) < 0 || (b) >= n)?0.0:job_time(((a) < 0)?NULL:&jobs[order[(a)]], &jobs[order[(b)]]))
+
+static void tour_reverse(int* order, int* pos_of, int i, int j)
+{
+	for(int a = i, b = j; a < b; a++, b--)
+	{
+		int tmp = order[a]; order[a] = order[b]; order[b] = tmp;
+		pos_of[order[a]] = a; pos_of[order[b]] = b;
+	}
+}
+
+// 2-opt over the neighbour lists: the edge leaving position a is replaced by an
+// edge to one of the nearest jobs, reversing the tour between them.
+static int tour_2opt(const weldjob* jobs, int* order, int n, const int* neighbours, int* pos_of)
+{
+	int improved = 0;
+	for(int a = -1; a < n-1; a++)
+	{
+		for(int nb = 0; nb < TOUR_NEIGHBOURS; nb++)
+		{
+			int cand = (a < 0)?-1:neighbours[order[a]*TOUR_NEIGHBOURS+nb];
+			int j;
+			if(a < 0)
+			{
+				// From home, try every job as the new first one.
+				if(nb > 0) break;
+				for(j = 1; j < n; j++)
+				{
+					if(LINK(-1, j) + ((j+1 < n)?job_time(&jobs[order[0]], &jobs[order[j+1]]):0.0)
+						< EDGE(0) + EDGE(j+1) - 1e-6)
+						break;
+				}
+				if(j == n)
+					break;
+			}
+			else
+			{
+				if(cand < 0)
+					break;
+				j = pos_of[cand];
+				if(j <= a+1)
+					continue;
+			}
+
+			// Reverse order[a+1..j]: edges (a,a+1) and (j,j+1) become (a,j) and (a+1,j+1).
+			int i = a+1;
+			double before = EDGE(i) + EDGE(j+1);
+			double after = LINK(a, j) + ((j+1 < n)?job_time(&jobs[order[i]], &jobs[order[j+1]]):0.0);
+			if(after > before - 1e-6)
+				continue;
+
+			tour_reverse(order, pos_of, i, j);
+
+			if(!tour_spacing_ok(jobs, order, n, i-min_cell_gap, i+min_cell_gap) ||
+			   !tour_spacing_ok(jobs, order, n, j-min_cell_gap, j+min_cell_gap))
+			{
+				tour_reverse(order, pos_of, i, j);
+				continue;
+			}
+			improved = 1;
+		}
+	}
+	return improved;
+}
+
+// Moves order[i..i+len-1] so that it follows what is now at position p.
+static void tour_move_segment(int* order, int n, int i, int len, int p, int* tmp)
+{
+	int k = 0;
+	for(int m = 0; m < n; m++)
+	{
+		if(m >= i && m < i+len)
+			continue;
+		tmp[k++] = order[m];
+		if(m == p)
+			for(int s = 0; s < len; s++)
+				tmp[k++] = order[i+s];
+	}
+	memcpy(order, tmp, n*sizeof(int));
+}
+
+static int tour_or_opt(const weldjob* jobs, int* order, int n, const int* neighbours, int* pos_of, int* tmp, int* backup)
+{
+	int improved = 0;
+	for(int len = 1; len <= OR_OPT_MAX_LEN; len++)
+	{
+		for(int i = 0; i+len <= n; i++)
+		{
+			int last = i+len-1;
+			double removed = EDGE(i) + EDGE(last+1) - LINK(i-1, last+1);
+
+			for(int nb = 0; nb < TOUR_NEIGHBOURS; nb++)
+			{
+				int cand = neighbours[order[i]*TOUR_NEIGHBOURS+nb];
+				if(cand < 0)
+					break;
+				int p = pos_of[cand]; // insert right after cand
+				if(p >= i-1 && p <= last)
+					continue;
+
+				double inserted = LINK(p, i) + ((p+1 < n)?job_time(&jobs[order[last]], &jobs[order[p+1]]):0.0)
+					- ((p+1 < n)?LINK(p, p+1):0.0);
+
+				if(inserted - removed > -1e-6)
+					continue;
+
+				memcpy(backup, order, n*sizeof(int));
+				tour_move_segment(order, n, i, len, p, tmp);
+				int lo = (i < p)?i:p;
+				int hi = (i < p)?p:last;
+				if(!tour_spacing_ok(jobs, order, n, lo-min_cell_gap-len, hi+min_cell_gap+len))
+				{
+					memcpy(order, backup, n*sizeof(int));
+					continue;
+				}
+
+				for(int m = 0; m < n; m++)
+					pos_of[order[m]] = m;
+				improved = 1;
+				break;
+			}
+		}
+	}
+	return improved;
+}
+
+#undef EDGE
+#undef LINK
+
+// Orders the jobs in place for least travel. Returns the number of spacing violations
+// that could not be avoided (only possible when a cell has more dots than there are cells).
+int plan_tour(weldjob* jobs, int n)
+{
+	if(n < 2)
+		return 0;
+
+	int* order = malloc(n*sizeof(int));
+	int* used = calloc(n, sizeof(int));
+	int* neighbours = malloc(n*TOUR_NEIGHBOURS*sizeof(int));
+	int* pos_of = malloc(n*sizeof(int));
+	int* tmp = malloc(n*sizeof(int));
+	int* backup = malloc(n*sizeof(int));
+	int max_cell = 0;
+	for(int i = 0; i < n; i++)
+		if(jobs[i].cell > max_cell) max_cell = jobs[i].cell;
+	int* last_at = malloc((max_cell+1)*sizeof(int));
+	if(!order || !used || !neighbours || !pos_of || !tmp || !backup || !last_at)
+	{
+		printf("Out of memory in tour planner\n");
+		exit(1);
+	}
+	for(int c = 0; c <= max_cell; c++)
+		last_at[c] = -n;
+
+	// Nearest neighbour construction, honouring the cell spacing when possible.
+	int violations = 0;
+	const weldjob* cur = NULL;
+	for(int k = 0; k < n; k++)
+	{
+		int best = -1, best_any = -1;
+		float best_t = 0.0, best_any_t = 0.0;
+		for(int i = 0; i < n; i++)
+		{
+			if(used[i])
+				continue;
+			float t = job_time(cur, &jobs[i]);
+			if(best_any < 0 || t < best_any_t)
+				{best_any = i; best_any_t = t;}
+			if(k - last_at[jobs[i].cell] > min_cell_gap && (best < 0 || t < best_t))
+				{best = i; best_t = t;}
+		}
+		if(best < 0)
+			{best = best_any; violations++;}
+
+		used[best] = 1;
+		order[k] = best;
+		last_at[jobs[best].cell] = k;
+		cur = &jobs[best];
+	}
+
+	// Neighbour lists for Or-opt.
+	for(int i = 0; i < n; i++)
+	{
+		int* nbl = &neighbours[i*TOUR_NEIGHBOURS];
+		float nbt[TOUR_NEIGHBOURS];
+		int cnt = 0;
+		for(int j = 0; j < n; j++)
+		{
+			if(j == i)
+				continue;
+			float t = job_time(&jobs[i], &jobs[j]);
+			if(cnt == TOUR_NEIGHBOURS && t >= nbt[cnt-1])
+				continue;
+			int s = (cnt < TOUR_NEIGHBOURS)?cnt++:cnt-1;
+			while(s > 0 && nbt[s-1] > t)
+				{nbt[s] = nbt[s-1]; nbl[s] = nbl[s-1]; s--;}
+			nbt[s] = t; nbl[s] = j;
+		}
+		for(int s = cnt; s < TOUR_NEIGHBOURS; s++)
+			nbl[s] = -1;
+	}
+
+	for(int m = 0; m < n; m++)
+		pos_of[order[m]] = m;
+
+	for(int pass = 0; pass < TOUR_MAX_PASSES; pass++)
+	{
+		int improved = tour_2opt(jobs, order, n, neighbours, pos_of);
+		improved |= tour_or_opt(jobs, order, n, neighbours, pos_of, tmp, backup);
+		if(!improved)
+			break;
+	}
+
+	weldjob* sorted = malloc(n*sizeof(weldjob));
+	if(!sorted)
+	{
+		printf("Out of memory in tour planner\n");
+		exit(1);
+	}
+	for(int i = 0; i < n; i++)
+		sorted[i] = jobs[order[i]];
+	memcpy(jobs, sorted, n*sizeof(weldjob));
+
+	free(sorted); free(order); free(used); free(neighbours); free(pos_of); free(tmp); free(backup); free(last_at);
+	return violations;
+}
+
+// Thermal weld scheduling.
+// Each dot adds heat to its cell, and the heat decays exponentially with cell_tau.
+// Cells within neighbour_radius see a share of it, falling off linearly with distance.
+// A dot may start once the heat seen at its cell is below heat_limit. The required
+// cooldown is charged only when needed, and the scheduler first tries to fill it by
+// welding a cooler job from the next thermal_window jobs of the tour.
+// The constants below are estimates, not measurements, so the schedule is only used
+// when asked for (t); by default every dot still gets the fixed sleep.
+
+float heat_per_dot = 1.0;        // relative heat of one dot
+float heat_per_dot_extra = 1.4;  // ... with the extra power relay
+float cell_tau = 4.0;            // s, heat decay time constant
+float neighbour_radius = 25.0;   // mm
+float neighbour_coupling = 0.25; // share of the heat seen by an adjacent cell
+float heat_limit = 0.5;          // a dot starts only below this heat level
+int thermal_window = 12;         // how many jobs ahead of the tour the scheduler may pick from
+float fixed_cooldown = 3.0;      // s, the old fixed sleep after each dot
+
+typedef struct
+{
+	int num;
+	int* cell;
+	float* weight;
+} neighbourhood;
+
+// Heat seen at cell c at time t.
+static float cell_heat(const neighbourhood* nbh, const float* heat, const float* heat_t, int c, float t)
+{
+	float h = 0.0;
+	for(int k = 0; k < nbh[c].num; k++)
+	{
+		int o = nbh[c].cell[k];
+		if(heat[o] > 0.0)
+			h += nbh[c].weight[k] * heat[o] * expf(-(t-heat_t[o])/cell_tau);
+	}
+	return h;
+}
+
+// Reorders jobs within the thermal window and fills in their cooldowns.
+// cell_mid[c] is the midpoint of cell c, cell_extra[c] tells if it uses the extra power relay.
+// Returns the total cooldown time in seconds.
+double schedule_thermal(weldjob* jobs, int n, const float (*cell_mid)[2], const int* cell_extra, int num_cells)
+{
+	neighbourhood* nbh = calloc(num_cells, sizeof(neighbourhood));
+	float* heat = calloc(num_cells, sizeof(float));
+	float* heat_t = calloc(num_cells, sizeof(float));
+	int* last_at = malloc(num_cells*sizeof(int));
+	int* present = calloc(num_cells, sizeof(int));
+	int* done = calloc(n, sizeof(int));
+	weldjob* out = malloc(n*sizeof(weldjob) + 1);
+	if(!nbh || !heat || !heat_t || !last_at || !present || !done || !out)
+	{
+		printf("Out of memory in thermal scheduler\n");
+		exit(1);
+	}
+
+	for(int i = 0; i < n; i++)
+		present[jobs[i].cell] = 1;
+
+	for(int c = 0; c < num_cells; c++)
+	{
+		last_at[c] = -n;
+		if(!present[c])
+			continue;
+
+		int cnt = 0;
+		for(int o = 0; o < num_cells; o++)
+		{
+			if(!present[o])
+				continue;
+			float d = hypotf(cell_mid[c][X]-cell_mid[o][X], cell_mid[c][Y]-cell_mid[o][Y]);
+			if(o == c || d < neighbour_radius)
+				cnt++;
+		}
+		nbh[c].cell = malloc(cnt*sizeof(int));
+		nbh[c].weight = malloc(cnt*sizeof(float));
+		if(!nbh[c].cell || !nbh[c].weight)
+		{
+			printf("Out of memory in thermal scheduler\n");
+			exit(1);
+		}
+		for(int o = 0; o < num_cells; o++)
+		{
+			if(!present[o])
+				continue;
+			float d = hypotf(cell_mid[c][X]-cell_mid[o][X], cell_mid[c][Y]-cell_mid[o][Y]);
+			if(o == c)
+				{nbh[c].cell[nbh[c].num] = o; nbh[c].weight[nbh[c].num++] = 1.0;}
+			else if(d < neighbour_radius)
+				{nbh[c].cell[nbh[c].num] = o; nbh[c].weight[nbh[c].num++] = neighbour_coupling*(1.0 - d/neighbour_radius);}
+		}
+	}
+
+	double total_cooldown = 0.0;
+	float t = 0.0;
+	const weldjob* cur = NULL;
+	int first = 0; // first unscheduled job of the tour
+
+	for(int k = 0; k < n; k++)
+	{
+		while(done[first])
+			first++;
+
+		int best = -1, best_spaced = 0;
+		float best_start = 0.0, best_wait = 0.0;
+		for(int i = first, seen = 0; i < n && seen < thermal_window; i++)
+		{
+			if(done[i])
+				continue;
+			seen++;
+
+			int spaced = (k - last_at[jobs[i].cell]) > min_cell_gap;
+			float arrive = t + job_time(cur, &jobs[i]);
+			float h = cell_heat(nbh, heat, heat_t, jobs[i].cell, arrive);
+			float wait = (h > heat_limit)?(cell_tau*logf(h/heat_limit)):0.0;
+
+			if(best < 0 || (spaced && !best_spaced) || (spaced == best_spaced && arrive+wait < best_start))
+				{best = i; best_spaced = spaced; best_start = arrive+wait; best_wait = wait;}
+		}
+
+		int c = jobs[best].cell;
+		// Fold the remaining heat into the new deposit, so that one timestamp per cell is enough.
+		heat[c] = heat[c]*expf(-(best_start-heat_t[c])/cell_tau)
+			+ (cell_extra[c]?heat_per_dot_extra:heat_per_dot);
+		heat_t[c] = best_start;
+		last_at[c] = k;
+
+		done[best] = 1;
+		out[k] = jobs[best];
+		out[k].cooldown = best_wait;
+		total_cooldown += best_wait;
+
+		t = best_start + DOT_SEQUENCE_TIME;
+		cur = &jobs[best];
+	}
+
+	memcpy(jobs, out, n*sizeof(weldjob));
+
+	for(int c = 0; c < num_cells; c++)
+		{free(nbh[c].cell); free(nbh[c].weight);}
+	free(nbh); free(heat); free(heat_t); free(last_at); free(present); free(done); free(out);
+	return total_cooldown;
+}
+
+// Checkpoint journal.
+// Every completed dot is appended to the journal as "<idx_x>;<idx_y>;<dot>" and
+// fsync'd before the next one starts. The first line identifies the job. A run that
+// finishes removes its journal, so a journal left behind means an interrupted run,
+// which can be resumed without welding the recorded dots again.
+
+__thread int journal_fd = -1;
+
+// Finds the cell with the given index in the sorted store, -1 if there is none.
+int find_cell(int idx_x, int idx_y)
+{
+	int lo = 0, hi = cells.num-1;
+	while(lo <= hi)
+	{
+		int c = (lo+hi)/2;
+		int d = (cells.idx[c][X] != idx_x)?(cells.idx[c][X]-idx_x):(cells.idx[c][Y]-idx_y);
+		if(d == 0)
+			return c;
+		if(d < 0) lo = c+1; else hi = c-1;
+	}
+	return -1;
+}
+
+// Reads the dots recorded in a journal into done[cell*MAX_WELDS_PER_POINT+dot].
+// Returns their number, 0 if there is no journal, -1 if it belongs to another job.
+// A torn last line (no newline) is not counted.
+int journal_read(const char* path, const char* header, unsigned char* done)
+{
+	FILE* f = fopen(path, "rb");
+	if(!f)
+		return 0;
+
+	char line[1000];
+	if(!fgets(line, sizeof(line), f))
+		{fclose(f); return 0;}
+	if(strcmp(line, header))
+	{
+		printf("Journal %s was written for another job: %s", path, line);
+		fclose(f);
+		return -1;
+	}
+
+	int cnt = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		int idx_x, idx_y, dot;
+		if(!strchr(line, '\n') || sscanf(line, "%d;%d;%d", &idx_x, &idx_y, &dot) != 3)
+			continue;
+		int c = find_cell(idx_x, idx_y);
+		if(c < 0 || dot < 0 || dot >= cells.num_welds[c])
+		{
+			printf("Journal %s: no dot %u on weldpoint %u;%u, ignored\n", path, dot, idx_x, idx_y);
+			continue;
+		}
+		if(!done[c*MAX_WELDS_PER_POINT+dot])
+			cnt++;
+		done[c*MAX_WELDS_PER_POINT+dot] = 1;
+	}
+	fclose(f);
+	return cnt;
+}
+
+// Closes the journal and leaves it behind, for a run that is to be continued.
+void journal_close()
+{
+	if(journal_fd < 0)
+		return;
+	close(journal_fd);
+	journal_fd = -1;
+}
+
+// Opens the journal for appending. A fresh run starts it over with the header.
+int journal_open(const char* path, const char* header, int resume)
+{
+	journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (resume?0:O_TRUNC), 0644);
+	if(journal_fd < 0)
+	{
+		printf("error %d opening journal %s: %s\n", errno, path, strerror(errno));
+		return 0;
+	}
+	if(!resume || lseek(journal_fd, 0, SEEK_END) == 0)
+	{
+		if(write(journal_fd, header, strlen(header)) != (int)strlen(header) || fsync(journal_fd) < 0)
+		{
+			printf("error %d writing journal %s: %s\n", errno, path, strerror(errno));
+			journal_close();
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void journal_record(const weldjob* job)
+{
+	if(journal_fd < 0)
+		return;
+
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), "%d;%d;%d\n", cells.idx[job->cell][X], cells.idx[job->cell][Y], job->dot);
+	if(write(journal_fd, buf, len) != len || fsync(journal_fd) < 0)
+	{
+		printf("\nerror %d writing journal: %s. Continuing without it\n", errno, strerror(errno));
+		close(journal_fd);
+		journal_fd = -1;
+	}
+}
+
+void journal_finish(const char* path)
+{
+	if(journal_fd < 0)
+		return;
+	journal_close();
+	unlink(path);
+}
+
+// Parser micro-benchmark: the mapped scanner against the line-by-line reference,
+// over the given file and over a synthetic file of BENCH_LINES lines.
+
+#define BENCH_LINES 1000000
+
+double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+int bench_one(const char* filename, int runs)
+{
+	struct stat st;
+	if(stat(filename, &st) < 0)
+	{
+		printf("Couldn't stat %s\n", filename);
+		return 0;
+	}
+
+	double t_stdio = 0.0, t_mmap = 0.0;
+	int weldpoints_stdio = 0, weldpoints_mmap = 0;
+	for(int run = 0; run < runs; run++)
+	{
+		FILE* f = fopen(filename, "rb");
+		if(!f)
+		{
+			printf("Couldn't open %s\n", filename);
+			return 0;
+		}
+		num_points[X] = num_points[Y] = 0;
+		cells.num = 0;
+		double t0 = bench_now();
+		int ok = parse_file_stdio(f);
+		t_stdio += bench_now()-t0;
+		fclose(f);
+		weldpoints_stdio = cells.num;
+
+		num_points[X] = num_points[Y] = 0;
+		cells.num = 0;
+		num_alignpoints = 0;
+		t0 = bench_now();
+		ok &= parse_file(filename);
+		t_mmap += bench_now()-t0;
+		weldpoints_mmap = cells.num;
+
+		if(!ok)
+			return 0;
+	}
+
+	double mb = st.st_size/1000000.0;
+	printf("%s: %.2f MB, %u runs, %u weldpoints on a %u x %u grid, %u alignpoints%s\n", filename, mb, runs,
+		cells.num, num_points[X], num_points[Y], num_alignpoints,
+		(weldpoints_stdio == weldpoints_mmap)?"":" (MISMATCH)");
+	printf("  fgets/sscanf  %9.3f ms/run  %8.1f MB/s\n", 1000.0*t_stdio/runs, mb*runs/t_stdio);
+	printf("  mmap scanner  %9.3f ms/run  %8.1f MB/s  (%.1fx)\n", 1000.0*t_mmap/runs, mb*runs/t_mmap, t_stdio/t_mmap);
+	return 1;
+}
+
+int bench_parse(const char* filename)
+{
+	if(!bench_one(filename, 100))
+		return 1;
+
+	// Synthetic job: the same mix of motion lines and markers as cnc_gen output.
+	char synth[] = "/tmp/weld_bench_XXXXXX";
+	int fd = mkstemp(synth);
+	if(fd < 0)
+	{
+		printf("Couldn't create a temporary file\n");
+		return 1;
+	}
+	FILE* f = fdopen(fd, "w");
+	int line = 0, dot = 0;
+	while(line < BENCH_LINES)
+	{
+		int ix = dot/100, iy = dot%100;
+		fprintf(f, "G00 X%.2f Y%.2f (WELDPOINT %u;%u;%.2f;%.2f)\n", 80.0+ix*1.75, 90.0+iy*19.0, ix, iy, 13.21+ix*1.75, 11.29+iy*19.0);
+		fprintf(f, "M03 S58\nG02 X84.12 Y97.49 I9.10 J0.00 F530.00\nM05\nG00 X84.24 Y97.49\n");
+		fprintf(f, "M03 S21\nG02 X84.24 Y97.49 I8.98 J0.00\nM05\nG04 P6.000 (cool down)\n");
+		line += 9;
+		if(++dot % 1000 == 0)
+			{fprintf(f, "G01 X10.00 Y10.00 (ALIGNPOINT 0;0;-1.00;-1.00)\n"); line++;}
+	}
+	fclose(f);
+
+	int ok = bench_one(synth, 5);
+	unlink(synth);
+	return ok?0:1;
+}
+
+// Options of a run, shared by all stations.
+typedef struct
+{
+	int n_weld_points[2];
+	int powers[2];
+	float point_distance[2];
+	int parallel_rows;
+	char start;        // '+' or '-'
+
+	int simu;
+	int midsimu;
+	int raster;
+	int plan_only;
+	int fixed_sleep;
+	int stream;
+	int resume;
+} weldopts;
+
+// A pack, or half a pack, to be welded by whichever station gets to it first.
+typedef struct
+{
+	const char* datafile;
+	int part; // -1 = the whole pack, 0/1 = the columns below/above the middle one
+} packjob;
+
+// Forgets the pack welded before on this station.
+void reset_pack()
+{
+	free(dots.cell);
+	free(dots.dot);
+	free(dots.pos);
+	memset(&dots, 0, sizeof(dots));
+	free(cells.idx);
+	free(cells.mid);
+	free(cells.num_welds);
+	free(cells.extra_power);
+	memset(&cells, 0, sizeof(cells));
+	num_points[X] = num_points[Y] = 0;
+	num_alignpoints = 0;
+}
+
+// Plans and welds one pack on the given transport (-1 when only planning).
+// Returns the number of dots welded, -1 on a fatal error.
+int weld_pack(const weldopts* opt, const packjob* pj, int automove)
+{
+	reset_pack();
+	clock_reset();
+
+	if(!parse_file(pj->datafile))
+	{
+		printf("Fatal error parsing datafile. Stop.\n");
+		return -1;
+	}
+
+	if(num_alignpoints)
+	{
+		float min[2] = {alignpoints[0].pos[X], alignpoints[0].pos[Y]};
+		float max[2] = {min[X], min[Y]};
+		for(int i = 1; i < num_alignpoints; i++)
+		{
+			for(int a = X; a <= Y; a++)
+			{
+				if(alignpoints[i].pos[a] < min[a]) min[a] = alignpoints[i].pos[a];
+				if(alignpoints[i].pos[a] > max[a]) max[a] = alignpoints[i].pos[a];
+			}
+		}
+		printf("%u alignpoints, box %.2f x %.2f mm\n", num_alignpoints, max[X]-min[X], max[Y]-min[Y]);
+	}
+
+	if(!process_file((int*)opt->n_weld_points, (float*)opt->point_distance, opt->parallel_rows, (int*)opt->powers))
 	{
 		printf("Fatal error processing weldpoints. Stop.\n");
+		return -1;
+	}
+
+	// A dry run keeps its own journal, so that it never hides a real interrupted run.
+
+	char part_name[16] = "";
+	if(pj->part >= 0)
+		snprintf(part_name, sizeof(part_name), ".half%u", pj->part);
+
+	char journal_path[1000];
+	char journal_header[1000];
+	snprintf(journal_path, sizeof(journal_path), "%s%s.%s", pj->datafile, part_name, opt->simu?"simjournal":"journal");
+	snprintf(journal_header, sizeof(journal_header), "weld %s%s %u %c %u dots\n", pj->datafile, part_name,
+		opt->parallel_rows, opt->start, dots.num);
+
+	unsigned char* done = calloc(cells.num*MAX_WELDS_PER_POINT + 1, 1);
+	if(!done)
+	{
+		printf("Out of memory\n");
+		return -1;
+	}
+
+	int num_done = journal_read(journal_path, journal_header, done);
+	if(num_done < 0)
+	{
+		free(done);
+		return -1;
+	}
+	if(num_done && !opt->resume && !opt->plan_only)
+	{
+		printf("%s shows an interrupted run with %u dots done. Use c to continue it, or remove the journal.\n",
+			journal_path, num_done);
+		free(done);
+		return -1;
+	}
+	if(opt->resume)
+	{
+		printf("Continuing: %u of %u dots done\n", num_done, dots.num);
+	}
+	else
+	{
+		memset(done, 0, cells.num*MAX_WELDS_PER_POINT);
+	}
+
+	// The jobs start in raster order, as in the dot list.
+
+	int split = (num_points[X]+1)/2;
+
+	weldjob* jobs = malloc(dots.num*sizeof(weldjob) + 1);
+	if(!jobs)
+	{
+		printf("Out of memory\n");
+		free(done);
+		return -1;
+	}
+
+	int num_jobs = 0;
+	for(int i = 0; i < dots.num; i++)
+	{
+		if(done[dots.cell[i]*MAX_WELDS_PER_POINT + dots.dot[i]])
+			continue;
+		if(pj->part >= 0 && (cells.idx[dots.cell[i]][X] >= split) != pj->part)
+			continue;
+
+		weldjob* j = &jobs[num_jobs++];
+		j->cell = dots.cell[i];
+		j->dot = dots.dot[i];
+		j->cooldown = 0.0;
+		for(int coord = 0; coord < 2; coord++)
+			j->pos[coord] = (opt->midsimu?cells.mid[j->cell][coord]:dots.pos[i][coord])
+				+ ((coord==X)?ALIGN_X:ALIGN_Y);
+	}
+	free(done);
+
+	if(!num_jobs)
+	{
+		printf("Nothing left to weld\n");
+		if(!opt->plan_only)
+			unlink(journal_path);
+		free(jobs);
 		return 0;
 	}
 
-	// Start welding.
+	int* identity = malloc(num_jobs*sizeof(int) + 1);
+	if(!identity)
+	{
+		printf("Out of memory\n");
+		free(jobs);
+		return -1;
+	}
+	for(int i = 0; i < num_jobs; i++)
+		identity[i] = i;
+
+	double raster_time = tour_time(jobs, identity, num_jobs);
+	printf("%u dots. Estimated travel time in raster order: %.1f s\n", num_jobs, raster_time);
+
+	if(!opt->raster)
+	{
+		int violations = plan_tour(jobs, num_jobs);
+		double planned_time = tour_time(jobs, identity, num_jobs);
+		printf("Estimated travel time in planned order: %.1f s (saves %.1f s, %.1f%%)\n", planned_time,
+			raster_time-planned_time, (raster_time > 0.0)?(100.0*(raster_time-planned_time)/raster_time):0.0);
+		if(violations)
+			printf("Warning: %u dots had to follow another dot on the same cell\n", violations);
+	}
+
+	if(!opt->fixed_sleep)
+	{
+		double cooldown = schedule_thermal(jobs, num_jobs, (const float (*)[2])cells.mid, cells.extra_power, cells.num);
+		int cooled = 0;
+		for(int i = 0; i < num_jobs; i++)
+			if(jobs[i].cooldown > 0.0) cooled++;
+
+		double fixed_idle = num_jobs*fixed_cooldown;
+		double thermal_idle = num_jobs*DOT_SEQUENCE_TIME + cooldown;
+		printf("Estimated travel time after thermal scheduling: %.1f s\n", tour_time(jobs, identity, num_jobs));
+		printf("Wait after dots: fixed sleep %.1f s, thermal schedule %.1f s (phases %.1f s, %u dots cooled for %.1f s). Saves %.1f s\n",
+			fixed_idle, thermal_idle, num_jobs*DOT_SEQUENCE_TIME, cooled, cooldown, fixed_idle-thermal_idle);
+	}
+	free(identity);
+
+	if(opt->plan_only)
+	{
+		free(jobs);
+		return 0;
+	}
+
+	// With several stations, a real run waits for the operator to load the pack.
+	if(num_stations > 1 && !opt->simu)
+	{
+		printf("Station %u: load %s%s, then enter g %u\n", station_index+1, pj->datafile, part_name, station_index+1);
+		while(!op_go[station_index] && !op_abort)
+			loop_wait(0.5);
+		op_go[station_index] = 0;
+		if(op_abort)
+		{
+			free(jobs);
+			return 0;
+		}
+	}
+
+	unsigned char* skipped = calloc(cells.num + 1, 1);
+	int num_skipped = 0;
+	// Streaming: the machine time of each dot, then when it is done at the latest.
+	double* done_at = malloc(num_jobs*sizeof(double) + 1);
+	if(!skipped || !done_at)
+	{
+		printf("Out of memory\n");
+		free(jobs);
+		free(skipped);
+		free(done_at);
+		return -1;
+	}
+
+	if(!journal_open(journal_path, journal_header, opt->resume))
+	{
+		free(jobs);
+		free(skipped);
+		free(done_at);
+		return -1;
+	}
 
-	int max_dots = n_weld_points[0];
-	if(n_weld_points[1] > max_dots)
-		max_dots = n_weld_points[1];
+	// Start welding.
 
 	automove_init(automove);
 
 	automove_outp(automove, 0);
-	automove_wait(automove, 0.5);
+	automove_wait(automove, 0.5, PH_SETUP);
 	automove_find_home(automove);
-	sleep(5);
+	clock_account(PH_SETUP, 4.5); // homing, the host gives it 5 s in total
+	host_sleep(5.0);
 
-	if(!simu)
+	if(!opt->simu)
 	{
 		automove_outp(automove, GAS_VALVE);
-		automove_wait(automove, 1.0);
+		automove_wait(automove, 1.0, PH_SETUP);
 		automove_outp(automove, 0);
-		sleep(2);
+		clock_account(PH_SETUP, 1.0);
+		host_sleep(2.0);
 	}
 
-	for(int dot = 0; dot < max_dots; dot++)
+	if(opt->stream)
 	{
-		for(int curx = 0; curx < num_points[X]; curx++)
+		printf("Streaming, at most one dot ahead of the controller\n");
+		streaming = 1;
+	}
+
+	volatile int* paused = &op_paused[station_index];
+	volatile int* skip = &op_skip[station_index];
+
+	int recorded = 0, flushed = 0;
+
+	int welded = 0;
+	int last_cell = -1;
+	for(int i = 0; i < num_jobs && !op_abort; i++)
+	{
+		int c = jobs[i].cell;
+		double machine_before = clock_machine();
+
+		if(*paused)
 		{
-			for(int cury = 0; cury < num_points[Y]; cury++)
-			{
-				int cmd;
-				if(points[curx][cury].state != STATE_INITIALIZED)
-					continue;
-				if(dot >= points[curx][cury].num_welds)
-					continue;
+			if(num_stations > 1)
+				printf("Station %u paused. r %u = resume, s %u = skip cell, a = abort\n", station_index+1, station_index+1, station_index+1);
+			else
+				printf("\nPaused. r = resume, s = skip cell, a = abort\n");
+			while(*paused && !op_abort)
+				loop_wait(0.5);
+			if(op_abort)
+				break;
+		}
+
+		if(*skip)
+		{
+			if(last_cell >= 0)
+				skipped[last_cell] = 1;
+			*skip = 0;
+		}
 
-				printf("x=%2u/%2u  y=%2u/%2u  dot=%u/%u   %c   \r", curx+1, num_points[X], cury+1, num_points[Y], dot+1,
-					points[curx][cury].num_welds, (points[curx][cury].extra_power)?'P':' ');
+		// The operator skipped this cell. Its dots go into the journal as well,
+		// so that a continued run does not come back to it.
+		int weld_it = !skipped[c];
+		if(weld_it)
+		{
+			if(num_stations == 1)
+			{
+				printf("%4u/%4u  x=%2u/%2u  y=%2u/%2u  dot=%u/%u   %c   \r", i+1, num_jobs,
+					cells.idx[c][X]+1, num_points[X], cells.idx[c][Y]+1, num_points[Y], jobs[i].dot+1,
+					cells.num_welds[c], (cells.extra_power[c])?'P':' ');
 				fflush(stdout);
+			}
 
-				if(midsimu)
-					automove_goto(automove, ALIGN_X+points[curx][cury].midpoint[X],
-					      ALIGN_Y+points[curx][cury].midpoint[Y]);
+			automove_goto(automove, jobs[i].pos[X], jobs[i].pos[Y]);
+			if(jobs[i].cooldown > 0.0)
+			{
+				if(streaming)
+					automove_wait(automove, jobs[i].cooldown, PH_COOLDOWN);
 				else
-					automove_goto(automove, ALIGN_X+points[curx][cury].weldpoints[dot][X],
-					      ALIGN_Y+points[curx][cury].weldpoints[dot][Y]);
-
-				cmd = Z_VALVE_UP_RELEASE;
-				if(!simu) cmd |= GAS_VALVE;
-				automove_outp(automove, cmd); // let it drop with gravity, put gas on.
-				automove_wait(automove, 0.4);
-
-				cmd = Z_VALVE_UP_RELEASE | Z_VALVE_DOWN; // apply force, keep gas on.
-				if(!simu) cmd |= GAS_VALVE;
-				if(points[curx][cury].extra_power) cmd |= EXTRA_PWR_RELAY;
-				automove_outp(automove, cmd);
-				automove_wait(automove, 0.3);
-
-				cmd = Z_VALVE_UP_RELEASE | Z_VALVE_DOWN; // Weld while applying force
-				if(!simu) cmd |= GAS_VALVE | WELDER_ON;
-				if(points[curx][cury].extra_power) cmd |= EXTRA_PWR_RELAY;
-				automove_outp(automove, cmd);
-				automove_wait(automove, 0.5); // weld stops once energy level is reached, but this is a safety timeout.
-
-				cmd = Z_VALVE_UP_RELEASE | Z_VALVE_DOWN;
-				if(!simu) cmd |= GAS_VALVE;
-				automove_outp(automove, cmd); // keep pressure and gas
-				automove_wait(automove, 0.3);
-
-				cmd = 0;
-				if(!simu) cmd |= GAS_VALVE;
-				automove_outp(automove, cmd); // keep gas for a little bit to purge smoke and cool the electrode
-				automove_wait(automove, 0.3);
-
-				automove_outp(automove, 0);  // all off, welder up.
-				sleep(3);
+				{
+					clock_account(PH_COOLDOWN, jobs[i].cooldown);
+					host_sleep(jobs[i].cooldown);
+				}
+			}
+			if(op_abort)
+				break;
+
+			automove_weld_dot(automove, cells.extra_power[c], opt->simu);
+			welded++;
+			last_cell = c;
+		}
+		else
+			num_skipped++;
+
+		if(streaming)
+		{
+			if(opt->fixed_sleep && weld_it)
+				automove_wait(automove, fixed_cooldown-DOT_SEQUENCE_TIME, PH_COOLDOWN);
+
+			done_at[i] = clock_machine() - machine_before;
+			if(i > 0)
+				host_sleep(done_at[i-1] - STREAM_LEAD - clock_now());
+			if(op_abort)
+				break;
+			if(!automove_flush(automove) || op_abort)
+				break;
+			// The controller has taken the dot, which says nothing about it being
+			// welded. It is recorded once its machine time has passed.
+			double taken = clock_now();
+			done_at[i] += (i > 0 && done_at[i-1] > taken)?done_at[i-1]:taken;
+			flushed = i+1;
+			while(recorded < flushed && done_at[recorded] + STREAM_RECORD_MARGIN <= clock_now())
+				journal_record(&jobs[recorded++]);
+			continue;
+		}
+
+		if(weld_it)
+		{
+			if(opt->fixed_sleep)
+			{
+				clock_account(PH_COOLDOWN, fixed_cooldown-DOT_SEQUENCE_TIME);
+				host_sleep(fixed_cooldown);
 			}
+			else
+				host_sleep(DOT_SEQUENCE_TIME); // the controller is still running the queued phases.
+			if(op_abort)
+				break; // the dot may not be complete, so it is not recorded
 		}
+
+		journal_record(&jobs[i]);
 	}
 
-	printf("\n");
+	// Wait for the rest of the streamed dots to be done.
+	while(recorded < flushed && !op_abort)
+	{
+		host_sleep(done_at[recorded] + STREAM_RECORD_MARGIN - clock_now());
+		while(recorded < flushed && done_at[recorded] + STREAM_RECORD_MARGIN <= clock_now())
+			journal_record(&jobs[recorded++]);
+	}
+	streaming = 0;
+	free(jobs);
+	free(skipped);
+	free(done_at);
+
+	if(num_stations == 1)
+		printf("\n");
+	if(op_abort)
+	{
+		automove_abort(automove);
+		journal_close();
+		printf("Aborted %s%s after %u dots, all outputs off. Check the last dot, then continue with c\n",
+			pj->datafile, part_name, welded);
+		clock_report();
+		return welded;
+	}
 
-	return 1;
+	if(num_skipped)
+		printf("%u dots skipped by the operator\n", num_skipped);
+	journal_finish(journal_path);
+	clock_report();
+	return welded;
+}
+
+// Stations.
+// Every station runs in a thread of its own, on its own transport, with the thread
+// local state above: store, clock, command stream, event loop and journal. The
+// packs are dealt out round robin to per-station queues. A station takes work from
+// the front of its own queue, and once that is empty, steals from the back of the
+// longest other one, so that no table stands idle while there is work left.
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	int* items;   // indices into the pack jobs
+	int head;
+	int tail;
+} jobqueue;
+
+typedef struct
+{
+	int index;
+	const char* transport_spec;
+	jobqueue queue;
+	int packs;
+	int dots;
+	double busy;  // s, projected wall time of the packs welded so far
+	int failed;
+} station;
+
+const weldopts* run_opts;
+packjob* pack_jobs;
+station* stations;
+volatile int stations_active;
+pthread_mutex_t readout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int take_job(station* st)
+{
+	int item = -1;
+	pthread_mutex_lock(&st->queue.lock);
+	if(st->queue.head < st->queue.tail)
+		item = st->queue.items[st->queue.head++];
+	pthread_mutex_unlock(&st->queue.lock);
+	if(item >= 0)
+		return item;
+
+	while(1)
+	{
+		station* victim = NULL;
+		int most = 0;
+		for(int s = 0; s < num_stations; s++)
+		{
+			if(s == st->index)
+				continue;
+			pthread_mutex_lock(&stations[s].queue.lock);
+			int left = stations[s].queue.tail - stations[s].queue.head; // may change again, checked below
+			pthread_mutex_unlock(&stations[s].queue.lock);
+			if(left > most)
+				{most = left; victim = &stations[s];}
+		}
+		if(!victim)
+			return -1;
+
+		pthread_mutex_lock(&victim->queue.lock);
+		if(victim->queue.head < victim->queue.tail)
+			item = victim->queue.items[--victim->queue.tail];
+		pthread_mutex_unlock(&victim->queue.lock);
+		if(item >= 0)
+		{
+			if(num_stations > 1)
+				printf("Station %u: took over %s from station %u\n", st->index+1, pack_jobs[item].datafile, victim->index+1);
+			return item;
+		}
+	}
+}
+
+// Combined readout: the stations work in parallel, so the run takes as long
+// as the busiest one.
+void throughput_readout()
+{
+	int dots = 0, packs = 0;
+	double span = 0.0;
+	for(int s = 0; s < num_stations; s++)
+	{
+		dots += stations[s].dots;
+		packs += stations[s].packs;
+		if(stations[s].busy > span)
+			span = stations[s].busy;
+	}
+	printf("All stations: %u packs, %u dots in ", packs, dots);
+	print_hms(span);
+	printf(", %.0f dots/h\n", (span > 0.0)?(dots*3600.0/span):0.0);
+}
+
+void* station_run(void* arg)
+{
+	station* st = arg;
+	station_index = st->index;
+
+	int automove = -1;
+	int transport_kind = TRANSPORT_NONE;
+	if(!run_opts->plan_only)
+	{
+		automove = transport_open(st->transport_spec, &transport_kind);
+		if(automove < 0)
+		{
+			st->failed = 1;
+			__sync_fetch_and_sub(&stations_active, 1);
+			return NULL;
+		}
+		if(transport_kind != TRANSPORT_SERIAL || num_stations > 1)
+			printf("Station %u transport: %s\n", st->index+1, st->transport_spec);
+
+		// A simulated run against anything but the real controller needs no real pacing.
+		if(run_opts->simu && transport_kind != TRANSPORT_SERIAL)
+		{
+			if(num_stations == 1)
+				printf("Virtual clock\n");
+			virtual_clock = 1;
+		}
+
+		loop_init(automove, num_stations == 1);
+		if(num_stations == 1)
+			printf("Commands: p = pause, r = resume, s = skip cell, a = abort\n");
+	}
+
+	int item;
+	while(!op_abort && (item = take_job(st)) >= 0)
+	{
+		const packjob* pj = &pack_jobs[item];
+		if(num_stations > 1)
+			printf("Station %u: %s%s\n", st->index+1, pj->datafile, (pj->part < 0)?"":(pj->part?" (second half)":" (first half)"));
+
+		int welded = weld_pack(run_opts, pj, automove);
+		if(welded < 0)
+		{
+			st->failed = 1;
+			continue;
+		}
+
+		pthread_mutex_lock(&readout_lock);
+		st->packs++;
+		st->dots += welded;
+		st->busy += clock_wall();
+		if(!run_opts->plan_only)
+			throughput_readout();
+		pthread_mutex_unlock(&readout_lock);
+	}
+
+	if(automove >= 0)
+		close(automove);
+	__sync_fetch_and_sub(&stations_active, 1);
+	return NULL;
+}
+
+// Splits a comma separated list in place. Returns the number of entries.
+int split_list(char* list, char*** out)
+{
+	int n = 1;
+	for(char* p = list; *p; p++)
+		if(*p == ',') n++;
+	*out = malloc(n*sizeof(char*));
+	if(!*out)
+		return 0;
+	n = 0;
+	for(char* p = strtok(list, ","); p; p = strtok(NULL, ","))
+		(*out)[n++] = p;
+	return n;
 }
 
+int main(int argc, char** argv)
+{
+	if(argc >= 2 && !strcmp(argv[1], "--bench-parse"))
+		return bench_parse((argc > 2)?argv[2]:"finalv2_bottom_main.ngc");
+
+	if(argc < 4)
+	{
+		printf("Usage: weld <weld_data_file>[,...] <parallel_rows> <+|- (start)>[s][r][t][b][p][c][h][v] [transport][,...]\n");
+		printf("       weld --bench-parse [weld_data_file]\n");
+		printf("Data file as generated from cnc_gen: use (ALIGNPOINT <idx_x>;<idx_y>;<x>;<y>)\n");
+		printf("     and (WELDPOINT <idx_x>;<idx_y>;<x>;<y>), or the <prefix>_layout.bin written next to it\n");
+		printf("num_weld_points can currently be 1...5\n");
+		printf("+|- defines whether welding starts from + (smaller weld) or - (larger weld)\n");
+		printf("s = simulate (no gas, no weld) S = simulate with midpoints\n");
+		printf("    on any transport but serial, a simulated run uses a virtual clock and finishes at once\n");
+		printf("r = weld in raster order (dot by dot over the whole pack) instead of the planned tour\n");
+		printf("t = thermal schedule instead of the fixed %.1f s sleep after every dot;\n", fixed_cooldown);
+		printf("    its heat model is not calibrated yet, try it with p first\n");
+		printf("b = stream each dot as one block and let the controller's WA queue do the timing;\n");
+		printf("    the host stays at most one dot ahead, so an abort stops after the dot being welded\n");
+		printf("p = plan only: print travel and idle time estimates and exit\n");
+		printf("c = continue an interrupted run: skip the dots in <weld_data_file>.journal (.simjournal when simulating)\n");
+		printf("h = weld every pack as two halves, which can go to different stations\n");
+		printf("v = verbose: echo every command\n");
+		printf("transport: serial:<device> (default %s), pty:<device>, file:<path> or none\n", DEFAULT_TRANSPORT);
+		printf("Several data files and transports weld the packs on one station per transport\n");
+		return 1;
+	}
+
+	weldopts opt =
+	{
+		.n_weld_points  = {3, 5},
+		.powers         = {1, 0},
+		.point_distance = {3.0, 4.0},
+		.fixed_sleep    = 1,
+	};
+
+	int halves = 0;
+	char* transport_list = DEFAULT_TRANSPORT;
+
+	opt.parallel_rows = atoi(argv[2]);
+	if(opt.parallel_rows < 1 || opt.parallel_rows > 20)
+		{printf("invalid parallel_rows\n"); return 1;}
+
+	if(argv[3][0] != '+' && argv[3][0] != '-')
+		{printf("must define start argument (+ or -)\n"); return 1;}
+	opt.start = argv[3][0];
+
+	if(argv[3][0] == '-')
+	{
+		int tmp = opt.n_weld_points[0];
+		opt.n_weld_points[0] = opt.n_weld_points[1];
+		opt.n_weld_points[1] = tmp;
+
+		tmp = opt.powers[0];
+		opt.powers[0] = opt.powers[1];
+		opt.powers[1] = tmp;
+
+		float tmpf = opt.point_distance[0];
+		opt.point_distance[0] = opt.point_distance[1];
+		opt.point_distance[1] = tmpf;
+	}
+
+
+	if(strchr(argv[3]+1, 's') || strchr(argv[3]+1, 'S'))
+		{printf("Simulation mode\n"); opt.simu = 1;}
+
+	if(strchr(argv[3]+1, 'S'))
+		opt.midsimu = 1;
+
+	if(strchr(argv[3]+1, 'r'))
+		opt.raster = 1;
+
+	if(strchr(argv[3]+1, 'p'))
+		opt.plan_only = 1;
+
+	if(strchr(argv[3]+1, 't'))
+		opt.fixed_sleep = 0;
+
+	if(strchr(argv[3]+1, 'b'))
+		opt.stream = 1;
+
+	if(strchr(argv[3]+1, 'c'))
+		opt.resume = 1;
+
+	if(strchr(argv[3]+1, 'h'))
+		halves = 1;
+
+	if(strchr(argv[3]+1, 'v'))
+		verbose = 1;
+
+	if(argc > 4)
+		transport_list = argv[4];
+
+	char** datafiles;
+	char** transports;
+	int num_packs = split_list(argv[1], &datafiles);
+	num_stations = split_list(transport_list, &transports);
+	if(num_packs < 1 || num_stations < 1)
+		{printf("no data file or transport given\n"); return 1;}
+
+	int num_items = num_packs*(halves?2:1);
+	pack_jobs = malloc(num_items*sizeof(packjob));
+	stations = calloc(num_stations, sizeof(station));
+	op_paused = calloc(num_stations, sizeof(int));
+	op_skip = calloc(num_stations, sizeof(int));
+	op_go = calloc(num_stations, sizeof(int));
+	if(!pack_jobs || !stations || !op_paused || !op_skip || !op_go)
+	{
+		printf("Out of memory\n");
+		return 0;
+	}
+
+	for(int i = 0; i < num_items; i++)
+	{
+		pack_jobs[i].datafile = datafiles[halves?i/2:i];
+		pack_jobs[i].part = halves?(i%2):-1;
+	}
+
+	for(int s = 0; s < num_stations; s++)
+	{
+		station* st = &stations[s];
+		st->index = s;
+		st->transport_spec = transports[s];
+		pthread_mutex_init(&st->queue.lock, NULL);
+		st->queue.items = malloc(num_items*sizeof(int) + 1);
+		if(!st->queue.items)
+		{
+			printf("Out of memory\n");
+			return 0;
+		}
+		for(int i = s; i < num_items; i += num_stations)
+			st->queue.items[st->queue.tail++] = i;
+	}
+
+	run_opts = &opt;
+	stations_active = num_stations;
+
+	if(num_stations == 1)
+	{
+		station_run(&stations[0]);
+	}
+	else
+	{
+		// The main thread takes the operator's commands while the stations work.
+		if(!opt.plan_only)
+		{
+			loop_init(-1, 1);
+			printf("Commands: p = pause, r = resume, s = skip cell, g = pack loaded, a = abort; add a station number to address one station\n");
+		}
+
+		pthread_t* threads = malloc(num_stations*sizeof(pthread_t));
+		if(!threads)
+		{
+			printf("Out of memory\n");
+			return 0;
+		}
+		for(int s = 0; s < num_stations; s++)
+		{
+			if(pthread_create(&threads[s], NULL, station_run, &stations[s]))
+			{
+				printf("Couldn't start station %u\n", s+1);
+				stations[s].failed = 1;
+				__sync_fetch_and_sub(&stations_active, 1);
+				threads[s] = 0;
+			}
+		}
+
+		// After an abort loop_wait() returns at once, so then just wait for the
+		// stations to bring their machines to a safe state and end.
+		while(!op_abort && __sync_add_and_fetch(&stations_active, 0) > 0)
+			loop_wait(0.2);
+
+		for(int s = 0; s < num_stations; s++)
+			if(threads[s])
+				pthread_join(threads[s], NULL);
+
+		for(int s = 0; s < num_stations; s++)
+		{
+			printf("Station %u (%s): %u packs, %u dots, busy ", s+1, stations[s].transport_spec, stations[s].packs, stations[s].dots);
+			print_hms(stations[s].busy);
+			printf("%s\n", stations[s].failed?", FAILED":"");
+		}
+		if(!opt.plan_only)
+			throughput_readout();
+	}
+
+	for(int s = 0; s < num_stations; s++)
+		if(stations[s].failed)
+			return 0;
+	return 1;
+}
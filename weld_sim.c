@@ -0,0 +1,316 @@
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <termios.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+
+// Simulates the automove controller that weld drives.
+// Opens a pseudo terminal and prints the slave name, to be given to weld as
+// pty:<name>. Parses the IN/FH/CD/WA/MA dialect, models the axis motion and
+// the controller's command queue, and reports the simulated cycle time when
+// the host closes the terminal. A captured command stream (weld ... file:<path>)
+// can be replayed with -f.
+
+#define X 0
+#define Y 1
+
+#define Z_VALVE_DOWN 2
+#define WELDER_ON 4
+#define GAS_VALVE 16
+
+#define XON  0x11
+#define XOFF 0x13
+
+// Machine model. Positions are in mils, as in the MA command.
+float axis_speed[2] = {9000.0, 9000.0};   // mil/s
+float axis_accel[2] = {40000.0, 40000.0}; // mil/s^2
+float move_settle = 0.15;                 // s, after every move
+float home_search = 2.0;                  // s, FH on top of the move to 0,0
+
+// Controller input buffer, for flow control in real time mode.
+#define QUEUE_SIZE 256
+#define QUEUE_HIGH 192
+#define QUEUE_LOW  64
+
+typedef struct
+{
+	double t;          // simulated time, s
+	double travel;
+	double wait;
+	double weld_on;
+	double gas_on;
+	int moves;
+	int dots;
+	int commands;
+	int unknown;
+	float pos[2];
+	int outputs;
+} simstate;
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+// Time for one axis to travel d with a trapezoidal (or triangular) speed profile.
+float axis_time(float d, float v, float a)
+{
+	if(d <= 0.0)
+		return 0.0;
+	if(d < v*v/a)
+		return 2.0*sqrtf(d/a);
+	return d/v + v/a;
+}
+
+float move_time(const float* from, const float* to)
+{
+	float tx = axis_time(fabsf(to[X]-from[X]), axis_speed[X], axis_accel[X]);
+	float ty = axis_time(fabsf(to[Y]-from[Y]), axis_speed[Y], axis_accel[Y]);
+	return ((tx > ty)?tx:ty) + move_settle;
+}
+
+// Advances the simulated time with the outputs held.
+void hold(simstate* st, double dt)
+{
+	st->t += dt;
+	if(st->outputs & WELDER_ON) st->weld_on += dt;
+	if(st->outputs & GAS_VALVE) st->gas_on += dt;
+}
+
+// Executes one command (without the terminating ';'). Returns its duration.
+double execute(simstate* st, char* cmd)
+{
+	while(*cmd == ' ' || *cmd == '\r' || *cmd == '\n')
+		cmd++;
+	if(*cmd == 0)
+		return 0.0;
+
+	st->commands++;
+	double dt = 0.0;
+
+	if(!strncmp(cmd, "IN", 2))
+	{
+		st->outputs = 0;
+	}
+	else if(!strncmp(cmd, "FH", 2))
+	{
+		float home[2] = {0.0, 0.0};
+		dt = move_time(st->pos, home) + home_search;
+		st->pos[X] = st->pos[Y] = 0.0;
+		hold(st, dt);
+		st->travel += dt;
+	}
+	else if(!strncmp(cmd, "CD", 2))
+	{
+		int val = atoi(cmd+2);
+		if((val & Z_VALVE_DOWN) && !(st->outputs & Z_VALVE_DOWN))
+			st->dots++;
+		st->outputs = val;
+	}
+	else if(!strncmp(cmd, "WA", 2))
+	{
+		dt = atof(cmd+2);
+		hold(st, dt);
+		st->wait += dt;
+	}
+	else if(!strncmp(cmd, "MA", 2))
+	{
+		float to[2];
+		if(sscanf(cmd+2, " %f , %f", &to[X], &to[Y]) != 2)
+		{
+			printf("Bad MA command: %s\n", cmd);
+			st->unknown++;
+			return 0.0;
+		}
+		dt = move_time(st->pos, to);
+		st->pos[X] = to[X];
+		st->pos[Y] = to[Y];
+		hold(st, dt);
+		st->travel += dt;
+		st->moves++;
+	}
+	else
+	{
+		printf("Unknown command: %s\n", cmd);
+		st->unknown++;
+	}
+
+	return dt;
+}
+
+void report(const simstate* st, double wall)
+{
+	printf("\nSimulated cycle time: %.1f s (%.2f h)\n", st->t, st->t/3600.0);
+	printf("  travel   %8.1f s  (%u moves)\n", st->travel, st->moves);
+	printf("  WA       %8.1f s\n", st->wait);
+	printf("  weld on  %8.1f s\n", st->weld_on);
+	printf("  gas on   %8.1f s\n", st->gas_on);
+	printf("%u dots, %u commands, %u unknown. Host connected for %.1f s\n", st->dots, st->commands, st->unknown, wall);
+	if(st->dots)
+		printf("%.2f s per dot\n", st->t/st->dots);
+}
+
+int main(int argc, char** argv)
+{
+	int realtime = 0;
+	const char* capture = NULL;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-r"))
+			realtime = 1;
+		else if(!strcmp(argv[i], "-f") && i+1 < argc)
+			capture = argv[++i];
+		else
+		{
+			printf("Usage: weld_sim [-r] [-f <capture_file>]\n");
+			printf("Without -f, opens a pseudo terminal for weld (use transport pty:<name>)\n");
+			printf("-r = run the queue in real time, with XON/XOFF flow control towards the host\n");
+			printf("-f = replay a command stream captured with transport file:<path>\n");
+			return 1;
+		}
+	}
+
+	simstate st;
+	memset(&st, 0, sizeof(st));
+
+	int fd;
+	if(capture)
+	{
+		fd = open(capture, O_RDONLY);
+		if(fd < 0)
+		{
+			printf("error %d opening %s: %s\n", errno, capture, strerror(errno));
+			return 1;
+		}
+		realtime = 0;
+	}
+	else
+	{
+		fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if(fd < 0 || grantpt(fd) || unlockpt(fd))
+		{
+			printf("error %d opening a pseudo terminal: %s\n", errno, strerror(errno));
+			return 1;
+		}
+
+		// Keep the slave raw until weld opens it and applies its own settings.
+		int slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+		if(slave >= 0)
+		{
+			struct termios tty;
+			if(tcgetattr(slave, &tty) == 0)
+			{
+				cfmakeraw(&tty);
+				tcsetattr(slave, TCSANOW, &tty);
+			}
+			close(slave);
+		}
+
+		printf("Simulator listening on %s  (weld <file> <rows> <start> pty:%s)\n", ptsname(fd), ptsname(fd));
+		fflush(stdout);
+	}
+
+	char queue[QUEUE_SIZE+1];
+	int queue_len = 0;
+	int connected = capture?1:0;
+	int stopped = 0;
+	double start = now();
+	double busy_until = 0.0; // real time mode: when the command being run completes
+
+	while(1)
+	{
+		// Run queued commands. In real time mode, one at a time as their time comes.
+		char* end;
+		while((end = memchr(queue, ';', queue_len)) && (!realtime || now() >= busy_until))
+		{
+			*end = 0;
+			double dt = execute(&st, queue);
+			queue_len -= end+1-queue;
+			memmove(queue, end+1, queue_len);
+			if(realtime)
+				busy_until = now() + dt;
+		}
+
+		if(realtime && !capture)
+		{
+			if(!stopped && queue_len > QUEUE_HIGH)
+				{char c = XOFF; write(fd, &c, 1); stopped = 1;}
+			else if(stopped && queue_len < QUEUE_LOW)
+				{char c = XON; write(fd, &c, 1); stopped = 0;}
+		}
+
+		if(queue_len >= QUEUE_SIZE)
+		{
+			if(!realtime)
+			{
+				printf("Command too long, dropped\n");
+				queue_len = 0;
+			}
+			else
+			{
+				// Host ignored XOFF: wait for the queue to drain instead of reading more.
+				usleep(1000);
+				continue;
+			}
+		}
+
+		int timeout = -1;
+		if(realtime && memchr(queue, ';', queue_len))
+		{
+			double left = busy_until - now();
+			timeout = (left > 0.0)?(int)(left*1000.0)+1:0;
+		}
+
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if(!capture && poll(&pfd, 1, timeout) == 0)
+			continue;
+
+		int ret = read(fd, queue+queue_len, QUEUE_SIZE-queue_len);
+		if(ret > 0)
+		{
+			if(!connected)
+			{
+				connected = 1;
+				start = now();
+			}
+			queue_len += ret;
+			continue;
+		}
+
+		if(ret < 0 && errno == EINTR)
+			continue;
+
+		// EIO on the master: no slave is open. Before the host has connected, keep waiting.
+		if(!connected && ret < 0 && errno == EIO)
+		{
+			usleep(100000);
+			continue;
+		}
+		break;
+	}
+
+	// Whatever is left in the queue still runs on the machine.
+	queue[queue_len] = 0;
+	char* cmd = queue;
+	char* end;
+	while((end = strchr(cmd, ';')))
+	{
+		*end = 0;
+		execute(&st, cmd);
+		cmd = end+1;
+	}
+
+	report(&st, now()-start);
+	close(fd);
+	return 0;
+}